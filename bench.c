@@ -0,0 +1,440 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <math.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "umalloc.h"
+
+// 多线程基准测试：每种分配器 × 每种负载 × 每个线程数在独立的子进程中运行一次，
+// 保证每次都从全新的堆开始，并由 wait4 得到该次运行的峰值 RSS。
+// 输出为 CSV：allocator,workload,threads,ops,ops_per_sec,p50_ns,p99_ns,peak_rss_kb,frag_pct
+
+// ============================= 分配器 =============================
+struct allocator {
+    const char *name;
+    int strategy;  // umalloc 的分配策略，系统 malloc 为 -1
+    void* (*alloc)(size_t);
+    void (*free)(void*);
+    void* (*realloc)(void*, size_t);
+};
+
+static const struct allocator allocators[] = {
+    {"system", -1, malloc, free, realloc},
+    {"best_fit", STRATEGY_BEST_FIT, umalloc, ufree, urealloc},
+    {"quick_fit", STRATEGY_QUICK_FIT, umalloc, ufree, urealloc},
+    {"tlsf", STRATEGY_TLSF, umalloc, ufree, urealloc},
+    {"buddy", STRATEGY_BUDDY, umalloc, ufree, urealloc},
+};
+#define ALLOCATOR_COUNT (int)(sizeof(allocators) / sizeof(allocators[0]))
+
+static const struct allocator *A;  // 子进程中正在测试的分配器
+
+
+// ============================= 辅助函数 =============================
+#define SAMPLE_MASK 15  // 每 16 次操作计时一次
+#define HIST_SUB 8  // 每个 2 的幂区间细分的桶数
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+// 每个线程的计数，结束后由主线程合并
+struct worker {
+    pthread_t thread;
+    int id;
+    uint64_t rng;
+    size_t ops;
+    size_t hist[HIST_BUCKETS];  // 抽样耗时的对数直方图 (纳秒)
+    void *arg;  // 负载私有的数据
+};
+
+static size_t ops_per_thread = 100000;
+
+static inline uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift 伪随机数，每个线程独立
+static inline uint64_t next_rand(struct worker *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+static inline int hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB) return (int)ns;
+    int msb = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (msb - 3)) & (HIST_SUB - 1);
+    return msb * HIST_SUB + sub;
+}
+
+// 桶的上界 (纳秒)
+static double hist_upper(int bucket) {
+    if (bucket < HIST_SUB) return bucket + 1;
+    int msb = bucket / HIST_SUB, sub = bucket % HIST_SUB;
+    return ldexp(1.0 + (sub + 1) / (double)HIST_SUB, msb);
+}
+
+static double hist_percentile(const size_t *hist, double q) {
+    size_t total = 0, seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) total += hist[i];
+    if (total == 0) return 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= q * total) return hist_upper(i);
+    }
+    return 0;
+}
+
+// 计时包装：抽样的操作记录耗时，其余操作直接执行
+#define TIMED(w, expr) do { \
+    if (((w)->ops++ & SAMPLE_MASK) == 0) { \
+        uint64_t t0_ = now_ns(); \
+        expr; \
+        (w)->hist[hist_bucket(now_ns() - t0_)]++; \
+    } else { \
+        expr; \
+    } \
+} while (0)
+
+// 写入对象的首尾字节，避免分配器只返回地址而不触碰内存
+static inline void touch(void *p, size_t size) {
+    if (!p) {
+        fprintf(stderr, "bench: %s allocation of %zu bytes failed\n", A->name, size);
+        exit(1);
+    }
+    ((char*)p)[0] = 1;
+    ((char*)p)[size - 1] = 1;
+}
+
+
+// ============================= 负载 =============================
+// Larson：模拟服务器，每个通道持有一组对象，随机替换其中一个 (释放 + 分配 10~1000 字节)。
+// 每轮结束后由新线程接手通道，继续释放上一个线程分配的对象 (线程的创建与跨线程释放)
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 4
+
+struct larson_lane {
+    void *slots[LARSON_SLOTS];
+    size_t sizes[LARSON_SLOTS];
+};
+
+static void* larson_round(void *arg) {
+    struct worker *w = arg;
+    struct larson_lane *lane = w->arg;
+    for (size_t i = 0; i < ops_per_thread / LARSON_ROUNDS; i++) {
+        int k = next_rand(w) % LARSON_SLOTS;
+        size_t size = 10 + next_rand(w) % 991;
+        TIMED(w, A->free(lane->slots[k]));
+        TIMED(w, lane->slots[k] = A->alloc(size));
+        touch(lane->slots[k], size);
+        lane->sizes[k] = size;
+    }
+    return NULL;
+}
+
+static void* larson_worker(void *arg) {
+    struct worker *w = arg;
+    struct larson_lane *lane = calloc(1, sizeof(*lane));
+    w->arg = lane;
+    for (int k = 0; k < LARSON_SLOTS; k++) {
+        lane->sizes[k] = 10 + next_rand(w) % 991;
+        lane->slots[k] = A->alloc(lane->sizes[k]);
+        touch(lane->slots[k], lane->sizes[k]);
+    }
+    for (int round = 0; round < LARSON_ROUNDS; round++) {
+        pthread_t t;
+        pthread_create(&t, NULL, larson_round, w);
+        pthread_join(t, NULL);
+    }
+    for (int k = 0; k < LARSON_SLOTS; k++) A->free(lane->slots[k]);
+    free(lane);
+    return NULL;
+}
+
+// 生产者/消费者：偶数号线程分配，经环形缓冲区交给奇数号线程释放；只有一个线程时自己释放
+#define PC_RING 1024
+
+struct pc_ring {
+    void *items[PC_RING];
+    size_t head, tail;
+};
+
+static void* prodcons_worker(void *arg) {
+    struct worker *w = arg;
+    struct pc_ring *ring = w->arg;
+    if (!ring) {
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            size_t size = 16 + next_rand(w) % 2033;
+            void *p;
+            TIMED(w, p = A->alloc(size));
+            touch(p, size);
+            TIMED(w, A->free(p));
+        }
+        return NULL;
+    }
+    if (w->id % 2 == 0) {
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            size_t size = 16 + next_rand(w) % 2033;
+            void *p;
+            TIMED(w, p = A->alloc(size));
+            touch(p, size);
+            while (i - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= PC_RING) sched_yield();
+            ring->items[i % PC_RING] = p;
+            __atomic_store_n(&ring->head, i + 1, __ATOMIC_RELEASE);
+        }
+    } else {
+        for (size_t i = 0; i < ops_per_thread; i++) {
+            while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == i) sched_yield();
+            void *p = ring->items[i % PC_RING];
+            TIMED(w, A->free(p));
+            __atomic_store_n(&ring->tail, i + 1, __ATOMIC_RELEASE);
+        }
+    }
+    return NULL;
+}
+
+// 幂律分布：大小服从 alpha = 1.2 的帕累托分布 (16 字节起，截断到 256 KB)，随机替换一组存活对象
+#define POWERLAW_SLOTS 2000
+
+static size_t powerlaw_size(struct worker *w) {
+    double u = ((next_rand(w) >> 11) + 1) * (1.0 / 9007199254740992.0);
+    double size = 16 * pow(u, -1 / 1.2);
+    return size > 256 * 1024 ? 256 * 1024 : (size_t)size;
+}
+
+static void* powerlaw_worker(void *arg) {
+    struct worker *w = arg;
+    void **slots = calloc(POWERLAW_SLOTS, sizeof(void*));
+    for (size_t i = 0; i < ops_per_thread; i++) {
+        int k = next_rand(w) % POWERLAW_SLOTS;
+        size_t size = powerlaw_size(w);
+        if (slots[k]) TIMED(w, A->free(slots[k]));
+        TIMED(w, slots[k] = A->alloc(size));
+        touch(slots[k], size);
+    }
+    for (int k = 0; k < POWERLAW_SLOTS; k++) A->free(slots[k]);
+    free(slots);
+    return NULL;
+}
+
+// 长短寿命混合：95% 的对象在几次操作后释放，5% 的对象长期存活并偶尔被替换，
+// 长寿对象夹在短寿对象之间，容易留下空洞
+#define LIFETIME_SHORT 16
+#define LIFETIME_LONG 4000
+
+static void* lifetime_worker(void *arg) {
+    struct worker *w = arg;
+    void *shorts[LIFETIME_SHORT] = {0};
+    void **longs = calloc(LIFETIME_LONG, sizeof(void*));
+    for (size_t i = 0; i < ops_per_thread; i++) {
+        size_t size = 32 + next_rand(w) % 4064;
+        void *p;
+        TIMED(w, p = A->alloc(size));
+        touch(p, size);
+        void **slot = (next_rand(w) % 100 < 5) ? &longs[next_rand(w) % LIFETIME_LONG] : &shorts[i % LIFETIME_SHORT];
+        if (*slot) TIMED(w, A->free(*slot));
+        *slot = p;
+    }
+    for (int k = 0; k < LIFETIME_SHORT; k++) A->free(shorts[k]);
+    for (int k = 0; k < LIFETIME_LONG; k++) A->free(longs[k]);
+    free(longs);
+    return NULL;
+}
+
+// realloc 密集：对象反复增长或缩小 (模拟动态数组和字符串拼接)，偶尔释放重来
+#define REALLOC_SLOTS 500
+
+static void* realloc_worker(void *arg) {
+    struct worker *w = arg;
+    void **slots = calloc(REALLOC_SLOTS, sizeof(void*));
+    size_t *sizes = calloc(REALLOC_SLOTS, sizeof(size_t));
+    for (size_t i = 0; i < ops_per_thread; i++) {
+        int k = next_rand(w) % REALLOC_SLOTS;
+        uint64_t r = next_rand(w) % 100;
+        if (r < 5 && slots[k]) {
+            TIMED(w, A->free(slots[k]));
+            slots[k] = NULL;
+            sizes[k] = 0;
+            continue;
+        }
+        size_t size = sizes[k] ? (r < 70 ? sizes[k] * 3 / 2 + 8 : sizes[k] / 2 + 1) : 16;
+        if (size > 64 * 1024) size = 16;
+        void *p;
+        TIMED(w, p = A->realloc(slots[k], size));
+        touch(p, size);
+        slots[k] = p;
+        sizes[k] = size;
+    }
+    for (int k = 0; k < REALLOC_SLOTS; k++) A->free(slots[k]);
+    free(slots);
+    free(sizes);
+    return NULL;
+}
+
+struct workload {
+    const char *name;
+    void* (*run)(void*);
+};
+
+static const struct workload workloads[] = {
+    {"larson", larson_worker},
+    {"prodcons", prodcons_worker},
+    {"powerlaw", powerlaw_worker},
+    {"lifetime", lifetime_worker},
+    {"realloc", realloc_worker},
+};
+#define WORKLOAD_COUNT (int)(sizeof(workloads) / sizeof(workloads[0]))
+
+
+// ============================= 运行 =============================
+// 子进程通过管道交回的结果
+struct result {
+    size_t ops;
+    double seconds;
+    double p50_ns;
+    double p99_ns;
+    double frag_pct;  // 外部碎片率，系统 malloc 为 -1
+};
+
+// 在子进程中运行一次：启动 threads 个线程，全部结束后汇总
+static struct result run_once(const struct allocator *alloc, const struct workload *load, int threads) {
+    A = alloc;
+    if (alloc->strategy >= 0) mem_init(4096, alloc->strategy);
+
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    struct pc_ring *rings = calloc(threads / 2 + 1, sizeof(struct pc_ring));
+    for (int i = 0; i < threads; i++) {
+        workers[i].id = i;
+        workers[i].rng = 0x9E3779B97F4A7C15ULL * (i + 1);
+        if (load->run == prodcons_worker && threads > 1 && !(threads % 2 && i == threads - 1)) workers[i].arg = &rings[i / 2];
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < threads; i++) pthread_create(&workers[i].thread, NULL, load->run, &workers[i]);
+    for (int i = 0; i < threads; i++) pthread_join(workers[i].thread, NULL);
+    uint64_t elapsed = now_ns() - start;
+
+    struct result r = {0};
+    static size_t hist[HIST_BUCKETS];
+    for (int i = 0; i < threads; i++) {
+        r.ops += workers[i].ops;
+        for (int b = 0; b < HIST_BUCKETS; b++) hist[b] += workers[i].hist[b];
+    }
+    r.seconds = elapsed / 1e9;
+    r.p50_ns = hist_percentile(hist, 0.5);
+    r.p99_ns = hist_percentile(hist, 0.99);
+    r.frag_pct = -1;
+    if (alloc->strategy >= 0) {
+        struct umalloc_stats stats;
+        umalloc_get_stats(&stats);
+        r.frag_pct = stats.free_bytes ? 100.0 * (stats.free_bytes - stats.largest_free) / stats.free_bytes : 0;
+    }
+    return r;
+}
+
+// 在子进程中运行并打印一行结果
+static void run_child(const struct allocator *alloc, const struct workload *load, int threads) {
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(1);
+    }
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        struct result r = run_once(alloc, load, threads);
+        if (write(fds[1], &r, sizeof(r)) != sizeof(r)) _exit(1);
+        _exit(0);
+    }
+
+    close(fds[1]);
+    struct result r;
+    ssize_t n = read(fds[0], &r, sizeof(r));
+    close(fds[0]);
+    int status;
+    struct rusage usage;
+    wait4(pid, &status, 0, &usage);
+    if (n != sizeof(r) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        printf("%s,%s,%d,FAILED\n", alloc->name, load->name, threads);
+        return;
+    }
+
+    printf("%s,%s,%d,%zu,%.0f,%.0f,%.0f,%ld,", alloc->name, load->name, threads,
+           r.ops, r.ops / r.seconds, r.p50_ns, r.p99_ns, usage.ru_maxrss);
+    if (r.frag_pct < 0) printf("NA\n");
+    else printf("%.2f\n", r.frag_pct);
+    fflush(stdout);
+}
+
+// 解析逗号分隔的名称列表，返回是否包含 name (列表为空时包含全部)
+static int selected(const char *list, const char *name) {
+    if (!list) return 1;
+    size_t len = strlen(name);
+    for (const char *p = list; *p; ) {
+        const char *end = strchr(p, ',');
+        size_t n = end ? (size_t)(end - p) : strlen(p);
+        if (n == len && strncmp(p, name, n) == 0) return 1;
+        if (!end) break;
+        p = end + 1;
+    }
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-a allocators] [-w workloads] [-t threads] [-n ops]\n", prog);
+    fprintf(stderr, "  -a  逗号分隔的分配器 (system,best_fit,quick_fit,tlsf,buddy)，默认全部\n");
+    fprintf(stderr, "  -w  逗号分隔的负载 (larson,prodcons,powerlaw,lifetime,realloc)，默认全部\n");
+    fprintf(stderr, "  -t  逗号分隔的线程数，默认 1,2,4,8\n");
+    fprintf(stderr, "  -n  每个线程的操作数，默认 100000\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    const char *alloc_list = NULL, *load_list = NULL, *thread_list = "1,2,4,8";
+    int opt;
+    while ((opt = getopt(argc, argv, "a:w:t:n:h")) != -1) {
+        switch (opt) {
+        case 'a': alloc_list = optarg; break;
+        case 'w': load_list = optarg; break;
+        case 't': thread_list = optarg; break;
+        case 'n': ops_per_thread = strtoul(optarg, NULL, 10); break;
+        default: usage(argv[0]);
+        }
+    }
+    if (ops_per_thread < LARSON_ROUNDS) usage(argv[0]);
+
+    int threads[64], thread_count = 0;
+    for (const char *p = thread_list; *p && thread_count < 64; ) {
+        int t = atoi(p);
+        if (t < 1) usage(argv[0]);
+        threads[thread_count++] = t;
+        const char *end = strchr(p, ',');
+        if (!end) break;
+        p = end + 1;
+    }
+
+    printf("allocator,workload,threads,ops,ops_per_sec,p50_ns,p99_ns,peak_rss_kb,frag_pct\n");
+    fflush(stdout);
+    for (int l = 0; l < WORKLOAD_COUNT; l++) {
+        if (!selected(load_list, workloads[l].name)) continue;
+        for (int t = 0; t < thread_count; t++) {
+            for (int a = 0; a < ALLOCATOR_COUNT; a++) {
+                if (!selected(alloc_list, allocators[a].name)) continue;
+                run_child(&allocators[a], &workloads[l], threads[t]);
+            }
+        }
+    }
+    return 0;
+}
@@ -6,7 +6,10 @@
 #include <pthread.h>
 #include <sys/wait.h>
 #include <stdint.h>
+#include <errno.h>
 #include <time.h>
+#include <sched.h>
+#include <signal.h>
 #include "umalloc.h"
 
 #define PGSIZE 4096
@@ -102,8 +105,8 @@ void test_coalescing() {
     printf("\n[Test 2] 内存合并 (Coalescing) 逻辑测试...\n");
     fragmentation_stats(); // 初始状态
 
-    // 1. 分配三个连续块 A, B, C
-    void *a = umalloc(128);
+    // 1. 分配三个连续块 A, B, C (都大于 slab 上限，从普通堆分配)
+    void *a = umalloc(400);
     void *b = umalloc(520);
     void *c = umalloc(300);
     
@@ -115,8 +118,8 @@ void test_coalescing() {
     printf("Freed A and B. C is still holding the middle.\n");
     fragmentation_stats();
 
-    // 3. 尝试分配一个 600 字节的大块，由于之前已经释放了 A 和 B，所以这个时候新申请的内存应该直接从 A 开始
-    void *d = umalloc(600); 
+    // 3. 尝试分配一个 900 字节的大块，由于之前已经释放了 A 和 B，所以这个时候新申请的内存应该直接从 A 开始
+    void *d = umalloc(900); 
     printf("Allocated D = %p\n", d);
 
     if (d == a) {
@@ -206,6 +209,23 @@ void test_performance_benchmark() {
     printf("  >> [速度测试] 完成 %d 次分配/释放\n", BENCH_COUNT * runs);
     printf("  >> 总耗时: %lu ns | 平均每轮: %lu ns\n", total_time, total_time / runs);
 
+    // 批量接口：同样的分配/释放次数，整批只获取一次锁 (600 字节走堆上的切分与合并)
+    int batch_sizes[] = {size, 600};
+    for(int k = 0; k < 2; k++) {
+        start_time = get_time_ns();
+        for(int run = 0; run < runs; run++) {
+            size_t got = umalloc_batch(batch_sizes[k], BENCH_COUNT, temp);
+            if(got != BENCH_COUNT) {
+                printf("ERROR: umalloc_batch returned %zu of %d\n", got, BENCH_COUNT);
+                exit(1);
+            }
+            memset(temp[BENCH_COUNT - 1], 0xAB, batch_sizes[k]);
+            ufree_batch(temp, got);
+        }
+        total_time = get_time_ns() - start_time;
+        printf("  >> [批量测试] %d 字节 x %d: 总耗时 %lu ns | 平均每轮: %lu ns\n", batch_sizes[k], BENCH_COUNT * runs, total_time, total_time / runs);
+    }
+
     // 2. 内存碎片测试
     printf("\n  >> 正在制造内存碎片...\n");
     
@@ -250,35 +270,96 @@ void test_performance_benchmark() {
 
     printf("  >> [最终状态] 全部释放后的内存统计 (理想应为 Used:0, 1 block):\n");
     fragmentation_stats();
+
+    // 各级操作计数和 umalloc/ufree 的耗时分布
+    profile_stats();
+}
+
+// 把 visualize_heap 的输出重定向到临时文件，逐个竞技场检查：已用与空闲之和等于总量，
+// 布局图不超过 rows 行、每行恰好 columns 个字符，且出现已用和空闲的字符
+static void check_visualization(unsigned int rows, unsigned int columns) {
+    FILE *out = tmpfile();
+    if (!out) {
+        perror("tmpfile failed");
+        exit(1);
+    }
+    fflush(stdout);
+    int saved = dup(STDOUT_FILENO);
+    dup2(fileno(out), STDOUT_FILENO);
+    visualize_heap(rows, columns);
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+    rewind(out);
+
+    char line[1024];
+    int arenas = 0;
+    unsigned int grid_rows = 0;
+    size_t used_chars = 0, free_chars = 0;
+    while (fgets(line, sizeof(line), out)) {
+        size_t total, used, free_bytes;
+        void *addr;
+        int start;
+        if (strstr(line, "MEMORY LAYOUT")) {
+            arenas++;
+            grid_rows = 0;
+        } else if (sscanf(line, "| Total: %zu  Used: %zu  Free: %zu |", &total, &used, &free_bytes) == 3) {
+            if (used + free_bytes != total) {
+                printf("ERROR: arena %d renders %zu used + %zu free of %zu bytes\n", arenas, used, free_bytes, total);
+                exit(1);
+            }
+        } else if (strncmp(line, "| 0x", 4) == 0 && sscanf(line, "| %p | %n", &addr, &start) == 1) {
+            char *cells = line + start;
+            char *end = strstr(cells, " |");
+            if (!end || (unsigned int)(end - cells) != columns || ++grid_rows > rows) {
+                printf("ERROR: bad heap map row %u in arena %d: %s", grid_rows, arenas, line);
+                exit(1);
+            }
+            for (char *c = cells; c < end; c++) {
+                if (*c == '#') used_chars++;
+                else if (*c == '.' || *c == '+') free_chars++;
+                else if (*c != ' ') {
+                    printf("ERROR: unexpected heap map character '%c'\n", *c);
+                    exit(1);
+                }
+            }
+        }
+    }
+    fclose(out);
+    if (arenas == 0 || used_chars == 0 || free_chars == 0) {
+        printf("ERROR: heap map shows %d arenas, %zu used and %zu free cells\n", arenas, used_chars, free_chars);
+        exit(1);
+    }
+    printf("  >> %u x %u: %d 个竞技场，%zu 个已用字符，%zu 个空闲字符\n", rows, columns, arenas, used_chars, free_chars);
 }
 
 void test_visualization() {
     printf("\n[Test 5] 内存可视化测试...\n");
     
     // 分配一些内存
-    // Tip: sizeof(struct mem_block) = 48, 以及需要 8 字节对齐
-    void *p1 = umalloc(100);  // 148 + 4 = 152
-    void *p2 = umalloc(200);  // 248
-    void *p3 = umalloc(50);  // 98 + 6 = 104
-    // 总共 152 + 248 + 104 = 504 字节
-    
-    // 详细可视化
-    visualize_memory();
+    // Tip: sizeof(struct mem_block) = 16, 以及需要 16 字节对齐；不超过 256 字节的申请走 slab，不出现在布局中
+    void *p1 = umalloc(300);  // 316 + 4 = 320
+    void *p2 = umalloc(400);  // 416 + 0 = 416
+    void *p3 = umalloc(280);  // 296 + 8 = 304
+    // 总共 320 + 416 + 304 = 1040 字节
+    check_visualization(16, 32);
     
     // 释放一些制造碎片
     ufree(p2);
-    visualize_memory();
+    check_visualization(16, 32);
     
     // 再分配
     void *p4 = umalloc(300);
     void *p5 = umalloc(450);
-    visualize_memory();
+    check_visualization(16, 32);
+    check_visualization(4, 64);  // 更粗的分辨率
     
     // 清理
     ufree(p1);
     ufree(p3);
     ufree(p4);
     ufree(p5);
+    printf("内存可视化测试完成。\n");
 }
 
 void* thread_worker(void* arg) {
@@ -316,17 +397,865 @@ void test_concurrent_threads() {
     printf("并发线程测试完成。\n");
 }
 
+// 生产者/消费者：一个线程分配，另一个线程释放，释放全部是跨线程的远程释放
+#define PC_ITEMS 100000  // 传递的块数
+#define PC_RING 1024  // 环形缓冲区容量
+static void *pc_ring[PC_RING];
+static size_t pc_head, pc_tail;  // 生产者写 head，消费者写 tail
+
+static size_t pc_size(size_t i) {
+    static const size_t sizes[] = {64, 512, 2048};  // slab、线程缓存和普通堆三条路径
+    return sizes[i % 3];
+}
+
+void* producer_worker(void* arg) {
+    (void)arg;
+    for (size_t i = 0; i < PC_ITEMS; i++) {
+        char *p = umalloc(pc_size(i));
+        if (!p) {
+            printf("ERROR: producer umalloc failed\n");
+            exit(1);
+        }
+        p[0] = (char)i;
+        while (i - __atomic_load_n(&pc_tail, __ATOMIC_ACQUIRE) >= PC_RING) sched_yield();  // 缓冲区满
+        pc_ring[i % PC_RING] = p;
+        __atomic_store_n(&pc_head, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void* consumer_worker(void* arg) {
+    (void)arg;
+    for (size_t i = 0; i < PC_ITEMS; i++) {
+        while (__atomic_load_n(&pc_head, __ATOMIC_ACQUIRE) == i) sched_yield();  // 缓冲区空
+        char *p = pc_ring[i % PC_RING];
+        if (p[0] != (char)i) {
+            printf("ERROR: DATA CORRUPTION at %p in producer/consumer test\n", (void*)p);
+            exit(1);
+        }
+        ufree(p);
+        __atomic_store_n(&pc_tail, i + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+void test_producer_consumer() {
+    printf("\n[Test 7] 生产者/消费者 (跨线程释放) 测试...\n");
+    pthread_t producer, consumer;
+    pc_head = pc_tail = 0;
+
+    // 同时录制分配记录，结束后核对事件
+    const char *trace_path = "/tmp/memtest.trace";
+    if (umalloc_trace_start(trace_path) != 0) {
+        perror("umalloc_trace_start failed");
+        exit(1);
+    }
+
+    uint64_t start_time = get_time_ns();
+    if (pthread_create(&consumer, NULL, consumer_worker, NULL) != 0 ||
+        pthread_create(&producer, NULL, producer_worker, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+
+    // 主线程同时不加锁地读取统计快照，每个竞技场的数据应当自洽
+    size_t samples = 0;
+    while (__atomic_load_n(&pc_tail, __ATOMIC_ACQUIRE) < PC_ITEMS) {
+        struct umalloc_stats stats;
+        umalloc_get_stats(&stats);
+        if (stats.used_bytes + stats.free_bytes > stats.total_bytes || stats.largest_free > stats.free_bytes) {
+            printf("ERROR: inconsistent stats snapshot (used %zu, free %zu, total %zu)\n",
+                   stats.used_bytes, stats.free_bytes, stats.total_bytes);
+            exit(1);
+        }
+        samples++;
+        sched_yield();
+    }
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    uint64_t total_time = get_time_ns() - start_time;
+    umalloc_trace_stop();
+    printf("  >> 运行期间读取统计快照 %zu 次\n", samples);
+
+    // 两个线程的事件：每个块一次分配、一次释放，且释放记录在分配之后
+    FILE *f = fopen(trace_path, "rb");
+    struct umalloc_trace_header header;
+    struct umalloc_trace_event e;
+    size_t mallocs = 0, frees = 0;
+    uint32_t threads = 0;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || header.magic != UMALLOC_TRACE_MAGIC) {
+        printf("ERROR: bad trace header in %s\n", trace_path);
+        exit(1);
+    }
+    while (fread(&e, sizeof(e), 1, f) == 1) {
+        if (e.op == UMALLOC_TRACE_MALLOC) mallocs++;
+        else if (e.op == UMALLOC_TRACE_FREE) frees++;
+        threads |= 1u << (e.thread % 32);
+    }
+    fclose(f);
+    unlink(trace_path);
+    if (mallocs != PC_ITEMS || frees != PC_ITEMS || __builtin_popcount(threads) != 2) {
+        printf("ERROR: trace has %zu mallocs and %zu frees from %d threads, expected %d each from 2\n",
+               mallocs, frees, __builtin_popcount(threads), PC_ITEMS);
+        exit(1);
+    }
+    printf("  >> 分配记录: %zu 次分配, %zu 次释放\n", mallocs, frees);
+
+    printf("  >> 传递 %d 个块 | 总耗时: %lu ns | 平均每块: %lu ns\n",
+           PC_ITEMS, (unsigned long)total_time, (unsigned long)(total_time / PC_ITEMS));
+    fragmentation_stats();
+    printf("生产者/消费者测试完成。\n");
+}
+
+// 私有堆：每帧分配大量对象后整体重置，重置后从头复用同一段内存
+#define HEAP_FRAMES 10
+#define HEAP_OBJECTS 10000
+void test_private_heap() {
+    printf("\n[Test 8] 私有堆重置测试...\n");
+    static void *objs[HEAP_OBJECTS];
+    allocation_strategy strategies[] = {STRATEGY_BEST_FIT, STRATEGY_QUICK_FIT, STRATEGY_TLSF, STRATEGY_BUDDY};
+    const char *names[] = {"best_fit", "quick_fit", "tlsf", "buddy"};
+
+    for (int s = 0; s < 4; s++) {
+        uheap_t *heap = uheap_create(64 * 1024, strategies[s]);
+        if (!heap) {
+            printf("ERROR: uheap_create failed\n");
+            exit(1);
+        }
+        void *base = uheap_alloc(heap, 100);  // 空堆的第一个对象
+        uheap_free(heap, base);
+
+        uint64_t reset_time = 0;
+        for (int frame = 0; frame < HEAP_FRAMES; frame++) {
+            for (int i = 0; i < HEAP_OBJECTS; i++) {
+                int size = (rand() % 2000) + 1;
+                objs[i] = uheap_alloc(heap, size);
+                if (!objs[i]) {
+                    printf("ERROR: uheap_alloc failed in frame %d\n", frame);
+                    exit(1);
+                }
+                memset(objs[i], (char)i, size);
+                if (i % 3 == 0) {
+                    uheap_free(heap, objs[i]);  // 帧内也可以单独释放
+                    objs[i] = NULL;
+                }
+            }
+            for (int i = 0; i < HEAP_OBJECTS; i++) {
+                if (objs[i]) check_data_integrity(objs[i], 1, (char)i);
+            }
+
+            uint64_t start = get_time_ns();
+            uheap_reset(heap);
+            reset_time += get_time_ns() - start;
+
+            // 重置后堆又是一整块空闲内存，第一个对象落在同一个位置。
+            // 伙伴系统把空闲内存按已提交的大小拆分，第一帧扩展堆之后位置才固定
+            void *p = uheap_alloc(heap, 100);
+            if (frame == 0 && strategies[s] == STRATEGY_BUDDY) base = p;
+            if (p != base) {
+                printf("ERROR: reset heap returned %p instead of %p\n", p, base);
+                exit(1);
+            }
+            uheap_free(heap, p);
+        }
+        uheap_destroy(heap);
+        printf("  >> %s: %d 帧 × %d 个对象，平均每次重置 %lu ns\n", names[s],
+               HEAP_FRAMES, HEAP_OBJECTS, (unsigned long)(reset_time / HEAP_FRAMES));
+    }
+
+    // 重复释放：第二次释放的块可能在延迟合并链表中，或已被合并进前一个块，都应被忽略
+    umallopt(UMALLOC_OPT_DEFER_COALESCE, 50);
+    for (int s = 0; s < 4; s++) {
+        uheap_t *heap = uheap_create(64 * 1024, strategies[s]);
+        void *a = uheap_alloc(heap, 1000);
+        void *b = uheap_alloc(heap, 1000);
+        void *c = uheap_alloc(heap, 1000);
+        for (int round = 0; round < 2; round++) {
+            if (round == 0) {
+                uheap_free(heap, b);
+                uheap_free(heap, b);
+            } else {
+                uheap_free(heap, a);
+                uheap_free(heap, b);  // 不延迟合并时 b 并入 a
+                uheap_free(heap, b);
+            }
+            a = uheap_alloc(heap, 1000);
+            b = uheap_alloc(heap, 1000);
+            if (!a || !b || a == b || a == c || b == c) {
+                printf("ERROR: %s double free returned %p and %p (live %p)\n", names[s], a, b, c);
+                exit(1);
+            }
+            memset(a, 1, 1000);
+            memset(b, 2, 1000);
+            memset(c, 3, 1000);
+            check_data_integrity(a, 1000, 1);
+            check_data_integrity(b, 1000, 2);
+        }
+        uheap_destroy(heap);
+    }
+    umallopt(UMALLOC_OPT_DEFER_COALESCE, 0);
+
+    // 句柄为 NULL 时使用默认堆
+    void *p = uheap_alloc(NULL, 100);
+    if (!p) {
+        printf("ERROR: uheap_alloc on the default heap failed\n");
+        exit(1);
+    }
+    uheap_free(NULL, p);
+    printf("私有堆测试完成。\n");
+}
+
+// 延迟合并：同样大小反复分配/释放时，释放的块不合并，下次分配直接复用
+#define DEFER_OBJECTS 100
+#define DEFER_SIZE 2000  // 大于线程缓存的上限，直接在堆上分配和释放
+void test_deferred_coalescing(allocation_strategy strategy) {
+    printf("\n[Test 9] 延迟合并测试...\n");
+    if (strategy != STRATEGY_QUICK_FIT) {
+        printf("  >> 仅快速适配支持延迟合并，跳过\n");
+        return;
+    }
+    static void *objs[DEFER_OBJECTS];
+    struct umalloc_stats stats;
+
+    for (int defer = 0; defer <= 1; defer++) {
+        umallopt(UMALLOC_OPT_DEFER_COALESCE, defer ? 100 : 0);
+        uint64_t start = get_time_ns();
+        for (int run = 0; run < 100; run++) {
+            for (int i = 0; i < DEFER_OBJECTS; i++) {
+                objs[i] = umalloc(DEFER_SIZE);
+                if (!objs[i]) {
+                    printf("ERROR: umalloc failed with deferred coalescing %s\n", defer ? "on" : "off");
+                    exit(1);
+                }
+                check_data_integrity(objs[i], 16, (char)i);
+            }
+            for (int i = 0; i < DEFER_OBJECTS; i++) ufree(objs[i]);
+        }
+        uint64_t total_time = get_time_ns() - start;
+        umalloc_get_stats(&stats);
+        printf("  >> 延迟合并%s: %d 次分配/释放耗时 %lu ns，等待合并 %zu 块，批量合并 %zu 次\n", defer ? "开启" : "关闭",
+               DEFER_OBJECTS * 100, (unsigned long)total_time, stats.deferred_blocks, stats.coalesce_passes);
+        if (defer && stats.deferred_blocks == 0 && stats.coalesce_passes == 0) {
+            printf("ERROR: no block was deferred\n");
+            exit(1);
+        }
+    }
+
+    // 回收前会合并所有延迟的块
+    umallopt(UMALLOC_OPT_DEFER_COALESCE, 0);
+    umalloc_purge();
+    umalloc_get_stats(&stats);
+    if (stats.deferred_blocks != 0 || stats.deferred_bytes != 0) {
+        printf("ERROR: %zu blocks still deferred after purge\n", stats.deferred_blocks);
+        exit(1);
+    }
+    fragmentation_stats();
+    printf("延迟合并测试完成。\n");
+}
+
+// CPU 缓存：多个线程 (多于 CPU 数时相互抢占) 分配释放 slab 和线程缓存范围内的对象，
+// 关闭并回收后已用字节数应回到测试前的值
+#define CPU_THREADS 8
+#define CPU_OBJECTS 64
+#define CPU_ROUNDS 20000
+
+void* cpu_cache_worker(void* arg) {
+    int id = *(int*)arg;
+    void *objs[CPU_OBJECTS] = {0};
+    int sizes[CPU_OBJECTS];
+    for (int r = 0; r < CPU_ROUNDS; r++) {
+        int i = (r * 7 + id) % CPU_OBJECTS;
+        if (objs[i]) {
+            check_data_integrity(objs[i], sizes[i], (char)(i + id));
+            ufree(objs[i]);
+        }
+        sizes[i] = 8 + (r * 37 + id * 101) % 1000;  // 覆盖 slab 和线程缓存的大小范围
+        objs[i] = umalloc(sizes[i]);
+        if (!objs[i]) {
+            printf("ERROR: umalloc(%d) failed with CPU caches\n", sizes[i]);
+            exit(1);
+        }
+        memset(objs[i], (char)(i + id), sizes[i]);
+    }
+    for (int i = 0; i < CPU_OBJECTS; i++) {
+        check_data_integrity(objs[i], sizes[i], (char)(i + id));
+        ufree(objs[i]);
+    }
+    return NULL;
+}
+
+void test_cpu_cache() {
+    printf("\n[Test 10] CPU 缓存测试...\n");
+    struct umalloc_stats stats;
+    umalloc_purge();
+    umalloc_get_stats(&stats);
+    size_t used = stats.used_bytes;
+
+    if (umallopt(UMALLOC_OPT_PERCPU_CACHE, 1) != 0) {
+        printf("ERROR: cannot enable CPU caches\n");
+        exit(1);
+    }
+    umalloc_get_stats(&stats);
+    if (stats.cpu_caches == 0) {
+        printf("ERROR: CPU caches not reported\n");
+        exit(1);
+    }
+    printf("  >> %u 个 CPU 缓存，使用 %s\n", stats.cpu_caches, stats.cpu_cache_rseq ? "rseq" : "sched_getcpu");
+
+    pthread_t threads[CPU_THREADS];
+    int tids[CPU_THREADS];
+    uint64_t start = get_time_ns();
+    for (int i = 0; i < CPU_THREADS; i++) {
+        tids[i] = i;
+        if (pthread_create(&threads[i], NULL, cpu_cache_worker, &tids[i]) != 0) {
+            perror("pthread_create failed");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < CPU_THREADS; i++) pthread_join(threads[i], NULL);
+    printf("  >> %d 个线程各 %d 次分配/释放耗时 %lu ns\n", CPU_THREADS, CPU_ROUNDS, (unsigned long)(get_time_ns() - start));
+
+    umallopt(UMALLOC_OPT_PERCPU_CACHE, 0);
+    umalloc_purge();
+    umalloc_get_stats(&stats);
+    if (stats.cpu_caches != 0 || stats.used_bytes != used) {
+        printf("ERROR: %zu bytes used after draining CPU caches, expected %zu\n", stats.used_bytes, used);
+        exit(1);
+    }
+    fragmentation_stats();
+    printf("CPU 缓存测试完成。\n");
+}
+
+// 透明大页与预热：预热后首次写入不再缺页，应明显快于未预热时。
+// 系统允许透明大页时，预热后的堆应有大页覆盖，归还 (解除提交) 后重新增长的堆也不应失去大页
+#define WARM_SIZE (32 * 1024 * 1024)
+#define WARM_OBJECTS 256  // 每个对象 WARM_SIZE / WARM_OBJECTS 字节，在堆中分配
+#define HUGEPAGE_SLACK (4 * 1024 * 1024)  // 区域开头和解除提交时保留的尾部大页可能仍按 4 KB 页驻留
+
+// 系统是否允许透明大页 (/sys/kernel/mm/transparent_hugepage/enabled 不是 never)
+static int hugepage_enabled() {
+    char mode[64] = "";
+    FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+    if (!f) return 0;
+    if (!fgets(mode, sizeof(mode), f)) mode[0] = '\0';
+    fclose(f);
+    return mode[0] != '\0' && !strstr(mode, "[never]");
+}
+
+// 分配 WARM_OBJECTS 个对象并写入，返回耗时 (ns)
+static uint64_t hugepage_fill(void **objs, size_t size) {
+    uint64_t start = get_time_ns();
+    for (int i = 0; i < WARM_OBJECTS; i++) {
+        objs[i] = umalloc(size);
+        if (!objs[i]) {
+            printf("ERROR: umalloc(%zu) failed\n", size);
+            exit(1);
+        }
+        memset(objs[i], i, size);
+    }
+    return get_time_ns() - start;
+}
+
+static void hugepage_release(void **objs, size_t size) {
+    for (int i = 0; i < WARM_OBJECTS; i++) {
+        check_data_integrity(objs[i], size, (char)i);
+        ufree(objs[i]);
+    }
+}
+
+void test_hugepage_prefault() {
+    printf("\n[Test 11] 透明大页与预热测试...\n");
+    static void *objs[WARM_OBJECTS];
+    size_t size = WARM_SIZE / WARM_OBJECTS - 64;
+    umallopt(UMALLOC_OPT_MMAP_THRESHOLD, WARM_SIZE);  // 保证对象都在堆中
+
+    size_t warm_huge = 0;
+    for (int warm = 0; warm <= 1; warm++) {
+        umallopt(UMALLOC_OPT_HUGEPAGE, warm);
+        umalloc_purge();  // 归还上一轮的页，两轮都从未驻留的堆开始
+        if (warm && umalloc_prefault(WARM_SIZE) != 0) {
+            printf("ERROR: umalloc_prefault failed\n");
+            exit(1);
+        }
+        uint64_t total_time = hugepage_fill(objs, size);
+        warm_huge = umalloc_hugepage_bytes();
+        printf("  >> %s: 分配并写入 %d MB 耗时 %lu ns，大页 %zu 字节\n", warm ? "大页 + 预热" : "未预热",
+               WARM_SIZE >> 20, (unsigned long)total_time, warm_huge);
+        hugepage_release(objs, size);
+    }
+
+    // 归还后堆尾被解除提交，重新增长时新提交的部分仍应使用大页
+    umalloc_purge();
+    hugepage_fill(objs, size);
+    size_t regrow_huge = umalloc_hugepage_bytes();
+    printf("  >> 归还后重新增长：大页 %zu 字节\n", regrow_huge);
+    hugepage_release(objs, size);
+
+    if (hugepage_enabled()) {
+        if (warm_huge == 0) {
+            printf("ERROR: no huge page coverage after prefault\n");
+            exit(1);
+        }
+        // 预热轮次还包含额外提交的空闲堆，只比较两轮都写入的 WARM_SIZE 字节
+        size_t expected = warm_huge < WARM_SIZE ? warm_huge : WARM_SIZE;
+        if (regrow_huge + HUGEPAGE_SLACK < expected) {
+            printf("ERROR: huge page coverage dropped from %zu to %zu bytes after purge and regrow\n", warm_huge, regrow_huge);
+            exit(1);
+        }
+    } else {
+        printf("  >> 系统未启用透明大页，跳过大页覆盖检查\n");
+    }
+
+    fragmentation_stats();
+    umallopt(UMALLOC_OPT_HUGEPAGE, 0);
+    umallopt(UMALLOC_OPT_MMAP_THRESHOLD, 128 * 1024);
+    printf("透明大页与预热测试完成。\n");
+}
+
+// 尾部空闲块复用：区域尾部留下一个恰好放得下下一次申请的空闲块，之后的分配应使用它或在同一区域内扩展，
+// 而不是预留新的区域 (TLSF 按上取整后的级别查找时会跳过它)
+#define TAIL_ALLOCS 8
+
+void test_tail_reuse(allocation_strategy strategy) {
+    printf("\n[Test 12] 尾部空闲块复用测试...\n");
+    uheap_t *heap = uheap_create(4096, strategy);
+    if (!heap) {
+        printf("ERROR: uheap_create failed\n");
+        exit(1);
+    }
+    void *first = uheap_alloc(heap, 1008);  // 初始区域剩下约 3 KB 的尾部空闲块
+    for (int i = 0; i < TAIL_ALLOCS; i++) {
+        void *p = uheap_alloc(heap, 3008);
+        if (!p) {
+            printf("ERROR: uheap_alloc failed\n");
+            exit(1);
+        }
+        if ((uintptr_t)p >> 30 != (uintptr_t)first >> 30) {
+            printf("ERROR: allocation %d reserved a new region (%p, first %p)\n", i, p, first);
+            exit(1);
+        }
+    }
+    uheap_destroy(heap);
+    printf("尾部空闲块复用测试完成。\n");
+}
+
+#define BATCH_DUP 4
+#define BATCH_DUP_SIZE 20000  // 在堆中分配，不进入线程缓存
+
+// 重复释放：第二次 ufree 应被忽略，之后两次分配不能得到同一地址。
+// 槽位和块先进入线程缓存 (或 CPU 缓存)，检查不能只看 run 的位图和堆的空闲标志
+void test_double_free() {
+    printf("\n[Test 13] 重复释放测试...\n");
+    size_t sizes[] = {32, 200, 600, 2048};
+    for (int percpu = 0; percpu <= 1; percpu++) {
+        umallopt(UMALLOC_OPT_PERCPU_CACHE, percpu);
+        for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+            void *p = umalloc(sizes[i]);
+            ufree(p);
+            ufree(p);
+            void *a = umalloc(sizes[i]);
+            void *b = umalloc(sizes[i]);
+            if (a == b) {
+                printf("ERROR: double free of %zu bytes (%s) returned %p twice\n", sizes[i], percpu ? "CPU cache" : "thread cache", a);
+                exit(1);
+            }
+            ufree(a);
+            ufree(b);
+        }
+    }
+    umallopt(UMALLOC_OPT_PERCPU_CACHE, 0);
+
+    // 批量释放时相邻的块拼接成一个空闲块，之后另一次 ufree_batch 再释放其中一个也要被忽略：
+    // 被误当作已分配块释放时已用内存会再减少一次
+    struct umalloc_stats stats;
+    void *batch[BATCH_DUP];
+    umalloc_get_stats(&stats);
+    size_t used = stats.used_bytes;
+    if (umalloc_batch(BATCH_DUP_SIZE, BATCH_DUP, batch) != BATCH_DUP) {
+        printf("ERROR: umalloc_batch failed\n");
+        exit(1);
+    }
+    ufree_batch(batch, BATCH_DUP);
+    for (int i = 1; i < BATCH_DUP; i++) ufree_batch(&batch[i], 1);
+    umalloc_get_stats(&stats);
+    if (stats.used_bytes != used) {
+        printf("ERROR: %zu bytes used after a batch double free, expected %zu\n", stats.used_bytes, used);
+        exit(1);
+    }
+    printf("重复释放测试完成。\n");
+}
+
+// 在子进程中用错误的大小释放，开启 UMALLOC_OPT_CHECK_SIZED 时子进程应当 abort
+static void sized_free_mismatch(size_t size, size_t wrong) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        freopen("/dev/null", "w", stderr);  // 屏蔽预期的报错信息
+        void *p = umalloc(size);
+        ufree_sized(p, wrong);
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT) {
+        printf("ERROR: ufree_sized(%zu) of a %zu-byte object was not detected\n", wrong, size);
+        exit(1);
+    }
+}
+
+void test_sized_free() {
+    printf("\n[Test 14] 带大小释放测试...\n");
+    // 槽位、堆中的块、独立映射的大对象
+    size_t sizes[] = {64, 2000, 256 * 1024};
+    umallopt(UMALLOC_OPT_CHECK_SIZED, 1);
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        // 正确的大小：释放后同样大小的申请能正常使用
+        for (int round = 0; round < 3; round++) {
+            char *p = umalloc(sizes[i]);
+            memset(p, 0x5A, sizes[i]);
+            check_data_integrity(p, sizes[i], 0x5A);
+            ufree_sized(p, sizes[i]);
+        }
+        // urealloc 之后按新的大小释放
+        char *p = umalloc(sizes[i]);
+        p = urealloc(p, sizes[i] + 8);
+        ufree_sized(p, sizes[i] + 8);
+
+        sized_free_mismatch(sizes[i], sizes[i] * 2);
+    }
+    sized_free_mismatch(2000, 1999);  // 同一缓存级别内的错误大小也要发现
+    umallopt(UMALLOC_OPT_CHECK_SIZED, 0);
+    printf("带大小释放测试完成。\n");
+}
+
+void test_heap_map() {
+    printf("\n[Test 15] 堆布局导出测试...\n");
+    // 大于线程缓存上限、小于大对象阈值的块留在堆中，导出时带有申请大小
+    size_t sizes[] = {3000, 5000, 7777};
+    void *ptrs[3];
+    int found[3] = {0};
+    for (int i = 0; i < 3; i++) ptrs[i] = umalloc(sizes[i]);
+
+    // 二进制格式：逐个区域读回，块大小之和等于区域大小，已知的分配能按地址找到且申请大小一致
+    const char *map_path = "/tmp/memtest.map";
+    if (umalloc_heap_map(map_path, UMALLOC_MAP_BINARY) != 0) {
+        perror("umalloc_heap_map failed");
+        exit(1);
+    }
+    FILE *f = fopen(map_path, "rb");
+    struct umalloc_map_header header;
+    if (!f || fread(&header, sizeof(header), 1, f) != 1 || header.magic != UMALLOC_MAP_MAGIC || header.region_count == 0) {
+        printf("ERROR: bad heap map header\n");
+        exit(1);
+    }
+    for (uint32_t r = 0; r < header.region_count; r++) {
+        struct umalloc_map_region region;
+        struct umalloc_map_block block;
+        if (fread(&region, sizeof(region), 1, f) != 1) {
+            printf("ERROR: truncated heap map\n");
+            exit(1);
+        }
+        uint64_t addr = region.start;
+        for (uint64_t i = 0; i < region.block_count; i++) {
+            if (fread(&block, sizeof(block), 1, f) != 1) {
+                printf("ERROR: truncated heap map in region %u\n", r);
+                exit(1);
+            }
+            uint64_t size = block.size & ~15UL;
+            for (int j = 0; j < 3; j++) {
+                uint64_t p = (uintptr_t)ptrs[j];
+                if (p <= addr || p >= addr + size) continue;
+                if ((block.size & 1) || block.requested != sizes[j]) {
+                    printf("ERROR: heap map block at %#lx records %lu bytes, expected %zu\n", (unsigned long)addr, (unsigned long)block.requested, sizes[j]);
+                    exit(1);
+                }
+                found[j] = 1;
+            }
+            addr += size;
+        }
+        if (addr - region.start != region.size) {
+            printf("ERROR: heap map region %u covers %lu of %lu bytes\n", r, (unsigned long)(addr - region.start), (unsigned long)region.size);
+            exit(1);
+        }
+    }
+    if (fgetc(f) != EOF) {
+        printf("ERROR: trailing data after heap map regions\n");
+        exit(1);
+    }
+    fclose(f);
+    for (int j = 0; j < 3; j++) {
+        if (!found[j]) {
+            printf("ERROR: %zu-byte block %p missing from heap map\n", sizes[j], ptrs[j]);
+            exit(1);
+        }
+    }
+
+    // JSON 格式：已分配块记为 [大小, 0, 申请大小]
+    if (umalloc_heap_map(map_path, UMALLOC_MAP_JSON) != 0) {
+        perror("umalloc_heap_map failed");
+        exit(1);
+    }
+    static char json[1 << 20];
+    f = fopen(map_path, "r");
+    size_t len = f ? fread(json, 1, sizeof(json) - 1, f) : 0;
+    json[len] = 0;
+    if (f) fclose(f);
+    if (strncmp(json, "{\"regions\": [", 13) != 0 || len == 0 || json[len - 2] != '}') {
+        printf("ERROR: bad heap map JSON\n");
+        exit(1);
+    }
+    for (int j = 0; j < 3; j++) {
+        char entry[32];
+        snprintf(entry, sizeof(entry), ",0,%zu]", sizes[j]);
+        if (!strstr(json, entry)) {
+            printf("ERROR: %zu-byte block missing from heap map JSON\n", sizes[j]);
+            exit(1);
+        }
+    }
+    unlink(map_path);
+
+    for (int i = 0; i < 3; i++) ufree(ptrs[i]);
+    printf("堆布局导出测试完成。\n");
+}
+
+// 清零与对齐分配：ucalloc 复用的块也要清零并拒绝溢出的大小；ualigned_alloc 在 slab、堆和直接映射三条路径上都要对齐
+void test_calloc_aligned() {
+    printf("\n[Test 16] 清零与对齐分配测试...\n");
+    // 槽位、堆中的块、独立映射的大对象
+    size_t sizes[] = {64, 2000, 256 * 1024};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        char *p = umalloc(sizes[i]);
+        memset(p, 0xAB, sizes[i]);
+        ufree(p);
+        unsigned char *q = ucalloc(1, sizes[i]);  // 通常复用刚释放的块
+        if (!q) {
+            printf("ERROR: ucalloc(1, %zu) failed\n", sizes[i]);
+            exit(1);
+        }
+        for (size_t j = 0; j < sizes[i]; j++) {
+            if (q[j] != 0) {
+                printf("ERROR: ucalloc(1, %zu) byte %zu is %#x\n", sizes[i], j, q[j]);
+                exit(1);
+            }
+        }
+        if (umalloc_usable_size(q) < sizes[i]) {
+            printf("ERROR: usable size %zu of ucalloc(1, %zu)\n", umalloc_usable_size(q), sizes[i]);
+            exit(1);
+        }
+        ufree(q);
+    }
+    if (ucalloc(SIZE_MAX / 2, 4) != NULL) {
+        printf("ERROR: ucalloc accepted an overflowing size\n");
+        exit(1);
+    }
+
+    // 阈值为 64 时小的对齐申请也超过映射阈值
+    size_t alignments[] = {32, 64, 4096, 16384};
+    size_t lengths[] = {1, 200, 5000};
+    size_t thresholds[] = {128 * 1024, 64};
+    for (int t = 0; t < 2; t++) {
+        umallopt(UMALLOC_OPT_MMAP_THRESHOLD, thresholds[t]);
+        for (size_t i = 0; i < sizeof(alignments) / sizeof(alignments[0]); i++) {
+            for (size_t j = 0; j < sizeof(lengths) / sizeof(lengths[0]); j++) {
+                char *p = ualigned_alloc(alignments[i], lengths[j]);
+                if (!p || (uintptr_t)p % alignments[i] != 0) {
+                    printf("ERROR: ualigned_alloc(%zu, %zu) returned %p (threshold %zu)\n", alignments[i], lengths[j], p, thresholds[t]);
+                    exit(1);
+                }
+                if (umalloc_usable_size(p) < lengths[j]) {
+                    printf("ERROR: usable size %zu of ualigned_alloc(%zu, %zu)\n", umalloc_usable_size(p), alignments[i], lengths[j]);
+                    exit(1);
+                }
+                check_data_integrity(p, lengths[j], (char)j);
+                ufree(p);
+            }
+        }
+    }
+    umallopt(UMALLOC_OPT_MMAP_THRESHOLD, 128 * 1024);
+
+    // alignment 必须是 sizeof(void*) 倍数的 2 的幂
+    size_t bad[] = {0, 3, 4, 24, 4097};
+    for (size_t i = 0; i < sizeof(bad) / sizeof(bad[0]); i++) {
+        void *p = NULL;
+        if (uposix_memalign(&p, bad[i], 100) != EINVAL) {
+            printf("ERROR: uposix_memalign accepted alignment %zu\n", bad[i]);
+            exit(1);
+        }
+    }
+    void *p = NULL;
+    if (uposix_memalign(&p, 64, 100) != 0 || (uintptr_t)p % 64 != 0) {
+        printf("ERROR: uposix_memalign(64, 100) returned %p\n", p);
+        exit(1);
+    }
+    ufree(p);
+
+    for (size_t n = 1; n <= 300 * 1024; n = n * 3 + 1) {
+        void *q = umalloc(n);
+        if (umalloc_usable_size(q) < n) {
+            printf("ERROR: usable size %zu of umalloc(%zu)\n", umalloc_usable_size(q), n);
+            exit(1);
+        }
+        ufree(q);
+    }
+    printf("清零与对齐分配测试完成。\n");
+}
+
+// 多竞技场：两个新线程轮流分到不同的竞技场 (区域按 1 GB 对齐，不同竞技场的区域不在同一个 1 GB 内)；
+// 一个线程释放另一个线程的块时压入对方的远程释放栈，对方下次持锁分配时通过 remote_drain 回收
+#define ARENA_OBJECTS 64
+#define ARENA_SIZE 2048  // 大于线程缓存的上限，释放时直接进入远程释放栈
+static void *arena_objs[ARENA_OBJECTS];
+static void *arena_own[2];  // 两个线程各自分配的块
+static int arena_phase;  // 0 → 1 所有者已分配，1 → 2 另一个线程已全部释放
+
+static void arena_wait(int phase) {
+    while (__atomic_load_n(&arena_phase, __ATOMIC_ACQUIRE) < phase) sched_yield();
+}
+
+void* arena_owner(void* arg) {
+    (void)arg;
+    for (int i = 0; i < ARENA_OBJECTS; i++) {
+        arena_objs[i] = umalloc(ARENA_SIZE);
+        memset(arena_objs[i], i, ARENA_SIZE);
+    }
+    __atomic_store_n(&arena_phase, 1, __ATOMIC_RELEASE);
+    arena_wait(2);
+    arena_own[0] = umalloc(ARENA_SIZE);  // 持锁分配，先回收远程释放的块
+    return NULL;
+}
+
+void* arena_remote(void* arg) {
+    (void)arg;
+    arena_wait(1);
+    arena_own[1] = umalloc(ARENA_SIZE);
+    for (int i = 0; i < ARENA_OBJECTS; i++) {
+        check_data_integrity(arena_objs[i], ARENA_SIZE, (char)i);
+        ufree(arena_objs[i]);
+    }
+    __atomic_store_n(&arena_phase, 2, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+void test_arenas() {
+    printf("\n[Test 17] 多竞技场与远程释放测试...\n");
+    struct umalloc_stats stats;
+    umalloc_get_stats(&stats);
+    if (stats.arena_limit < 2) {
+        printf("  >> 竞技场上限为 %u，跳过\n", stats.arena_limit);
+        return;
+    }
+    size_t drained = stats.remote_drained;
+
+    pthread_t owner, remote;
+    arena_phase = 0;
+    if (pthread_create(&owner, NULL, arena_owner, NULL) != 0 ||
+        pthread_create(&remote, NULL, arena_remote, NULL) != 0) {
+        perror("pthread_create failed");
+        exit(1);
+    }
+    pthread_join(owner, NULL);
+    pthread_join(remote, NULL);
+
+    if ((uintptr_t)arena_own[0] >> 30 == (uintptr_t)arena_own[1] >> 30) {
+        printf("ERROR: both threads allocated from the same arena (%p, %p)\n", arena_own[0], arena_own[1]);
+        exit(1);
+    }
+    umalloc_get_stats(&stats);
+    if (stats.remote_drained - drained < ARENA_OBJECTS) {
+        printf("ERROR: %zu remote frees drained, expected %d\n", stats.remote_drained - drained, ARENA_OBJECTS);
+        exit(1);
+    }
+    printf("  >> %u 个竞技场，回收 %zu 个远程释放\n", stats.arena_count, stats.remote_drained - drained);
+    ufree(arena_own[0]);
+    ufree(arena_own[1]);
+    printf("多竞技场与远程释放测试完成。\n");
+}
+
+// 后台回收：缩短衰减时间并启动回收线程，刚释放的空闲页在衰减时间过后应被归还系统
+// (已归还的字节数或从堆尾归还的累计字节数增加)，调用者不需要调用 umalloc_purge
+#define SCAV_OBJECTS 256
+#define SCAV_SIZE 20000  // 在堆中分配
+#define SCAV_DECAY_MS 100
+#define SCAV_WAIT_MS 5000
+
+static size_t scavenged_bytes() {
+    struct umalloc_stats stats;
+    umalloc_get_stats(&stats);
+    return stats.purged_bytes + stats.trimmed_bytes;
+}
+
+void test_scavenger() {
+    printf("\n[Test 18] 后台回收测试...\n");
+    static void *objs[SCAV_OBJECTS];
+    umalloc_purge();  // 之前测试留下的空闲页先归还，之后只剩本测试释放的页
+    for (int i = 0; i < SCAV_OBJECTS; i++) {
+        objs[i] = umalloc(SCAV_SIZE);
+        if (!objs[i]) {
+            printf("ERROR: umalloc(%d) failed\n", SCAV_SIZE);
+            exit(1);
+        }
+        memset(objs[i], i, SCAV_SIZE);
+    }
+    for (int i = 0; i < SCAV_OBJECTS; i++) ufree(objs[i]);
+    size_t before = scavenged_bytes();
+
+    umallopt(UMALLOC_OPT_DECAY_MS, SCAV_DECAY_MS);
+    if (umallopt(UMALLOC_OPT_BACKGROUND_THREAD, 1) != 0) {
+        printf("ERROR: cannot start the background scavenger\n");
+        exit(1);
+    }
+    struct timespec poll = {0, 10 * 1000000L};
+    uint64_t start = get_time_ns();
+    size_t after = before;
+    while (after - before < (size_t)SCAV_OBJECTS * SCAV_SIZE / 2 && get_time_ns() - start < SCAV_WAIT_MS * 1000000UL) {
+        nanosleep(&poll, NULL);
+        after = scavenged_bytes();
+    }
+    umallopt(UMALLOC_OPT_BACKGROUND_THREAD, 0);
+    umallopt(UMALLOC_OPT_DECAY_MS, 10000);
+
+    if (after - before < (size_t)SCAV_OBJECTS * SCAV_SIZE / 2) {
+        printf("ERROR: scavenger returned %zu of %d freed bytes within %d ms\n", after - before, SCAV_OBJECTS * SCAV_SIZE, SCAV_WAIT_MS);
+        exit(1);
+    }
+    printf("  >> %lu ms 内归还 %zu 字节\n", (unsigned long)((get_time_ns() - start) / 1000000), after - before);
+    printf("后台回收测试完成。\n");
+}
+
+// 用法：./memtest [best_fit|quick_fit|tlsf|buddy]，默认 best_fit
+int main(int argc, char **argv) {
+    allocation_strategy strategy = STRATEGY_BEST_FIT;
+    if (argc > 1) {
+        if (strcmp(argv[1], "quick_fit") == 0) strategy = STRATEGY_QUICK_FIT;
+        else if (strcmp(argv[1], "tlsf") == 0) strategy = STRATEGY_TLSF;
+        else if (strcmp(argv[1], "buddy") == 0) strategy = STRATEGY_BUDDY;
+        else if (strcmp(argv[1], "best_fit") != 0) {
+            printf("usage: %s [best_fit|quick_fit|tlsf|buddy]\n", argv[0]);
+            exit(1);
+        }
+    }
+    mem_init(4096, strategy);
 
-int main(void) {
-    printf("=== Starting Advanced Malloc Tests ===\n");
+    printf("=== Starting Advanced Malloc Tests (%s) ===\n", argc > 1 ? argv[1] : "best_fit");
     srand(100); // 固定随机种子保证可复现
 
     // test_basic_correctness();
     // test_coalescing();
     // test_stress_random();
     test_performance_benchmark();
-    // test_visualization();
+    test_visualization();
     // test_concurrent_threads();
+    test_producer_consumer();
+    test_private_heap();
+    test_deferred_coalescing(strategy);
+    test_cpu_cache();
+    test_hugepage_prefault();
+    test_tail_reuse(strategy);
+    test_double_free();
+    test_sized_free();
+    test_heap_map();
+    test_calloc_aligned();
+    test_arenas();
+    test_scavenger();
 
     printf("\n=== All Tests Passed Successfully ===\n");
     exit(0);
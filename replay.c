@@ -0,0 +1,309 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "umalloc.h"
+
+// 回放 umalloc_trace_start 录下的分配记录：每个录制线程的事件在各自的线程上按原顺序执行，
+// 跨线程的释放等到对象被分配后才执行。结束时报告耗时、峰值占用和 fragmentation_stats 的各项指标。
+//
+// 记录中的对象用地址标识，同一地址会被先后复用。回放前按时间排序全部事件，
+// 把每个地址的每一次存活映射为一个唯一的对象编号
+
+// ============================= 读取记录 =============================
+struct op {
+    uint32_t op;
+    uint32_t thread;  // 紧凑后的线程下标
+    size_t id;  // 对象编号，realloc 为新对象
+    size_t old;  // realloc 的原对象编号，NO_OBJECT 表示原指针为空
+    size_t size;
+    size_t align;
+};
+
+#define NO_OBJECT SIZE_MAX
+
+static struct umalloc_trace_event *events;
+static size_t event_count;
+
+static void load_trace(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        exit(1);
+    }
+    struct umalloc_trace_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != UMALLOC_TRACE_MAGIC ||
+        header.event_size != sizeof(struct umalloc_trace_event)) {
+        fprintf(stderr, "%s: not a umalloc trace\n", path);
+        exit(1);
+    }
+    size_t capacity = 1 << 16;
+    events = malloc(capacity * sizeof(*events));
+    for (;;) {
+        if (event_count == capacity) {
+            capacity *= 2;
+            events = realloc(events, capacity * sizeof(*events));
+        }
+        size_t n = fread(events + event_count, sizeof(*events), capacity - event_count, f);
+        if (n == 0) break;
+        event_count += n;
+    }
+    fclose(f);
+}
+
+// 按时间排序事件的下标，时间相同时保持文件中的顺序 (同一线程的事件在文件中有序)
+static int event_compare(const void *x, const void *y) {
+    size_t i = *(const size_t*)x, j = *(const size_t*)y;
+    if (events[i].time != events[j].time) return events[i].time < events[j].time ? -1 : 1;
+    return (i > j) - (i < j);
+}
+
+
+// ============================= 地址映射 =============================
+// 开放寻址的地址 -> 对象编号表，删除时把后续的探测链前移，不留墓碑
+static uint64_t *map_keys;
+static size_t *map_values;
+static size_t map_mask;
+
+static size_t map_slot(uint64_t key) {
+    return (size_t)((key >> 4) * 0x9E3779B97F4A7C15ULL >> 20) & map_mask;
+}
+
+static size_t* map_find(uint64_t key) {
+    for (size_t i = map_slot(key); map_keys[i]; i = (i + 1) & map_mask) {
+        if (map_keys[i] == key) return &map_values[i];
+    }
+    return NULL;
+}
+
+static void map_put(uint64_t key, size_t value) {
+    size_t i = map_slot(key);
+    while (map_keys[i] && map_keys[i] != key) i = (i + 1) & map_mask;
+    map_keys[i] = key;
+    map_values[i] = value;
+}
+
+static void map_remove(uint64_t key) {
+    size_t i = map_slot(key);
+    while (map_keys[i] != key) {
+        if (!map_keys[i]) return;
+        i = (i + 1) & map_mask;
+    }
+    for (size_t j = (i + 1) & map_mask; map_keys[j]; j = (j + 1) & map_mask) {
+        size_t home = map_slot(map_keys[j]);
+        // j 处的键的探测链经过 i 时才能前移到 i
+        if (((j - home) & map_mask) >= ((j - i) & map_mask)) {
+            map_keys[i] = map_keys[j];
+            map_values[i] = map_values[j];
+            i = j;
+        }
+    }
+    map_keys[i] = 0;
+}
+
+
+// ============================= 转换 =============================
+static struct op **thread_ops;  // 每个线程的操作序列
+static size_t *thread_op_count;
+static uint32_t thread_count;
+static size_t object_count;
+static size_t skipped;  // 找不到对象的释放 (重复释放或记录开始前分配的对象)
+static size_t reused;  // 分配到仍存活的地址 (记录中线程间的时间戳交错)，原对象在回放中不再释放
+static size_t peak_live, live_bytes;  // 记录中申请字节数的峰值
+
+// 把记录转换为按线程划分、以对象编号引用的操作序列
+static void build_ops(void) {
+    size_t *order = malloc((event_count ? event_count : 1) * sizeof(size_t));
+    for (size_t i = 0; i < event_count; i++) order[i] = i;
+    qsort(order, event_count, sizeof(size_t), event_compare);
+
+    uint32_t max_thread = 0;
+    for (size_t i = 0; i < event_count; i++) {
+        if (events[i].thread > max_thread) max_thread = events[i].thread;
+    }
+    uint32_t *thread_index = calloc(max_thread + 1, sizeof(uint32_t));
+    for (size_t i = 0; i < event_count; i++) thread_index[events[i].thread] = 1;
+    for (uint32_t t = 0; t <= max_thread; t++) {
+        if (thread_index[t]) thread_index[t] = thread_count++;
+    }
+    thread_ops = calloc(thread_count ? thread_count : 1, sizeof(struct op*));
+    thread_op_count = calloc(thread_count ? thread_count : 1, sizeof(size_t));
+    for (size_t i = 0; i < event_count; i++) thread_op_count[thread_index[events[i].thread]]++;
+    for (uint32_t t = 0; t < thread_count; t++) {
+        thread_ops[t] = malloc(thread_op_count[t] * sizeof(struct op));
+        thread_op_count[t] = 0;
+    }
+
+    size_t capacity = 1024;
+    while (capacity < event_count * 2) capacity *= 2;
+    map_keys = calloc(capacity, sizeof(uint64_t));
+    map_values = calloc(capacity, sizeof(size_t));
+    map_mask = capacity - 1;
+    size_t *sizes = malloc((event_count ? event_count : 1) * sizeof(size_t));  // 对象的申请大小
+
+    for (size_t i = 0; i < event_count; i++) {
+        struct umalloc_trace_event *e = &events[order[i]];
+        struct op op = {e->op, thread_index[e->thread], NO_OBJECT, NO_OBJECT, e->size, 0};
+        size_t *found;
+
+        if (e->op == UMALLOC_TRACE_FREE || e->op == UMALLOC_TRACE_REALLOC) {
+            uint64_t key = e->op == UMALLOC_TRACE_FREE ? e->ptr : e->aux;
+            if (key && (found = map_find(key))) {
+                op.old = *found;
+                live_bytes -= sizes[op.old];
+                map_remove(key);
+            } else if (key) {
+                // 不认识的原对象：释放直接跳过，realloc 当作新分配
+                skipped++;
+                if (e->op == UMALLOC_TRACE_FREE) continue;
+            }
+            if (e->op == UMALLOC_TRACE_FREE) op.id = op.old;
+        }
+        if (e->op != UMALLOC_TRACE_FREE && e->ptr) {
+            if ((found = map_find(e->ptr))) {
+                reused++;
+                live_bytes -= sizes[*found];
+            }
+            op.id = object_count++;
+            op.align = e->op == UMALLOC_TRACE_ALIGNED ? e->aux : 0;
+            sizes[op.id] = e->size;
+            live_bytes += e->size;
+            if (live_bytes > peak_live) peak_live = live_bytes;
+            map_put(e->ptr, op.id);
+        }
+        thread_ops[op.thread][thread_op_count[op.thread]++] = op;
+    }
+    free(sizes);
+    free(order);
+    free(thread_index);
+}
+
+
+// ============================= 回放 =============================
+static void **objects;  // 对象编号 -> 回放中的指针
+static char *ready;  // 对象是否已由某个线程分配
+static volatile int running;
+static pthread_barrier_t start_barrier;
+
+// 跨线程引用的对象可能还没被分配，等待分配它的线程
+static void* wait_object(size_t id) {
+    while (!__atomic_load_n(&ready[id], __ATOMIC_ACQUIRE)) sched_yield();
+    return objects[id];
+}
+
+static void publish_object(size_t id, void *p) {
+    objects[id] = p;
+    __atomic_store_n(&ready[id], 1, __ATOMIC_RELEASE);
+}
+
+static void* replay_worker(void *arg) {
+    uint32_t t = (uint32_t)(uintptr_t)arg;
+    pthread_barrier_wait(&start_barrier);
+    for (size_t i = 0; i < thread_op_count[t]; i++) {
+        struct op *op = &thread_ops[t][i];
+        void *p;
+        switch (op->op) {
+        case UMALLOC_TRACE_MALLOC:
+            p = umalloc(op->size);
+            break;
+        case UMALLOC_TRACE_CALLOC:
+            p = ucalloc(1, op->size);
+            break;
+        case UMALLOC_TRACE_ALIGNED:
+            p = ualigned_alloc(op->align, op->size);
+            break;
+        case UMALLOC_TRACE_FREE:
+            ufree(wait_object(op->id));
+            continue;
+        default:
+            p = urealloc(op->old == NO_OBJECT ? NULL : wait_object(op->old), op->size);
+            break;
+        }
+        if (op->id != NO_OBJECT) publish_object(op->id, p);
+    }
+    return NULL;
+}
+
+// 回放期间每毫秒采样一次堆的占用
+static size_t peak_footprint, peak_used;
+
+static void* sampler_main(void *arg) {
+    (void)arg;
+    while (__atomic_load_n(&running, __ATOMIC_ACQUIRE)) {
+        struct umalloc_stats stats;
+        umalloc_get_stats(&stats);
+        size_t footprint = stats.committed_bytes - stats.purged_bytes + stats.mmapped_bytes;
+        if (footprint > peak_footprint) peak_footprint = footprint;
+        if (stats.used_bytes > peak_used) peak_used = stats.used_bytes;
+        struct timespec ts = {0, 1000000};
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+static const struct {
+    const char *name;
+    allocation_strategy strategy;
+} strategies[] = {
+    {"best_fit", STRATEGY_BEST_FIT},
+    {"quick_fit", STRATEGY_QUICK_FIT},
+    {"tlsf", STRATEGY_TLSF},
+    {"buddy", STRATEGY_BUDDY},
+};
+#define STRATEGY_COUNT (int)(sizeof(strategies) / sizeof(strategies[0]))
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-s strategy] trace\n", prog);
+    fprintf(stderr, "  -s  分配策略:");
+    for (int i = 0; i < STRATEGY_COUNT; i++) fprintf(stderr, " %s", strategies[i].name);
+    fprintf(stderr, "，默认 %s\n", strategies[0].name);
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    int strategy = 0, opt;
+    while ((opt = getopt(argc, argv, "s:h")) != -1) {
+        if (opt != 's') usage(argv[0]);
+        for (strategy = 0; strategy < STRATEGY_COUNT && strcmp(optarg, strategies[strategy].name); strategy++);
+        if (strategy == STRATEGY_COUNT) usage(argv[0]);
+    }
+    if (optind != argc - 1) usage(argv[0]);
+
+    load_trace(argv[optind]);
+    build_ops();
+    objects = calloc(object_count ? object_count : 1, sizeof(void*));
+    ready = calloc(object_count ? object_count : 1, 1);
+
+    mem_init(4096, strategies[strategy].strategy);
+    pthread_t *threads = malloc((thread_count ? thread_count : 1) * sizeof(pthread_t));
+    pthread_t sampler;
+    pthread_barrier_init(&start_barrier, NULL, thread_count + 1);
+    running = 1;
+    pthread_create(&sampler, NULL, sampler_main, NULL);
+    for (uint32_t t = 0; t < thread_count; t++) pthread_create(&threads[t], NULL, replay_worker, (void*)(uintptr_t)t);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pthread_barrier_wait(&start_barrier);
+    for (uint32_t t = 0; t < thread_count; t++) pthread_join(threads[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(sampler, NULL);
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Replay (%s): %zu events, %u threads, %zu objects\n", strategies[strategy].name, event_count, thread_count, object_count);
+    printf("  Time: %.3f ms (%.0f ns per event)\n", seconds * 1e3, event_count ? seconds * 1e9 / event_count : 0);
+    printf("  Peak live requested: %zu bytes\n", peak_live);
+    printf("  Peak used: %zu bytes, peak footprint: %zu bytes (sampled), max RSS: %ld KB\n", peak_used, peak_footprint, usage.ru_maxrss);
+    if (skipped || reused) printf("  Unmatched: %zu frees of unknown objects, %zu allocations at live addresses\n", skipped, reused);
+    fragmentation_stats();  // 记录结束时仍存活的对象还未释放
+    return 0;
+}
@@ -1,485 +1,4151 @@
 // umalloc.c
 
-#define _DEFAULT_SOURCE
+#define _GNU_SOURCE
 #include "umalloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <inttypes.h>
+#ifndef MADV_COLLAPSE
+#define MADV_COLLAPSE 25  // Linux 6.1，glibc 2.37 之前的头文件没有定义
+#endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+// CPU 缓存的 restartable sequences 实现需要 glibc 2.35 起导出的 __rseq_offset
+#if defined(__x86_64__) && defined(__GLIBC_PREREQ)
+#if __GLIBC_PREREQ(2, 35)
+#include <sys/rseq.h>
+#include <sys/syscall.h>
+#include <linux/membarrier.h>
+#define HAVE_RSEQ 1
+#endif
+#endif
 
 
 // ==================== 数据结构 ========================
-// 内存信息
+// 堆区域：用 mmap(PROT_NONE) 预留的一段连续虚拟地址空间，从头开始按需提交 (mprotect 为可读写)。
+// 已提交部分的布局为 [区域头][块 ... 块][结尾块]，
+// 结尾块 (epilogue) 是一个大小为 0、标记为已分配的块头，用来终止按地址的遍历
+struct heap_region {
+  struct heap_region *next;  // 同一竞技场的下一个区域
+  size_t size;  // 已提交的大小 (含区域头和结尾块)
+  size_t reserved;  // 预留的虚拟地址空间大小
+  struct arena *arena;  // 所属竞技场
+};
+
+// 全局信息：各竞技场共享的配置和后台回收线程，每个竞技场的堆状态见 struct arena
+#define ARENA_MAX 256  // 竞技场数量的上限
+#define PROFILE_PERIOD 64  // 默认每 64 次 umalloc/ufree 计时一次
 struct {
-  pthread_mutex_t lock;  // 用户空间锁
-  struct mem_block *globallist;  // 全局链表头指针，低地址到高地址排序
-  size_t used_memory;
-  size_t total_memory;
+  pthread_mutex_t lock;  // 保护竞技场的创建与选择、可调参数和后台回收线程
+  int initialized;  // 是否已初始化
   allocation_strategy strategy;  // 内存分配策略
-} mem = {PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, STRATEGY_BEST_FIT};
+  size_t heap_size;  // 每个竞技场初始提交的堆大小
+  size_t page_size;  // 系统页大小
+  struct arena *arenas[ARENA_MAX];  // 已创建的竞技场，按需创建
+  struct arena *heaps;  // uheap_create 创建的私有堆
+  unsigned int arena_count;  // 线程可以使用的竞技场数量
+  unsigned int arena_next;  // 新线程轮转分配的下一个竞技场
+  size_t mmap_threshold;  // 大对象阈值
+  size_t epoch;  // 回收时钟，后台线程每个周期加一，空闲块记录自己空闲时的 epoch
+  size_t decay_ms;  // 空闲页的衰减时间
+  int purge_lazy;  // 使用 MADV_FREE
+  int check_sized;  // 调试模式：ufree_sized 核对调用者给出的大小
+  size_t defer_coalesce;  // 快速适配延迟合并的阈值 (占堆的百分比)，0 为每次释放都立即合并
+  int hugepage;  // 堆区域使用透明大页：按大页提交并 madvise(MADV_HUGEPAGE)
+  int cpu_cache;  // 用 CPU 缓存代替线程缓存
+  int cpu_cache_rseq;  // CPU 缓存使用 restartable sequences，否则使用 sched_getcpu 与原子操作
+  unsigned int cpu_count;  // CPU 缓存的个数，首次开启时按配置的 CPU 数建立
+  struct cpu_cache *cpu_caches;
+  unsigned int profile;  // umalloc/ufree 耗时的抽样周期，0 为不记录
+  uint64_t clock_ticks;  // 初始化时的计时读数和单调时钟，用于把计时单位换算为纳秒
+  uint64_t clock_ns;
+  int tracing;  // 是否记录分配事件
+  int trace_fd;  // 记录文件，停止记录并写出所有缓冲区后才关闭
+  int scavenger_running;  // 后台回收线程是否在运行
+  pthread_t scavenger;
+  pthread_cond_t scavenger_cond;  // 用于唤醒/停止后台线程
+} mem = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .strategy = STRATEGY_BEST_FIT,
+  .mmap_threshold = 128 * 1024,
+  .decay_ms = 10000,
+  .profile = PROFILE_PERIOD,
+  .trace_fd = -1,
+  .scavenger_cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+// 大对象：超过 mmap_threshold 的申请使用独立的 mmap 映射，释放时直接 munmap 归还系统。
+// 映射的布局为 [large_chunk][mem_block 头部][有效载荷]，块头带 BLOCK_MMAPPED 标志
+struct large_chunk {
+  struct large_chunk *prev;
+  struct large_chunk *next;
+  size_t map_size;  // 映射的总大小 (页对齐)
+  struct arena *arena;  // 所属竞技场，大对象记录在它的链表中
+};
+
+
+// 快速适配的空闲链表指针，存放在空闲块的有效载荷中
+struct free_links {
+  struct mem_block *prev;  // 在quick_lists中的前驱
+  struct mem_block *next;  // 在quick_lists中的后继
+};
+
+// 最佳适应的空闲块索引：按 (size, 地址) 排序的红黑树，节点存放在空闲块的有效载荷中
+struct rb_node {
+  uintptr_t parent_color;  // 父节点指针，最低位存放颜色
+  struct rb_node *left;
+  struct rb_node *right;
+};
 
 
 // ==================== 常量工具函数 ====================
 // 工具宏
-#define ALIGN(size) (((size) + 7) & ~7)  // 8字节对齐
-#define BLOCK_SIZE(size) (ALIGN(size + sizeof(struct mem_block)))  // 包括元数据的内存块大小
+#define ALIGN_SHIFT 4
+#define ALIGNMENT (1UL << ALIGN_SHIFT)
+#define ALIGN(size) (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))  // 16字节对齐
+#define FREE_PAYLOAD_SIZE (sizeof(struct rb_node) > sizeof(struct free_links) ? sizeof(struct rb_node) : sizeof(struct free_links))
+#define MIN_BLOCK_SIZE ALIGN(sizeof(struct mem_block) + FREE_PAYLOAD_SIZE + sizeof(size_t))  // 空闲块需要容纳链表指针和脚部
+#define BLOCK_SIZE(size) (ALIGN(size + sizeof(struct mem_block)) < MIN_BLOCK_SIZE ? MIN_BLOCK_SIZE : ALIGN(size + sizeof(struct mem_block)))  // 包括元数据的内存块大小
 #define GET_BLOCK(ptr) ((struct mem_block*)((char*)(ptr) - sizeof(struct mem_block)))
-#define PAYLOAD_SIZE(block) ((block)->size - sizeof(struct mem_block))  // 内存块有效载荷大小
+#define PAYLOAD_SIZE(block) (GET_SIZE(block) - sizeof(struct mem_block))  // 内存块有效载荷大小
 
-// 快速适配分配
-#define QUICK_LIST_COUNT 10  // 这里设定以 32 字节为基准，每级翻倍
-struct mem_block *quick_lists[QUICK_LIST_COUNT];
+// 块头标志位
+#define BLOCK_FREE 0x1  // 本块空闲
+#define BLOCK_PREV_FREE 0x2  // 物理上的前一块空闲 (此时前一块的脚部有效)
+#define BLOCK_MMAPPED 0x4  // 独立 mmap 的大对象
+#define BLOCK_PURGED 0x8  // 空闲块内部的整页已归还系统，块大小改变或被分配时清除
+#define BLOCK_FLAGS (ALIGNMENT - 1)
+#define GET_SIZE(block) ((block)->size & ~BLOCK_FLAGS)
+#define IS_FREE(block) ((block)->size & BLOCK_FREE)
+#define IS_PREV_FREE(block) ((block)->size & BLOCK_PREV_FREE)
+#define IS_MMAPPED(block) ((block)->size & BLOCK_MMAPPED)
+#define IS_PURGED(block) ((block)->size & BLOCK_PURGED)
+
+// 边界标记：通过地址运算访问物理相邻的块
+#define NEXT_BLOCK(block) ((struct mem_block*)((char*)(block) + GET_SIZE(block)))
+#define FOOTER(block) (*(size_t*)((char*)(block) + GET_SIZE(block) - sizeof(size_t)))
+#define PREV_BLOCK(block) ((struct mem_block*)((char*)(block) - *((size_t*)(block) - 1)))  // 仅当 IS_PREV_FREE 时有效
+#define FREE_LINKS(block) ((struct free_links*)((char*)(block) + sizeof(struct mem_block)))
+#define FREE_STAMP(block) (*(size_t*)((char*)(block) + sizeof(struct mem_block) + FREE_PAYLOAD_SIZE))  // 空闲时的 epoch，仅 PURGE_MIN_SIZE 以上的块记录
+#define REGION_HEADER_SIZE ALIGN(sizeof(struct heap_region))
+#define REGION_FIRST_BLOCK(region) ((struct mem_block*)((char*)(region) + REGION_HEADER_SIZE))
+#define REGION_EPILOGUE(region) ((struct mem_block*)((char*)(region) + (region)->size - sizeof(struct mem_block)))
+#define REGION_OVERHEAD (REGION_HEADER_SIZE + sizeof(struct mem_block))  // 区域头 + 结尾块
+#define PAGE_ALIGN(size) (((size) + mem.page_size - 1) & ~(mem.page_size - 1))  // 向上取整到页边界
+
+// 快速适配的尺寸分级：小于 QUICK_EXACT_MAX 的块每 16 字节一级 (精确级，级内所有块大小相同)，
+// 更大的块按 2 的幂分段，每段再均分为 QUICK_SUB_COUNT 级 (范围级)。
+#define QUICK_EXACT_SHIFT 10
+#define QUICK_EXACT_MAX (1UL << QUICK_EXACT_SHIFT)  // 精确级上限 1024 字节
+#define QUICK_EXACT_COUNT (1 << (QUICK_EXACT_SHIFT - ALIGN_SHIFT))  // 精确级数量
+#define QUICK_SUB_SHIFT 2
+#define QUICK_SUB_COUNT (1 << QUICK_SUB_SHIFT)  // 每个 2 的幂区间的细分级数
+#define QUICK_MAX_SHIFT 48  // 用户空间地址宽度，块大小不会超过 2^48
+#define QUICK_LIST_COUNT (QUICK_EXACT_COUNT + (QUICK_MAX_SHIFT - QUICK_EXACT_SHIFT) * QUICK_SUB_COUNT)
+#define QUICK_BITMAP_WORDS ((QUICK_LIST_COUNT + 63) / 64)
+#define DEFER_MAX_SIZE 4096  // 小于该大小的块可以延迟合并
+#define DEFER_LIST_COUNT (DEFER_MAX_SIZE >> ALIGN_SHIFT)  // 延迟链表按 16 字节精确分级
+#define DEFER_BITMAP_WORDS (DEFER_LIST_COUNT / 64)
+#define DEFER_NEXT(block) (FREE_LINKS(block)->next)  // 延迟链表的链接指针
+
+// TLSF 的两级分级：一级按 2 的幂分段，每段再均分为 TLSF_SL_COUNT 个二级类 (类内块大小相差不超过 1/16)。
+// 小于 TLSF_SMALL_MAX 的块都在一级 0 中，每 16 字节一个二级类
+#define TLSF_SL_SHIFT 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_SHIFT)
+#define TLSF_FL_SHIFT (TLSF_SL_SHIFT + ALIGN_SHIFT)
+#define TLSF_SMALL_MAX (1UL << TLSF_FL_SHIFT)  // 一级 0 的上限 256 字节
+#define TLSF_FL_COUNT (QUICK_MAX_SHIFT - TLSF_FL_SHIFT + 1)
+
+// 伙伴系统：块大小 (含头部) 为 BUDDY_MIN_SIZE << k，k 称为阶。大小为 s 的块相对 BUDDY_BASE 按 s 对齐，
+// 它的伙伴位于偏移量异或 s 处。区域头之后放一个始终为已分配的前导块，使 BUDDY_BASE 的有效载荷按页对齐，
+// 于是不小于 alignment (不超过一页) 的块天然满足对齐要求
+#define BUDDY_MIN_SHIFT 6
+#define BUDDY_MIN_SIZE (1UL << BUDDY_MIN_SHIFT)  // 最小块 64 字节
+#define BUDDY_ORDER_COUNT (QUICK_MAX_SHIFT - BUDDY_MIN_SHIFT + 1)
+#define BUDDY_BASE(region) ((char*)(region) + mem.page_size - sizeof(struct mem_block))
+#define BUDDY_PROLOGUE_SIZE (mem.page_size - sizeof(struct mem_block) - REGION_HEADER_SIZE)
+
+// 虚拟堆参数
+#define REGION_SHIFT 30
+#define HEAP_RESERVE_SIZE (1UL << REGION_SHIFT)  // 每个区域默认预留 1 GB 虚拟地址空间，起始地址按 1 GB 对齐
+#define HEAP_COMMIT_MAX (64UL << 20)  // 单次扩展最多提交 64 MB
+#define HUGEPAGE_SIZE (2UL << 20)  // 透明大页的大小 (x86-64 的 PMD 页)
+#define REGION_MAP_SIZE (1UL << (47 - REGION_SHIFT))  // 47 位用户地址空间按 1 GB 分槽
+
+// 区域映射表：第 i 项是覆盖地址 [i GB, i+1 GB) 的区域，释放时由块地址 O(1) 找到所属竞技场
+static struct heap_region *region_map[REGION_MAP_SIZE];
+#define REGION_OF(block) (region_map[(uintptr_t)(block) >> REGION_SHIFT])
+
+// 堆区域的提交粒度：使用透明大页时提交的末端按大页对齐 (区域起点按 1 GB 对齐)，
+// 否则末端的大页只有一部分可读写，不能整体由一个大页支持
+static inline size_t commit_align(size_t size) {
+  return mem.hugepage ? (size + HUGEPAGE_SIZE - 1) & ~(HUGEPAGE_SIZE - 1) : PAGE_ALIGN(size);
+}
+
+// 小对象 (slab) 参数：不超过 SLAB_MAX_SIZE 的申请从 run 中分配。
+// run 是一页大小的连续内存，被均分为同样大小的槽位 (每 16 字节一级)，槽位没有头部，
+// 空闲情况记录在 run 的位图中；run 的元数据放在 run 之外，通过页映射表由地址找到
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASS_COUNT (SLAB_MAX_SIZE >> ALIGN_SHIFT)  // 槽位大小为 16, 32, ..., 256
+#define SLAB_CLASS(nbytes) ((int)(((nbytes) + ALIGNMENT - 1) >> ALIGN_SHIFT) - 1)  // 申请大小到 slab 级别
+#define SLAB_SLOT_SIZE(index) (((size_t)(index) + 1) << ALIGN_SHIFT)
+#define RUN_SHIFT 12
+#define RUN_SIZE (1UL << RUN_SHIFT)  // 每个 run 4 KB
+#define RUN_BITMAP_WORDS ((RUN_SIZE / ALIGNMENT + 63) / 64)
+#define RUN_COMMIT_SIZE (16 * RUN_SIZE)  // run 区域每次提交的大小
+#define RUN_META_CHUNK (64 * 1024)  // run 元数据每次映射的大小
+#define PAGEMAP_LEAF_SIZE (1UL << (REGION_SHIFT - RUN_SHIFT))  // 页映射表的每个叶子覆盖 1 GB
+
+struct run {
+  struct run *prev;  // 同级有空闲槽位的 run 链表，或空 run 链表
+  struct run *next;
+  char *base;  // 槽位的起始地址
+  struct arena *arena;  // 所属竞技场
+  unsigned int class_index;  // slab 级别
+  unsigned int slot_count;  // 槽位数
+  unsigned int free_count;  // 空闲槽位数
+  int purged;  // 空 run 的页已归还系统
+  size_t stamp;  // 变为空 run 时的 epoch
+  uint64_t bitmap[RUN_BITMAP_WORDS];  // 第 i 位为 1 表示槽位 i 空闲
+  uint64_t cached[RUN_BITMAP_WORDS];  // 第 i 位为 1 表示槽位 i 在线程缓存或 CPU 缓存中，不持锁，用原子操作修改
+};
+
+// 页映射表：两级基数树，第一级按 1 GB 分槽，叶子按 4 KB 页号索引到所属 run；不属于任何 run 的地址为 NULL
+static struct run **pagemap_root[REGION_MAP_SIZE];
+
+// 竞技场参数
+#define ARENA_PER_CPU 4  // 默认每个在线 CPU 对应的竞技场数
+#define ARENA_REBALANCE 64  // 线程在当前竞技场上累计遇到这么多次锁争用后，改用争用最少的竞技场
+#define HEAP_INDEX ARENA_MAX  // uheap_create 创建的私有堆不在 mem.arenas 中
+
+// 竞技场的统计快照：持锁修改计数后，解锁前按顺序锁 (seqlock) 的协议发布一份副本，
+// umalloc_get_stats 不获取任何锁、不遍历堆即可读到每个竞技场一致的数据。字段全部是 size_t，按字拷贝
+struct arena_stats {
+  size_t heap_memory;  // 已提交的堆区域字节数
+  size_t used_memory;  // 已分配的堆块字节数 (含线程缓存中的块)
+  size_t free_memory;  // 空闲块字节数
+  size_t free_count;  // 空闲块个数
+  size_t largest_free;  // 最大空闲块
+  size_t waste;  // 已分配块中未被申请的有效载荷字节数
+  size_t purged_memory;
+  size_t trimmed_memory;
+  size_t grow_count;
+  size_t large_memory;
+  size_t large_count;
+  size_t run_memory;
+  size_t run_count;
+  size_t slab_used;
+  size_t remote_drained;
+  size_t deferred_count;
+  size_t deferred_memory;
+  size_t coalesce_passes;
+  size_t coalesce_merges;
+  size_t coalesce_ns;
+  size_t largest_dirty;  // 非 0 时 largest_free 只是上界 (最大块已被取走)，读者持锁重新求出
+};
+#define ARENA_STATS_WORDS (sizeof(struct arena_stats) / sizeof(size_t))
+
+// 竞技场：一个独立的堆，有自己的锁、区域链表、空闲索引和大对象链表。
+// 线程分散在不同的竞技场上分配以减少锁争用；块总是释放回它所在区域的竞技场
+struct arena {
+  pthread_mutex_t lock;
+  unsigned int index;  // 在 mem.arenas 中的下标，私有堆为 HEAP_INDEX
+  allocation_strategy strategy;  // 内存分配策略
+  struct heap_region *regions;  // 堆区域链表头指针
+  struct heap_region *last_region;  // 尾区域，扩展堆时在它的末尾继续提交，O(1) 找到结尾块
+  size_t used_memory;
+  size_t total_memory;  // 已提交的内存总量
+  size_t grow_count;  // 堆扩展次数
+  size_t purged_memory;  // 已归还系统 (不驻留) 的字节数
+  size_t trimmed_memory;  // 从堆尾归还的累计字节数
+  struct large_chunk *large_list;  // 大对象链表
+  size_t large_count;  // 大对象个数
+  size_t large_memory;  // 大对象映射的总字节数
+  size_t contention;  // 获取锁时发生争用的累计次数
+  struct mem_block *quick_lists[QUICK_LIST_COUNT];
+  uint64_t quick_bitmap[QUICK_BITMAP_WORDS];  // 非空桶位图，第 i 位表示 quick_lists[i] 非空
+  uint64_t quick_summary;  // 位图的索引，第 w 位表示 quick_bitmap[w] 非零
+  struct mem_block *deferred[DEFER_LIST_COUNT];  // 延迟合并的块，仍标记为已分配，相邻块释放时不会与它们合并
+  uint64_t deferred_bitmap[DEFER_BITMAP_WORDS];  // 非空延迟链表位图
+  size_t deferred_count;  // 延迟链表中的块数和字节数 (不计入 used_memory)
+  size_t deferred_memory;
+  size_t coalesce_passes;  // 批量合并的次数、合并相邻块的次数和累计耗时
+  size_t coalesce_merges;
+  size_t coalesce_ns;
+  uint64_t tlsf_fl_bitmap;  // TLSF 一级位图，第 f 位表示 tlsf_sl_bitmap[f] 非零
+  uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];  // 二级位图，第 s 位表示 tlsf_lists[f][s] 非空
+  struct mem_block *tlsf_lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+  struct mem_block *buddy_lists[BUDDY_ORDER_COUNT];  // 伙伴系统每阶一个空闲链表
+  uint64_t buddy_bitmap;  // 第 k 位表示 buddy_lists[k] 非空
+  struct rb_node *best_fit_root;  // 最佳适应的红黑树根节点
+  struct run *runs[SLAB_CLASS_COUNT];  // 每级有空闲槽位的 run 链表
+  struct run *empty_runs;  // 槽位全部空闲的 run，可被任意级复用
+  char *run_next;  // run 区域中下一个未使用的 run
+  char *run_end;  // run 区域已提交部分的末尾
+  char *run_limit;  // run 区域预留部分的末尾
+  struct run *meta_next;  // run 元数据的分配位置
+  struct run *meta_end;
+  size_t run_count;  // 已建立的 run 数
+  size_t run_memory;  // run 区域已提交的字节数
+  size_t slab_used;  // 已分配槽位的总字节数
+  void *remote_free;  // 其他线程释放的块和槽位 (无锁多生产者单消费者栈，链接指针在有效载荷开头)
+  size_t remote_drained;  // 从远程释放栈回收的累计个数
+  struct mem_block *fresh;  // 最近一次扩展堆得到的全新空闲块 (除空闲块元数据外全为 0)，供 ucalloc 跳过清零
+  size_t region_count;  // 堆区域个数，每个区域有固定的区域头和结尾块开销
+  size_t free_count;  // 空闲索引中的块数
+  size_t largest_free;  // 最大空闲块，largest_dirty 置位时只是上界，读取统计时再从空闲索引重新求出
+  int largest_dirty;
+  size_t waste;  // 内部碎片：已分配块 (含大对象) 有效载荷中未被申请的字节数，slab 槽位不计
+  size_t stats_seq;  // 顺序锁计数，奇数表示正在发布
+  struct arena_stats published;  // 最近一次发布的统计快照
+  struct arena *heap_prev;  // 私有堆链表 (mem.heaps)
+  struct arena *heap_next;
+};
+
+// 内存回收参数
+#define PURGE_MIN_SIZE (2 * mem.page_size)  // 至少两页的空闲块才可能包含完整的页
+#define SCAVENGE_TICKS 4  // 衰减时间内后台线程的唤醒次数
+#define SCAVENGE_BATCH 64  // 每批回收的空闲块数
+
+// 每个区域固定的开销：区域头和结尾块，伙伴系统还有前导块
+static inline size_t region_overhead(allocation_strategy strategy) {
+  return strategy == STRATEGY_BUDDY ? mem.page_size : REGION_OVERHEAD;
+}
+
+// 区域中第一个可分配的块，伙伴系统跳过前导块
+static inline struct mem_block* region_first_free(struct arena *a, struct heap_region *region) {
+  return a->strategy == STRATEGY_BUDDY ? (struct mem_block*)BUDDY_BASE(region) : REGION_FIRST_BLOCK(region);
+}
+
+// 修改块大小，保留标志位
+static inline void set_size(struct mem_block *block, size_t size) {
+  block->size = size | (block->size & BLOCK_FLAGS);
+}
+
+// 将块标记为空闲：写入脚部，并通知后一块；较大的块记录空闲时刻供回收线程判断衰减
+static inline void mark_free(struct mem_block *block) {
+  block->size |= BLOCK_FREE;
+  FOOTER(block) = GET_SIZE(block);
+  NEXT_BLOCK(block)->size |= BLOCK_PREV_FREE;
+  if (GET_SIZE(block) >= PURGE_MIN_SIZE) FREE_STAMP(block) = mem.epoch;
+}
+
+// 空闲块中可以归还系统的整页范围：跳过头部、链表指针、时间戳和脚部
+static inline void purge_range(struct mem_block *block, uintptr_t *start, uintptr_t *end) {
+  uintptr_t lo = (uintptr_t)block + sizeof(struct mem_block) + FREE_PAYLOAD_SIZE + sizeof(size_t);
+  uintptr_t hi = (uintptr_t)block + GET_SIZE(block) - sizeof(size_t);
+  *start = (lo + mem.page_size - 1) & ~(mem.page_size - 1);
+  *end = hi & ~(mem.page_size - 1);
+  if (*end < *start) *end = *start;
+}
+
+// 块即将被分配或改变大小，其中已归还的页会重新驻留
+static inline void unpurge(struct arena *a, struct mem_block *block) {
+  if (!IS_PURGED(block)) return;
+  uintptr_t start, end;
+  purge_range(block, &start, &end);
+  a->purged_memory -= end - start;
+  block->size &= ~(size_t)BLOCK_PURGED;
+}
+
+// 将块标记为已分配：清除自身和后一块的空闲标志
+static inline void mark_used(struct mem_block *block) {
+  block->size &= ~(size_t)BLOCK_FREE;
+  NEXT_BLOCK(block)->size &= ~(size_t)BLOCK_PREV_FREE;
+}
+
+// 已分配块的内部碎片：有效载荷中未被申请的字节数，线程缓存中 (applyed_size 为 0) 的块不计
+static inline size_t block_waste(struct mem_block *block) {
+  return block->applyed_size ? PAYLOAD_SIZE(block) - block->applyed_size : 0;
+}
 
-// 初始化所有快速链表为空
-void init_quick_lists() {
-  for (size_t i = 0; i < QUICK_LIST_COUNT; i++) quick_lists[i] = NULL;
+// 快速适配分配
+// 初始化所有快速链表和延迟链表为空
+void init_quick_lists(struct arena *a) {
+  for (size_t i = 0; i < QUICK_LIST_COUNT; i++) a->quick_lists[i] = NULL;
+  for (size_t i = 0; i < QUICK_BITMAP_WORDS; i++) a->quick_bitmap[i] = 0;
+  a->quick_summary = 0;
+  for (size_t i = 0; i < DEFER_LIST_COUNT; i++) a->deferred[i] = NULL;
+  for (size_t i = 0; i < DEFER_BITMAP_WORDS; i++) a->deferred_bitmap[i] = 0;
+  a->deferred_count = 0;
+  a->deferred_memory = 0;
 }
 
-// 根据大小选择快速链表索引
+// 根据大小选择快速链表索引，O(1)：精确级直接移位，范围级用前导零计数求最高位
 int quick_list_index(size_t size) {
-  int index = 0;
-  while (size > 32 && index < QUICK_LIST_COUNT - 1) {
-    size >>= 1; 
-    index++;  
+  if (size < QUICK_EXACT_MAX) return (int)(size >> ALIGN_SHIFT);
+  int msb = 63 - __builtin_clzl(size);
+  int sub = (int)(size >> (msb - QUICK_SUB_SHIFT)) & (QUICK_SUB_COUNT - 1);
+  return QUICK_EXACT_COUNT + (msb - QUICK_EXACT_SHIFT) * QUICK_SUB_COUNT + sub;
+}
+
+// 判断某一级是否为精确级
+static inline int quick_list_is_exact(int index) {
+  return index < QUICK_EXACT_COUNT;
+}
+
+// 根据链表是否为空更新位图
+static inline void quick_bitmap_update(struct arena *a, int index) {
+  int word = index >> 6;
+  if (a->quick_lists[index]) a->quick_bitmap[word] |= 1UL << (index & 63);
+  else a->quick_bitmap[word] &= ~(1UL << (index & 63));
+  if (a->quick_bitmap[word]) a->quick_summary |= 1UL << word;
+  else a->quick_summary &= ~(1UL << word);
+}
+
+// 查找索引不小于 index 的第一个非空桶，没有则返回 -1
+static inline int quick_bitmap_find(struct arena *a, int index) {
+  if (index >= QUICK_LIST_COUNT) return -1;
+  int word = index >> 6;
+  uint64_t bits = a->quick_bitmap[word] & (~0UL << (index & 63));
+  if (!bits) {
+    uint64_t words = (word + 1 < 64) ? a->quick_summary & (~0UL << (word + 1)) : 0;
+    if (!words) return -1;
+    word = __builtin_ctzl(words);
+    bits = a->quick_bitmap[word];
   }
-  return index;
+  return (word << 6) + __builtin_ctzl(bits);
+}
+
+// 空闲索引的块数和最大块随插入/删除增量维护；删除的恰好是最大块时，只做标记，读取统计时再重新求出。
+// 求出最大块需要遍历一个空闲链表，不能放在每次解锁都要执行的发布中
+static inline void free_count_add(struct arena *a, struct mem_block *block) {
+  a->free_count++;
+  if (GET_SIZE(block) > a->largest_free) a->largest_free = GET_SIZE(block);
+}
+
+static inline void free_count_remove(struct arena *a, struct mem_block *block) {
+  a->free_count--;
+  if (GET_SIZE(block) >= a->largest_free) a->largest_dirty = 1;
 }
 
 // 将块从快速链表中摘除
-void remove_from_quick_list(struct mem_block *block) {
+void remove_from_quick_list(struct arena *a, struct mem_block *block) {
   if (!block) return;
-  int index = quick_list_index(block->size);
-  if (block->next) block->next->prev = block->prev;
-  if (block->prev) block->prev->next = block->next;
-  if (quick_lists[index] == block) quick_lists[index] = block->next;
-  block->prev = NULL;
-  block->next = NULL;
+  free_count_remove(a, block);
+  int index = quick_list_index(GET_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
+  if (links->next) FREE_LINKS(links->next)->prev = links->prev;
+  if (links->prev) FREE_LINKS(links->prev)->next = links->next;
+  if (a->quick_lists[index] == block) {
+    a->quick_lists[index] = links->next;
+    if (!a->quick_lists[index]) quick_bitmap_update(a, index);
+  }
 }
 
 // 向快速链表添加块
-void add_to_quick_list(struct mem_block *block) {
+void add_to_quick_list(struct arena *a, struct mem_block *block) {
   if (!block) return;
-  int index = quick_list_index(block->size);
-
-  block->prev = NULL;
-  block->next = quick_lists[index];
-  if (quick_lists[index]) quick_lists[index]->prev = block;
-  quick_lists[index] = block;
-}
-
-// 扩展堆函数
-struct mem_block* extend_heap(size_t min_size) {
-  size_t pgsize = sysconf(_SC_PAGESIZE);  // 获取系统页大小
-  size_t extend_size = (min_size < pgsize) ? pgsize : ((min_size + pgsize - 1) & ~(pgsize - 1));  // 向上取整到页边界
-  
-  void *new_mem = sbrk(extend_size);  // 向内核申请内存
-  mem.total_memory += extend_size;  // 更新总内存大小
-  if (new_mem == (void*)-1) return NULL;  // 内存不足
-
-  // 初始化新内存块
-  struct mem_block *new_block = (struct mem_block*)new_mem;
-  new_block->is_free = 1;
-  new_block->size = extend_size;
-  new_block->applyed_size = 0;
-  new_block->prev = NULL;
-  new_block->next = NULL;
-  new_block->prev_global = NULL;
-  new_block->next_global = NULL;
-  
-  // 拓展来的地址是高地址，添加到全局链表的尾部
-  struct mem_block *curr = mem.globallist;
-  if (!curr) {
-    mem.globallist = new_block;
-  } else {
-    while (curr->next_global) curr = curr->next_global;
-    curr->next_global = new_block;
-    new_block->prev_global = curr;
-  }
+  free_count_add(a, block);
+  int index = quick_list_index(GET_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
 
-  printf("extend_heap: added %zu bytes at %p\n", extend_size, new_mem);
-  return new_block;
+  links->prev = NULL;
+  links->next = a->quick_lists[index];
+  if (a->quick_lists[index]) FREE_LINKS(a->quick_lists[index])->prev = block;
+  a->quick_lists[index] = block;
+  if (!links->next) quick_bitmap_update(a, index);  // 链表由空变为非空
 }
 
+// 把释放的块 (小于 DEFER_MAX_SIZE) 放入延迟链表，不合并、不修改标志位
+static inline void defer_push(struct arena *a, struct mem_block *block) {
+  int index = (int)(GET_SIZE(block) >> ALIGN_SHIFT);
+  DEFER_NEXT(block) = a->deferred[index];
+  a->deferred[index] = block;
+  a->deferred_bitmap[index >> 6] |= 1UL << (index & 63);
+  a->deferred_count++;
+  a->deferred_memory += GET_SIZE(block);
+}
 
-// ==================== 初始化 =====================
-void
-mem_init(size_t heap_size, allocation_strategy strategy) {
-  pthread_mutex_lock(&mem.lock);  // 获取锁
-  // 如果已经初始化过了，直接解锁退出
-  if (mem.total_memory > 0) {
-    pthread_mutex_unlock(&mem.lock);
-    return;
+// 取出一个大小恰为 size 的延迟块，没有则返回 NULL
+static inline struct mem_block* defer_pop(struct arena *a, size_t size) {
+  int index = (int)(size >> ALIGN_SHIFT);
+  struct mem_block *block = a->deferred[index];
+  if (!block) return NULL;
+  a->deferred[index] = DEFER_NEXT(block);
+  if (!a->deferred[index]) a->deferred_bitmap[index >> 6] &= ~(1UL << (index & 63));
+  a->deferred_count--;
+  a->deferred_memory -= size;
+  return block;
+}
+
+// TLSF 分配
+// 初始化两级位图和所有空闲链表
+void init_tlsf(struct arena *a) {
+  a->tlsf_fl_bitmap = 0;
+  for (int f = 0; f < TLSF_FL_COUNT; f++) {
+    a->tlsf_sl_bitmap[f] = 0;
+    for (int s = 0; s < TLSF_SL_COUNT; s++) a->tlsf_lists[f][s] = NULL;
   }
-  
-  // 向内核申请内存
-  void *heap_start = sbrk(heap_size);
-  if (heap_start == (void*)-1) {
-      pthread_mutex_unlock(&mem.lock); // 失败解锁
-      perror("mem_init: sbrk failed");
-      exit(1);
+}
+
+// 由块大小求出一级、二级类，O(1)：一级为最高位，二级为最高位之后的 TLSF_SL_SHIFT 位
+static inline void tlsf_mapping(size_t size, int *fl, int *sl) {
+  if (size < TLSF_SMALL_MAX) {
+    *fl = 0;
+    *sl = (int)(size >> ALIGN_SHIFT);
+    return;
   }
+  int msb = 63 - __builtin_clzl(size);
+  *fl = msb - TLSF_FL_SHIFT + 1;
+  *sl = (int)(size >> (msb - TLSF_SL_SHIFT)) & (TLSF_SL_COUNT - 1);
+}
 
-  // 初始化第一个内存块
-  struct mem_block *first_block = (struct mem_block*)heap_start;
-  first_block->size = heap_size;
-  first_block->applyed_size = 0;
-  first_block->is_free = 1;
-  first_block->next_global = NULL;
-  first_block->prev_global = NULL;
+// 查找不小于 (fl, sl) 的第一个非空类：先查同一级中更大的二级类，再查更高的一级，没有则返回 0
+static inline int tlsf_find(struct arena *a, int *fl, int *sl) {
+  uint32_t sl_map = (*sl < TLSF_SL_COUNT) ? a->tlsf_sl_bitmap[*fl] & (~0U << *sl) : 0;
+  if (!sl_map) {
+    uint64_t fl_map = a->tlsf_fl_bitmap & (~0UL << (*fl + 1));
+    if (!fl_map) return 0;
+    *fl = __builtin_ctzl(fl_map);
+    sl_map = a->tlsf_sl_bitmap[*fl];
+  }
+  *sl = __builtin_ctz(sl_map);
+  return 1;
+}
 
-  // 初始化全局链表
-  mem.strategy = strategy;  // 设置分配策略
-  mem.globallist = first_block;  // 全局链表头指针
-  mem.total_memory = heap_size;
-  mem.used_memory = 0;
+// 将块加入所在类的链表头部，链表由空变为非空时置位两级位图
+void tlsf_insert(struct arena *a, struct mem_block *block) {
+  free_count_add(a, block);
+  int fl, sl;
+  tlsf_mapping(GET_SIZE(block), &fl, &sl);
+  struct free_links *links = FREE_LINKS(block);
+  links->prev = NULL;
+  links->next = a->tlsf_lists[fl][sl];
+  if (links->next) {
+    FREE_LINKS(links->next)->prev = block;
+  } else {
+    a->tlsf_sl_bitmap[fl] |= 1U << sl;
+    a->tlsf_fl_bitmap |= 1UL << fl;
+  }
+  a->tlsf_lists[fl][sl] = block;
+}
 
-  // 如果使用快速适配策略，需要初始化快速适配链表
-  if (mem.strategy == STRATEGY_QUICK_FIT) {
-    init_quick_lists();
-    add_to_quick_list(first_block);  // 加入快速链表
-  } else if (mem.strategy == STRATEGY_BEST_FIT) {
-    first_block->next = NULL;
-    first_block->prev = NULL;
+// 将块从所在类的链表中摘除，链表变空时清除位图
+void tlsf_remove(struct arena *a, struct mem_block *block) {
+  free_count_remove(a, block);
+  int fl, sl;
+  tlsf_mapping(GET_SIZE(block), &fl, &sl);
+  struct free_links *links = FREE_LINKS(block);
+  if (links->next) FREE_LINKS(links->next)->prev = links->prev;
+  if (links->prev) {
+    FREE_LINKS(links->prev)->next = links->next;
+  } else {
+    a->tlsf_lists[fl][sl] = links->next;
+    if (!links->next) {
+      a->tlsf_sl_bitmap[fl] &= ~(1U << sl);
+      if (!a->tlsf_sl_bitmap[fl]) a->tlsf_fl_bitmap &= ~(1UL << fl);
+    }
   }
+}
 
-  // 释放锁
-  pthread_mutex_unlock(&mem.lock);
+// 伙伴系统
+// 初始化每阶的空闲链表
+void init_buddy(struct arena *a) {
+  for (int k = 0; k < BUDDY_ORDER_COUNT; k++) a->buddy_lists[k] = NULL;
+  a->buddy_bitmap = 0;
 }
 
+// 块大小向上取整到 2 的幂 (至少 BUDDY_MIN_SIZE)
+static inline size_t buddy_block_size(size_t size) {
+  return size <= BUDDY_MIN_SIZE ? BUDDY_MIN_SIZE : 1UL << (64 - __builtin_clzl(size - 1));
+}
 
-// ==================== 快速适配分配 ===================
-void*
-umalloc_quick_fit(size_t nbytes) { 
-  if (nbytes <= 0) return NULL;
+// 2 的幂大小对应的阶
+static inline int buddy_order(size_t size) {
+  return 63 - __builtin_clzl(size) - BUDDY_MIN_SHIFT;
+}
 
-  pthread_mutex_lock(&mem.lock);  // 获取锁
-  size_t required_size = BLOCK_SIZE(nbytes);  // 计算所需内存块大小
-  int index = quick_list_index(required_size);
-  struct mem_block *block = NULL;
+// 查找不小于 order 的第一个非空阶，没有则返回 -1
+static inline int buddy_find(struct arena *a, int order) {
+  uint64_t bits = order < 64 ? a->buddy_bitmap & (~0UL << order) : 0;
+  return bits ? __builtin_ctzl(bits) : -1;
+}
 
-  // 现在快速链表中查找
-  for (size_t i = index; i < QUICK_LIST_COUNT; i++) {
-    block = quick_lists[i];  // 获取桶i的链表头
-    while (block) {
-      if (block->is_free && block->size >= required_size) {  
-        // 说明找到了合适的块
-        goto found;
-      }
-      block = block->next;
-    }
-  }
+void buddy_insert(struct arena *a, struct mem_block *block) {
+  free_count_add(a, block);
+  int order = buddy_order(GET_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
+  links->prev = NULL;
+  links->next = a->buddy_lists[order];
+  if (links->next) FREE_LINKS(links->next)->prev = block;
+  else a->buddy_bitmap |= 1UL << order;
+  a->buddy_lists[order] = block;
+}
 
-  // 快速链表没找到，扩展堆
-  block = extend_heap(required_size);  // 扩展堆
-  if (!block) {  // 说明内存不足
-    pthread_mutex_unlock(&mem.lock);
-    return NULL;
+void buddy_remove(struct arena *a, struct mem_block *block) {
+  free_count_remove(a, block);
+  int order = buddy_order(GET_SIZE(block));
+  struct free_links *links = FREE_LINKS(block);
+  if (links->next) FREE_LINKS(links->next)->prev = links->prev;
+  if (links->prev) {
+    FREE_LINKS(links->prev)->next = links->next;
+  } else {
+    a->buddy_lists[order] = links->next;
+    if (!links->next) a->buddy_bitmap &= ~(1UL << order);
   }
-found:
-  remove_from_quick_list(block);  // 从快速链表中摘除
-  block->is_free = 0;  // 标记为已分配
-  block->applyed_size = nbytes;
+}
 
-  // 分割块
-  if (block->size > required_size + sizeof(struct mem_block) + 8) {
-    struct mem_block *new_block = (struct mem_block*)((char*)block + required_size);
-    new_block->size = block->size - required_size;
-    new_block->applyed_size = 0;
-    new_block->is_free = 1;
+// 最佳适应的空闲块红黑树
+#define RB_RED 0
+#define RB_BLACK 1
+#define FREE_NODE(block) ((struct rb_node*)((char*)(block) + sizeof(struct mem_block)))  // 空闲块对应的树节点
+#define NODE_BLOCK(node) GET_BLOCK(node)  // 树节点对应的空闲块
 
-    // 插入剩余块到快速链表
-    add_to_quick_list(new_block);
+static inline struct rb_node* rb_parent(struct rb_node *n) { return (struct rb_node*)(n->parent_color & ~1UL); }
+static inline int rb_is_red(struct rb_node *n) { return n && (n->parent_color & 1) == RB_RED; }
+static inline void rb_set_parent(struct rb_node *n, struct rb_node *p) { n->parent_color = (uintptr_t)p | (n->parent_color & 1); }
+static inline void rb_set_color(struct rb_node *n, int color) { n->parent_color = (n->parent_color & ~1UL) | color; }
 
-    // 修改全局链表
-    new_block->prev_global = block;
-    new_block->next_global = block->next_global;
-    if (block->next_global) block->next_global->prev_global = new_block;
-    block->next_global = new_block;
+// 按 (size, 地址) 比较两个节点
+static inline int rb_less(struct rb_node *a, struct rb_node *b) {
+  size_t sa = GET_SIZE(NODE_BLOCK(a)), sb = GET_SIZE(NODE_BLOCK(b));
+  return sa < sb || (sa == sb && a < b);
+}
 
-    block->size = required_size;
-  }
+// 用 child 替换 parent 下的 old 子树
+static inline void rb_replace_child(struct rb_node **root, struct rb_node *parent, struct rb_node *old, struct rb_node *child) {
+  if (!parent) *root = child;
+  else if (parent->left == old) parent->left = child;
+  else parent->right = child;
+}
 
-  mem.used_memory += block->size;
+static void rb_rotate_left(struct rb_node **root, struct rb_node *x) {
+  struct rb_node *y = x->right;
+  x->right = y->left;
+  if (y->left) rb_set_parent(y->left, x);
+  rb_set_parent(y, rb_parent(x));
+  rb_replace_child(root, rb_parent(x), x, y);
+  y->left = x;
+  rb_set_parent(x, y);
+}
 
-  pthread_mutex_unlock(&mem.lock); // 替换锁
-  return (void*)((char*)block + sizeof(struct mem_block));  // 返回用户可用的内存地址
+static void rb_rotate_right(struct rb_node **root, struct rb_node *x) {
+  struct rb_node *y = x->left;
+  x->left = y->right;
+  if (y->right) rb_set_parent(y->right, x);
+  rb_set_parent(y, rb_parent(x));
+  rb_replace_child(root, rb_parent(x), x, y);
+  y->right = x;
+  rb_set_parent(x, y);
 }
 
+// 中序后继
+static struct rb_node* rb_next(struct rb_node *n) {
+  if (n->right) {
+    n = n->right;
+    while (n->left) n = n->left;
+    return n;
+  }
+  struct rb_node *p;
+  while ((p = rb_parent(n)) && n == p->right) n = p;
+  return p;
+}
 
-// ==================== 最佳适应分配 ===================
-void*
-umalloc_best_fit(size_t nbytes) {
-  if (nbytes <= 0) return NULL;
+// 将空闲块插入红黑树
+void best_fit_insert(struct arena *a, struct mem_block *block) {
+  free_count_add(a, block);
+  struct rb_node **root = &a->best_fit_root;
+  struct rb_node *z = FREE_NODE(block);
+  struct rb_node *parent = NULL, **link = root;
+  while (*link) {
+    parent = *link;
+    link = rb_less(z, parent) ? &parent->left : &parent->right;
+  }
+  z->left = z->right = NULL;
+  z->parent_color = (uintptr_t)parent | RB_RED;
+  *link = z;
 
-  pthread_mutex_lock(&mem.lock);  // 获取锁
-  size_t required_size = BLOCK_SIZE(nbytes);  // 计算所需内存块大小
-  struct mem_block *best = NULL;
-  struct mem_block *curr = mem.globallist;
-
-  // 寻找最佳适配块
-  while (curr) {
-    if (curr->is_free && curr->size >= required_size) {
-      if (best == NULL || best->size > curr->size) {
-        best = curr;
+  // 插入修正
+  while ((parent = rb_parent(z)) && rb_is_red(parent)) {
+    struct rb_node *gparent = rb_parent(parent);
+    if (parent == gparent->left) {
+      struct rb_node *uncle = gparent->right;
+      if (rb_is_red(uncle)) {
+        rb_set_color(parent, RB_BLACK);
+        rb_set_color(uncle, RB_BLACK);
+        rb_set_color(gparent, RB_RED);
+        z = gparent;
+        continue;
+      }
+      if (z == parent->right) {
+        rb_rotate_left(root, parent);
+        z = parent;
+        parent = rb_parent(z);
+      }
+      rb_set_color(parent, RB_BLACK);
+      rb_set_color(gparent, RB_RED);
+      rb_rotate_right(root, gparent);
+    } else {
+      struct rb_node *uncle = gparent->left;
+      if (rb_is_red(uncle)) {
+        rb_set_color(parent, RB_BLACK);
+        rb_set_color(uncle, RB_BLACK);
+        rb_set_color(gparent, RB_RED);
+        z = gparent;
+        continue;
       }
+      if (z == parent->left) {
+        rb_rotate_right(root, parent);
+        z = parent;
+        parent = rb_parent(z);
+      }
+      rb_set_color(parent, RB_BLACK);
+      rb_set_color(gparent, RB_RED);
+      rb_rotate_left(root, gparent);
     }
-    curr = curr->next_global;
   }
+  rb_set_color(*root, RB_BLACK);
+}
 
-  // 没有找到最合适的块
-  if (!best) {
-    best = extend_heap(required_size);  // 扩展堆
-    if (!best) {  // 说明内存不足
-      pthread_mutex_unlock(&mem.lock);
-      return NULL;
+// 删除后的修正，x 可能为 NULL，因此需要单独传入其父节点
+static void rb_erase_fixup(struct rb_node **root, struct rb_node *x, struct rb_node *parent) {
+  while (x != *root && !rb_is_red(x)) {
+    if (x == parent->left) {
+      struct rb_node *w = parent->right;
+      if (rb_is_red(w)) {
+        rb_set_color(w, RB_BLACK);
+        rb_set_color(parent, RB_RED);
+        rb_rotate_left(root, parent);
+        w = parent->right;
+      }
+      if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+        rb_set_color(w, RB_RED);
+        x = parent;
+        parent = rb_parent(x);
+      } else {
+        if (!rb_is_red(w->right)) {
+          rb_set_color(w->left, RB_BLACK);
+          rb_set_color(w, RB_RED);
+          rb_rotate_right(root, w);
+          w = parent->right;
+        }
+        rb_set_color(w, parent->parent_color & 1);
+        rb_set_color(parent, RB_BLACK);
+        rb_set_color(w->right, RB_BLACK);
+        rb_rotate_left(root, parent);
+        x = *root;
+      }
+    } else {
+      struct rb_node *w = parent->left;
+      if (rb_is_red(w)) {
+        rb_set_color(w, RB_BLACK);
+        rb_set_color(parent, RB_RED);
+        rb_rotate_right(root, parent);
+        w = parent->left;
+      }
+      if (!rb_is_red(w->left) && !rb_is_red(w->right)) {
+        rb_set_color(w, RB_RED);
+        x = parent;
+        parent = rb_parent(x);
+      } else {
+        if (!rb_is_red(w->left)) {
+          rb_set_color(w->right, RB_BLACK);
+          rb_set_color(w, RB_RED);
+          rb_rotate_left(root, w);
+          w = parent->left;
+        }
+        rb_set_color(w, parent->parent_color & 1);
+        rb_set_color(parent, RB_BLACK);
+        rb_set_color(w->left, RB_BLACK);
+        rb_rotate_right(root, parent);
+        x = *root;
+      }
     }
   }
+  if (x) rb_set_color(x, RB_BLACK);
+}
 
-  // 分割块 (剩余空间足够大)：剩余空间 > 元数据大小 + 最小用户块
-  best->is_free = 0;
-  best->applyed_size = nbytes;  // 记录用户申请的大小
-  if (best->size > required_size + sizeof(struct mem_block) + 8) {
-    // 设置并计算新块
-    struct mem_block *new_block = (struct mem_block*)((char*)best + required_size);  // 在C语言中，指针加减法是以指向类型的大小为单位
-    new_block->size = best->size - required_size;
-    new_block->applyed_size = 0;
-    new_block->is_free = 1;
+// 将空闲块从红黑树中删除
+void best_fit_remove(struct arena *a, struct mem_block *block) {
+  free_count_remove(a, block);
+  struct rb_node **root = &a->best_fit_root;
+  struct rb_node *z = FREE_NODE(block);
+  struct rb_node *child, *parent;
+  int color;
 
-    // 更新全局链表
-    new_block->next_global = best->next_global;
-    new_block->prev_global = best;
-    if (best->next_global) best->next_global->prev_global = new_block;
-    best->next_global  = new_block;
-    best->size = required_size;
+  if (!z->left || !z->right) {
+    child = z->left ? z->left : z->right;
+    parent = rb_parent(z);
+    color = z->parent_color & 1;
+    if (child) rb_set_parent(child, parent);
+    rb_replace_child(root, parent, z, child);
+  } else {
+    // 用后继节点 y 顶替 z 的位置
+    struct rb_node *y = z->right;
+    while (y->left) y = y->left;
+    color = y->parent_color & 1;
+    child = y->right;
+    parent = rb_parent(y);
+    if (parent == z) {
+      parent = y;
+    } else {
+      if (child) rb_set_parent(child, parent);
+      parent->left = child;
+      y->right = z->right;
+      rb_set_parent(z->right, y);
+    }
+    y->left = z->left;
+    rb_set_parent(z->left, y);
+    y->parent_color = z->parent_color;
+    rb_replace_child(root, rb_parent(z), z, y);
   }
 
-  mem.used_memory += best->size;
-  pthread_mutex_unlock(&mem.lock);  // 释放锁
-
-  return (void*)((char*)best + sizeof(struct mem_block));  // 返回用户可用的内存地址, 藏内部管理信息（元数据）
+  if (color == RB_BLACK) rb_erase_fixup(root, child, parent);
 }
 
+// 空闲块变大后更新它在树中的位置：若仍小于中序后继则原地修改即可，否则重新插入
+void best_fit_grow(struct arena *a, struct mem_block *block) {
+  if (GET_SIZE(block) > a->largest_free) a->largest_free = GET_SIZE(block);
+  struct rb_node *node = FREE_NODE(block);
+  struct rb_node *next = rb_next(node);
+  if (!next || rb_less(node, next)) return;
+  best_fit_remove(a, block);
+  best_fit_insert(a, block);
+}
 
-// ==================== 内存释放 ===================
-// 向前合并
-static struct mem_block* merge_with_prev(struct mem_block *block) {
-    struct mem_block *prev = block->prev_global;
-    prev->size += block->size;
-    prev->next_global = block->next_global;
-    if (block->next_global) block->next_global->prev_global = prev;
-    return prev; // 返回合并后的指针
+// 查找不小于 size 的最小空闲块 (大小相同时取低地址)，O(log n)
+struct mem_block* best_fit_search(struct arena *a, size_t size) {
+  struct rb_node *node = a->best_fit_root, *best = NULL;
+  while (node) {
+    if (GET_SIZE(NODE_BLOCK(node)) >= size) {
+      best = node;
+      node = node->left;
+    } else {
+      node = node->right;
+    }
+  }
+  return best ? NODE_BLOCK(best) : NULL;
 }
 
-// 向后合并
-static struct mem_block* merge_with_next(struct mem_block *block) {
-    struct mem_block *next = block->next_global;
-    struct mem_block *next_next = next->next_global;
-    block->size += next->size;
-    block->next_global = next_next;
-    if (next_next) next_next->prev_global = block;
-    return block;
+void ufree_buddy(struct arena *a, struct mem_block *block);  // 见内存释放
+
+// 空闲索引：根据策略把空闲块加入快速链表或红黑树
+void free_index_insert(struct arena *a, struct mem_block *block) {
+  if (a->strategy == STRATEGY_QUICK_FIT) add_to_quick_list(a, block);
+  else if (a->strategy == STRATEGY_TLSF) tlsf_insert(a, block);
+  else if (a->strategy == STRATEGY_BUDDY) ufree_buddy(a, block);  // 按伙伴对齐拆分后插入，并与伙伴合并
+  else best_fit_insert(a, block);
 }
 
-// Best Fit 的 Free
-void ufree_best_fit(struct mem_block *block) {
-  if (block->prev_global && block->prev_global->is_free) block = merge_with_prev(block);  // 合并前一个块
-  if (block->next_global && block->next_global->is_free) block = merge_with_next(block);  // 合并后一个块
-  block->next = block->prev = NULL;  // 清理无用的指针
+// 将空闲块移出当前策略的空闲索引
+void free_index_remove(struct arena *a, struct mem_block *block) {
+  if (a->strategy == STRATEGY_QUICK_FIT) remove_from_quick_list(a, block);
+  else if (a->strategy == STRATEGY_TLSF) tlsf_remove(a, block);
+  else if (a->strategy == STRATEGY_BUDDY) buddy_remove(a, block);
+  else best_fit_remove(a, block);
 }
 
-// Quick Fit 的 Free
-void ufree_quick_fit(struct mem_block *block) {
-  remove_from_quick_list(block);  // 先移除自己
-  if (block->prev_global && block->prev_global->is_free) {
-    remove_from_quick_list(block->prev_global);  // 移除前一个块
-    block = merge_with_prev(block);  // 合并前一个块
+// 空闲索引中最大的块：红黑树取最右节点，快速链表和 TLSF 取最高的非空桶 (类) 中最大的块，伙伴系统取最高的非空阶
+static size_t free_index_largest(struct arena *a) {
+  if (a->strategy == STRATEGY_BUDDY) {
+    return a->buddy_bitmap ? BUDDY_MIN_SIZE << (63 - __builtin_clzl(a->buddy_bitmap)) : 0;
   }
-  if (block->next_global && block->next_global->is_free) {
-    remove_from_quick_list(block->next_global);  // 移除后一个块
-    block = merge_with_next(block);  // 合并后一个块
+  if (a->strategy == STRATEGY_TLSF) {
+    if (!a->tlsf_fl_bitmap) return 0;
+    int fl = 63 - __builtin_clzl(a->tlsf_fl_bitmap);
+    int sl = 31 - __builtin_clz(a->tlsf_sl_bitmap[fl]);
+    size_t largest = 0;
+    for (struct mem_block *b = a->tlsf_lists[fl][sl]; b; b = FREE_LINKS(b)->next) {
+      if (GET_SIZE(b) > largest) largest = GET_SIZE(b);
+    }
+    return largest;
+  }
+  if (a->strategy == STRATEGY_QUICK_FIT) {
+    if (!a->quick_summary) return 0;
+    int word = 63 - __builtin_clzl(a->quick_summary);
+    int index = (word << 6) + 63 - __builtin_clzl(a->quick_bitmap[word]);
+    size_t largest = 0;
+    for (struct mem_block *b = a->quick_lists[index]; b; b = FREE_LINKS(b)->next) {
+      if (GET_SIZE(b) > largest) largest = GET_SIZE(b);
+    }
+    return largest;
   }
-  add_to_quick_list(block);  // 将释放的块加入快速链表
+  struct rb_node *node = a->best_fit_root;
+  if (!node) return 0;
+  while (node->right) node = node->right;
+  return GET_SIZE(NODE_BLOCK(node));
 }
 
-// 统一释放内存的分发器
-void
-ufree(void *pa) {
-  if (pa == 0) return;
-  pthread_mutex_lock(&mem.lock);
+// ==================== 线程统计 ====================
+// 每个线程一份统计记录，只由所属线程写入 (普通加法加 relaxed 存储，快速路径上没有共享的原子操作)，
+// 读取时遍历所有记录合并。记录从不释放，线程退出后留给新线程复用，累计值随之延续
+#define HIST_BUCKETS UMALLOC_HIST_BUCKETS
+#define STAT_CLASSES UMALLOC_STAT_CLASSES
 
-  struct mem_block *block = GET_BLOCK(pa);
-  // 安全检查
-  if (block->is_free) {
-      pthread_mutex_unlock(&mem.lock);
-      return;
+struct thread_stats {
+  struct thread_stats *next;  // 所有记录串成只增不减的链表
+  int in_use;
+  size_t waste;  // 不持锁时 (线程缓存、远程释放) 内部碎片的变化量，按无符号回绕累加，求和后即为净变化
+  struct umalloc_class_stats classes[STAT_CLASSES];  // 按大小分级的操作计数
+  size_t malloc_latency[HIST_BUCKETS];  // umalloc 耗时的对数直方图
+  size_t free_latency[HIST_BUCKETS];  // ufree 耗时的对数直方图
+  struct trace_buffer *trace;  // 分配记录的缓冲区，首次记录时映射
+};
+
+static struct thread_stats *thread_stats_list;
+static struct thread_stats thread_stats_fallback;  // 映射失败时共用的记录
+static __thread struct thread_stats *thread_stats;
+static pthread_key_t thread_stats_key;  // 仅用于在线程退出时交还记录
+static pthread_once_t thread_stats_key_once = PTHREAD_ONCE_INIT;
+
+static void trace_flush(struct trace_buffer *b);
+
+static void thread_stats_exit(void *arg) {
+  struct thread_stats *t = arg;
+  if (t->trace) trace_flush(t->trace);
+  if (t != &thread_stats_fallback) __atomic_store_n(&t->in_use, 0, __ATOMIC_RELEASE);
+  thread_stats = NULL;  // 之后的析构函数若再次分配或释放，会重新认领
+}
+
+static void thread_stats_key_init(void) {
+  pthread_key_create(&thread_stats_key, thread_stats_exit);
+}
+
+// 为当前线程认领一条空闲记录，没有时新建一条压入链表
+static struct thread_stats* thread_stats_claim(void) {
+  for (struct thread_stats *t = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); t; t = t->next) {
+    int expected = 0;
+    if (!__atomic_load_n(&t->in_use, __ATOMIC_RELAXED) &&
+        __atomic_compare_exchange_n(&t->in_use, &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) return t;
   }
+  struct thread_stats *t = mmap(NULL, PAGE_ALIGN(sizeof(struct thread_stats)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (t == MAP_FAILED) return &thread_stats_fallback;
+  t->in_use = 1;
+  t->next = __atomic_load_n(&thread_stats_list, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&thread_stats_list, &t->next, t, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return t;
+}
 
-  block->is_free = 1;  // 标记为空闲
-  mem.used_memory -= block->size;
-  block->applyed_size = 0;  // 重置申请的大小
+// 当前线程的记录，首次使用时认领并注册线程退出回调
+static inline struct thread_stats* thread_stats_get(void) {
+  if (__builtin_expect(!thread_stats, 0)) {
+    thread_stats = thread_stats_claim();
+    pthread_once(&thread_stats_key_once, thread_stats_key_init);
+    pthread_setspecific(thread_stats_key, thread_stats);
+  }
+  return thread_stats;
+}
 
-  // 根据策略分发
-  if (mem.strategy == STRATEGY_BEST_FIT) {
-    ufree_best_fit(block);
-  } else if (mem.strategy == STRATEGY_QUICK_FIT) {
-    ufree_quick_fit(block);
+static inline void thread_stat_add(size_t *counter, size_t delta) {
+  __atomic_store_n(counter, *counter + delta, __ATOMIC_RELAXED);
+}
+
+// 统计用的大小分级：第 i 级为 [2^i, 2^(i+1))
+static inline int stat_class(size_t size) {
+  int c = size ? 63 - __builtin_clzl(size) : 0;
+  return c < STAT_CLASSES ? c : STAT_CLASSES - 1;
+}
+
+// 按大小分级计数，例如 CLASS_STAT(allocs, nbytes)
+#define CLASS_STAT(field, size) thread_stat_add(&thread_stats_get()->classes[stat_class(size)].field, 1)
+
+// 不持锁修改已分配块的申请大小 (线程缓存的取出/放入、远程释放)，内部碎片的变化记入当前线程
+static inline void block_set_applyed(struct mem_block *block, size_t nbytes) {
+  size_t old_waste = block_waste(block);
+  block->applyed_size = nbytes;
+  thread_stat_add(&thread_stats_get()->waste, block_waste(block) - old_waste);
+}
+
+// 计时：x86 上读时间戳计数器，其他平台用单调时钟的纳秒数；计时单位与纳秒的比例在读取统计时换算
+static inline uint64_t profile_clock(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+static inline uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 每个线程每 mem.profile 次调用抽样计时一次，返回本次调用是否计时
+static __thread unsigned int profile_countdown;
+static inline int profile_sample(void) {
+  if (!mem.profile) return 0;
+  if (profile_countdown) {
+    profile_countdown--;
+    return 0;
   }
+  profile_countdown = mem.profile - 1;
+  return 1;
+}
 
-  pthread_mutex_unlock(&mem.lock);
+// 把从 start 开始的耗时记入直方图：第 i 桶为 [2^i, 2^(i+1)) 个计时单位
+static inline void latency_record(size_t *hist, uint64_t start) {
+  uint64_t ticks = profile_clock() - start;
+  int bucket = ticks ? 63 - __builtin_clzll(ticks) : 0;
+  thread_stat_add(&hist[bucket], 1);
 }
 
 
-// =================== 统计 ==================
-// 碎片统计
-void 
-fragmentation_stats() {
-  pthread_mutex_lock(&mem.lock); // 替换锁
-
-  size_t total_free = 0;  // 记录总空闲内存
-  size_t largest_free = 0;  // 记录最大空闲块大小
-  size_t sum_unapplyed_size = 0;  // 记录申请的总大小
-  size_t block_count = 0;  // 记录空闲块数量
-
-  struct mem_block *curr = mem.globallist;
-  while (curr) {
-    if (curr->is_free) {
-      total_free += curr->size; 
-      if (curr->size > largest_free) {  // 记录外部碎片
-        largest_free = curr->size;
-      }
-      block_count++;
-    } else if (curr->is_free == 0 && curr->applyed_size > 0) {  // 记录内部碎片
-      sum_unapplyed_size += (curr->size - curr->applyed_size - sizeof(struct mem_block));  // 计算未使用的有效载荷总和 (不包括元数据)
-    }
-    curr = curr->next_global;
+// ==================== 分配记录 ====================
+// 记录期间公开接口的每次调用向当前线程的缓冲区追加一条事件。缓冲区满、线程退出或停止记录时整批写入文件，
+// 文件以 O_APPEND 打开，各线程的批次不会互相覆盖。停止记录的线程会替其他线程写出缓冲区，因此缓冲区带一把自旋锁
+#define TRACE_BUFFER_EVENTS 1024
+
+struct trace_buffer {
+  int lock;
+  unsigned int count;
+  struct umalloc_trace_event events[TRACE_BUFFER_EVENTS];
+};
+
+static uint32_t trace_threads;  // 已分配的线程编号
+static __thread uint32_t trace_thread;
+static __thread int trace_busy;  // 正在执行外层的 urealloc/ucalloc/ualigned_alloc，内部的 umalloc/ufree 不再记录
+
+#define TRACING() (__builtin_expect(__atomic_load_n(&mem.tracing, __ATOMIC_RELAXED), 0) && !trace_busy)
+
+static inline void trace_lock(struct trace_buffer *b) {
+  while (__atomic_exchange_n(&b->lock, 1, __ATOMIC_ACQUIRE)) sched_yield();
+}
+
+static inline void trace_unlock(struct trace_buffer *b) {
+  __atomic_store_n(&b->lock, 0, __ATOMIC_RELEASE);
+}
+
+// 持锁写出缓冲区中的事件，不改变调用者看到的 errno
+static void trace_write(struct trace_buffer *b) {
+  int saved = errno;
+  const char *p = (const char*)b->events;
+  size_t left = b->count * sizeof(struct umalloc_trace_event);
+  while (left > 0 && mem.trace_fd >= 0) {
+    ssize_t n = write(mem.trace_fd, p, left);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;  // 写入失败时丢弃这一批
+    p += n;
+    left -= n;
   }
+  b->count = 0;
+  errno = saved;
+}
 
-  size_t external_frag = 0;  // 记录外部碎片
-  if (total_free > 0) {
-    // 外部碎片率 = (1 - 最大连续空闲块大小 / 总空闲内存) × 100%
-    external_frag = (total_free - largest_free) * 10000 / total_free;  // 计算外部碎片百分比，这里保留两位小数
+static void trace_flush(struct trace_buffer *b) {
+  trace_lock(b);
+  if (b->count) trace_write(b);
+  trace_unlock(b);
+}
+
+// 追加一条事件，缓冲区映射失败时丢弃
+static void trace_event(uint32_t op, void *ptr, uint64_t aux, size_t size) {
+  uint64_t now = monotonic_ns();
+  struct thread_stats *t = thread_stats_get();
+  struct trace_buffer *b = __atomic_load_n(&t->trace, __ATOMIC_ACQUIRE);
+  if (!b) {
+    // 映射失败时共用的记录可能被多个线程同时安装缓冲区
+    b = mmap(NULL, PAGE_ALIGN(sizeof(struct trace_buffer)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (b == MAP_FAILED) return;
+    struct trace_buffer *expected = NULL;
+    if (!__atomic_compare_exchange_n(&t->trace, &expected, b, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      munmap(b, PAGE_ALIGN(sizeof(struct trace_buffer)));
+      b = expected;
+    }
   }
+  if (!trace_thread) trace_thread = __atomic_add_fetch(&trace_threads, 1, __ATOMIC_RELAXED);
 
-  size_t internal_frag = 0;  // 记录内部碎片，这里没有将元数据也算入内部碎片
-  if (sum_unapplyed_size > 0) {
-    // 内部碎片率 = 未使用的有效载荷总和 / 已分配的块总大小 × 100%
-    internal_frag = sum_unapplyed_size * 10000 / mem.used_memory;  // 计算内部碎片百分比，这里保留两位小数
+  trace_lock(b);
+  if (mem.tracing) {  // 停止记录后仍在途中的事件丢弃
+    b->events[b->count++] = (struct umalloc_trace_event){now, (uintptr_t)ptr, aux, size, trace_thread, op};
+    if (b->count == TRACE_BUFFER_EVENTS) trace_write(b);
   }
+  trace_unlock(b);
+}
 
-  printf("Memory Stats:\n");
-  printf("  Total: %zu bytes\n", mem.total_memory);
-  printf("  Used: %zu bytes\n", mem.used_memory);
-  printf("  Free: %zu bytes in %zu blocks\n", total_free, block_count);
-  printf("  Largest free block: %zu bytes\n", largest_free);
-  printf("  External: %zu.%02zu%%\n", external_frag / 100, external_frag % 100);
-  printf("  Internal: %zu.%02zu%%\n", internal_frag / 100, internal_frag % 100);
+// 开始把分配事件记录到 path (覆盖已有文件)，成功返回 0，失败或已在记录时返回 -1
+int
+umalloc_trace_start(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+  struct umalloc_trace_header header = {UMALLOC_TRACE_MAGIC, sizeof(struct umalloc_trace_event), 0};
+  if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+    close(fd);
+    return -1;
+  }
 
+  pthread_mutex_lock(&mem.lock);
+  if (mem.trace_fd >= 0) {
+    pthread_mutex_unlock(&mem.lock);
+    close(fd);
+    errno = EBUSY;
+    return -1;
+  }
+  mem.trace_fd = fd;
+  __atomic_store_n(&mem.tracing, 1, __ATOMIC_RELEASE);
   pthread_mutex_unlock(&mem.lock);
+  return 0;
 }
 
-
-// =================== 内存可视化 ==================
+// 停止记录：先让新事件不再进入缓冲区，再写出所有线程的缓冲区并关闭文件
 void
-visualize_memory() {
+umalloc_trace_stop(void) {
   pthread_mutex_lock(&mem.lock);
-
-  struct mem_block *curr = mem.globallist;
-  int total_blocks = 0;  // 内存总块数
-  int free_blocks = 0;  // 空闲块数
-  int used_blocks = 0;  // 已用块数
-  size_t total_free = 0;  // 空闲内存总大小
-  size_t total_used = 0;  // 已用内存总大小
-
-  // 统计内存块信息
-  while (curr) {
-    total_blocks++;
-    if (curr->is_free) {
-      free_blocks++;  // 空闲块
-      total_free += curr->size;
-    } else {
-      used_blocks++;  // 已用块
-      total_used += curr->size;
-    }
-    curr = curr->next_global;
+  if (mem.trace_fd < 0) {
+    pthread_mutex_unlock(&mem.lock);
+    return;
   }
-
-  int util = 0;  // 内存利用率
-  if (mem.total_memory > 0) {
-    util = (int)(total_used * 100 / mem.total_memory);
+  __atomic_store_n(&mem.tracing, 0, __ATOMIC_RELEASE);
+  for (struct thread_stats *t = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); t; t = t->next) {
+    if (t->trace) trace_flush(t->trace);
   }
+  if (thread_stats_fallback.trace) trace_flush(thread_stats_fallback.trace);
+  // 缓冲区都已清空，之后再写出的线程没有事件可写，不会用到已关闭的描述符
+  close(mem.trace_fd);
+  mem.trace_fd = -1;
+  pthread_mutex_unlock(&mem.lock);
+}
 
-  curr = mem.globallist;
 
-  // 打印内存布局
-  printf("\n+------------------------------------------------------------+\n");
-  printf("|                    MEMORY LAYOUT                           |\n");
-  printf("+------------------------------------------------------------+\n");
-  printf("| Total: %zu  Used: %zu  Free: %zu |\n",
-        mem.total_memory, total_used, total_free);
-  printf("| Blocks: %d (Used: %d Free: %d) Util: %d%% |\n",
-         total_blocks, used_blocks, free_blocks, util);
-  printf("+------------------------------------------------------------+\n");
+// ==================== 堆区域 ====================
+// 在 start 处为竞技场 a 建立一个新的堆区域，整个区域初始化为一个空闲块 (不加入空闲索引)
+static struct heap_region* new_region(struct arena *a, void *start, size_t size, size_t reserved) {
+  struct heap_region *region = (struct heap_region*)start;
+  region->next = NULL;
+  region->size = size;
+  region->reserved = reserved;
+  region->arena = a;
+  a->region_count++;
+  if (a->last_region) a->last_region->next = region;
+  else a->regions = region;
+  a->last_region = region;
 
-  if (curr) {
-    printf("| Addr Range: %p - %p |\n",
-           curr,
-           (void *)((char *)curr + mem.total_memory));
+  // 登记区域覆盖的每个 1 GB 地址槽
+  for (size_t i = 0; i < reserved >> REGION_SHIFT; i++) {
+    region_map[((uintptr_t)start >> REGION_SHIFT) + i] = region;
   }
 
-  printf("+------------------------------------------------------------+\n");
-  printf("| Address        | Memory State                              |\n");
-  printf("+------------------------------------------------------------+\n");
+  // 结尾块
+  struct mem_block *epilogue = REGION_EPILOGUE(region);
+  epilogue->size = 0;
+  epilogue->applyed_size = 0;
 
-  const size_t rows = 16;  // 设定可视化内存的行数
-  const size_t ROW_SIZE = mem.total_memory / rows;  // 每一行代表的内存空间
-  const size_t CHAR_SCALE = ROW_SIZE / 32;  // 每个字符代表的内存空间
-  uintptr_t base = (uintptr_t)mem.globallist;  // 基地址
-
-  for (size_t row = 0; row < rows; row++) {
-    uintptr_t row_addr = base + row * ROW_SIZE;  // 计算当前行的基地址
-    printf("| %p | ", (void *)row_addr);
-
-    // 逐字符绘制该行
-    for (size_t i = 0; i < ROW_SIZE / CHAR_SCALE; i++) {
-      uintptr_t addr = row_addr + i * CHAR_SCALE;  // 计算当前字符的基地址
-      struct mem_block *b = mem.globallist;
-      char c = ' ';
-
-      while (b) {
-        uintptr_t bs = (uintptr_t)b;
-        uintptr_t be = bs + b->size;
-        // 找到当前字符所在的内存块，并根据当前内存块的状态绘制字符
-        if (addr >= bs && addr < be) {
-          c = b->is_free ? '.' : '#';
-          break;
-        }
-        b = b->next_global;
-      }
-      printf("%c", c);
-    }
-    printf(" |\n");
+  // 伙伴系统的前导块，始终为已分配
+  if (a->strategy == STRATEGY_BUDDY) {
+    struct mem_block *prologue = REGION_FIRST_BLOCK(region);
+    prologue->size = BUDDY_PROLOGUE_SIZE;
+    prologue->applyed_size = 0;
   }
 
-  printf("+------------------------------------------------------------+\n");
-  printf("| Legend: # = Used (%zu B)   . = Free (%zu B)                    |\n", CHAR_SCALE, CHAR_SCALE);
-  printf("+------------------------------------------------------------+\n");
+  // 第一个空闲块：前面没有块或是前导块，因此 BLOCK_PREV_FREE 始终为 0
+  struct mem_block *first_block = region_first_free(a, region);
+  first_block->size = size - region_overhead(a->strategy);
+  first_block->applyed_size = 0;
+  mark_free(first_block);
+  return region;
+}
 
-  pthread_mutex_unlock(&mem.lock);
+// 预留 reserve_size (1 GB 的整数倍) 字节、按 1 GB 对齐的虚拟地址空间，不占用物理内存。
+// 多预留一个对齐单位，再把首尾多余的部分解除映射
+static char* reserve_aligned(size_t reserve_size) {
+  char *map = mmap(NULL, reserve_size + HEAP_RESERVE_SIZE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (map == MAP_FAILED) return NULL;
+  char *start = (char*)(((uintptr_t)map + HEAP_RESERVE_SIZE - 1) & ~(HEAP_RESERVE_SIZE - 1));
+  if (start > map) munmap(map, start - map);
+  munmap(start + reserve_size, map + HEAP_RESERVE_SIZE - start);
+  return start;
 }
 
+// 预留一个新的堆区域，并提交开头的 commit_size 字节 (按提交粒度向上取整)
+static struct heap_region* reserve_region(struct arena *a, size_t commit_size) {
+  commit_size = commit_align(commit_size);
+  size_t reserve_size = (commit_size + HEAP_RESERVE_SIZE - 1) & ~(HEAP_RESERVE_SIZE - 1);
+  char *start = reserve_aligned(reserve_size);
+  if (!start) return NULL;
+  if (mem.hugepage) madvise(start, reserve_size, MADV_HUGEPAGE);  // 标记整个预留范围，之后提交的部分同样适用
 
-// =================== 统一 malloc 接口 ==================
-void*
-umalloc(size_t nbytes)
-{
-  // 首次调用时初始化内存管理器 (选定策略)
-  if (mem.total_memory == 0) {
-    mem_init(4096, STRATEGY_BEST_FIT);
-    // mem_init(4096, STRATEGY_QUICK_FIT);
+  if (mprotect(start, commit_size, PROT_READ | PROT_WRITE) != 0) {
+    munmap(start, reserve_size);
+    return NULL;
   }
+  return new_region(a, start, commit_size, reserve_size);
+}
 
-  if (mem.strategy == STRATEGY_BEST_FIT) return umalloc_best_fit(nbytes);  // 使用最佳适应分配
-  else if (mem.strategy == STRATEGY_QUICK_FIT) return umalloc_quick_fit(nbytes);  // 使用快速适配分配
+// 扩展堆函数，返回一个足够大的空闲块 (不在空闲索引中)
+// 优先在尾区域的预留空间内继续提交，每次提交量至少为已提交大小 (几何增长)，从而摊还扩展次数
+struct mem_block* extend_heap(struct arena *a, size_t min_size) {
+  struct heap_region *last = a->last_region;
+  struct mem_block *epilogue = REGION_EPILOGUE(last);
 
-  return NULL;
+  // 尾部的空闲块会与新提交的内存合并，只需补足差额
+  size_t trailing_free = IS_PREV_FREE(epilogue) ? GET_SIZE(PREV_BLOCK(epilogue)) : 0;
+  size_t need = PAGE_ALIGN(min_size > trailing_free ? min_size - trailing_free : 0);
+  if (need == 0) {
+    // 尾部的空闲块已经放得下 (调用者的查找没有覆盖它，例如 TLSF 按上取整后的级别查找)，直接取出，不扩展
+    struct mem_block *tail = PREV_BLOCK(epilogue);
+    free_index_remove(a, tail);
+    a->fresh = NULL;
+    return tail;
+  }
+  CLASS_STAT(extends, min_size);  // 只统计真正提交或预留内存的扩展
+  size_t extend_size = last->size < HEAP_COMMIT_MAX ? last->size : HEAP_COMMIT_MAX;
+  if (extend_size < need) extend_size = need;
+  extend_size = commit_align(last->size + extend_size) - last->size;
+  if (extend_size > last->reserved - last->size) extend_size = last->reserved - last->size;
+
+  struct mem_block *new_block;
+  if (extend_size >= need &&
+      mprotect((char*)last + last->size, extend_size, PROT_READ | PROT_WRITE) == 0) {
+    // 原结尾块的位置成为新块的头部
+    new_block = epilogue;
+    last->size += extend_size;
+    new_block->size = extend_size | (new_block->size & BLOCK_PREV_FREE);
+    new_block->applyed_size = 0;
+    epilogue = REGION_EPILOGUE(last);
+    epilogue->size = 0;
+    epilogue->applyed_size = 0;
+    mark_free(new_block);
+
+    // 区域末尾原本是空闲块时，直接合并
+    a->fresh = new_block;
+    if (IS_PREV_FREE(new_block)) {
+      a->fresh = NULL;  // 合并后块的前半部分不是新提交的内存
+      struct mem_block *prev = PREV_BLOCK(new_block);
+      free_index_remove(a, prev);
+      unpurge(a, prev);
+      set_size(prev, GET_SIZE(prev) + GET_SIZE(new_block));
+      new_block = prev;
+      mark_free(new_block);
+    }
+  } else {
+    // 尾区域的预留空间已用完，预留新的区域
+    extend_size = PAGE_ALIGN(min_size + region_overhead(a->strategy));
+    struct heap_region *region = reserve_region(a, extend_size);
+    if (!region) return NULL;  // 内存不足
+    extend_size = region->size;
+    new_block = region_first_free(a, region);
+    a->fresh = new_block;
+  }
+
+  a->total_memory += extend_size;  // 更新总内存大小
+  a->grow_count++;
+  return new_block;
+}
+
+
+// ==================== 竞技场 =====================
+static __thread struct arena *thread_arena;  // 当前线程使用的竞技场
+static __thread unsigned int thread_contention;  // 当前线程在该竞技场上遇到的锁争用次数
+
+// 发布统计快照，调用者需持有 a->lock (同一时刻只有一个写者)。
+// 顺序锁：写者先把计数改为奇数，写完副本后再改为偶数；读者在前后两次读到相同的偶数时才接受读到的副本
+static void arena_publish(struct arena *a) {
+  struct arena_stats stats = {
+    .heap_memory = a->total_memory,
+    .used_memory = a->used_memory,
+    .free_memory = a->total_memory - a->used_memory - a->region_count * region_overhead(a->strategy),  // 已提交的堆中除去已分配块和区域开销都是空闲块
+    .free_count = a->free_count,
+    .largest_free = a->largest_free,
+    .waste = a->waste,
+    .purged_memory = a->purged_memory,
+    .trimmed_memory = a->trimmed_memory,
+    .grow_count = a->grow_count,
+    .large_memory = a->large_memory,
+    .large_count = a->large_count,
+    .run_memory = a->run_memory,
+    .run_count = a->run_count,
+    .slab_used = a->slab_used,
+    .remote_drained = a->remote_drained,
+    .deferred_count = a->deferred_count,
+    .deferred_memory = a->deferred_memory,
+    .coalesce_passes = a->coalesce_passes,
+    .coalesce_merges = a->coalesce_merges,
+    .coalesce_ns = a->coalesce_ns,
+    .largest_dirty = a->largest_dirty,
+  };
+  const size_t *src = (const size_t*)&stats;
+  size_t *dst = (size_t*)&a->published;
+  size_t seq = a->stats_seq;
+  __atomic_store_n(&a->stats_seq, seq + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  for (size_t i = 0; i < ARENA_STATS_WORDS; i++) __atomic_store_n(&dst[i], src[i], __ATOMIC_RELAXED);
+  __atomic_store_n(&a->stats_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+// 不加锁读取竞技场的统计快照，与发布冲突时重试
+static void arena_stats_read(struct arena *a, struct arena_stats *out) {
+  const size_t *src = (const size_t*)&a->published;
+  size_t *dst = (size_t*)out;
+  size_t seq;
+  do {
+    seq = __atomic_load_n(&a->stats_seq, __ATOMIC_ACQUIRE);
+    for (size_t i = 0; i < ARENA_STATS_WORDS; i++) dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  } while ((seq & 1) || seq != __atomic_load_n(&a->stats_seq, __ATOMIC_RELAXED));
+}
+
+// 创建一个竞技场并提交 heap_size 字节的初始堆。共享的竞技场由持有 mem.lock 的调用者登记到 mem.arenas
+static struct arena* arena_create(unsigned int index, allocation_strategy strategy, size_t heap_size) {
+  struct arena *a = mmap(NULL, PAGE_ALIGN(sizeof(struct arena)), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (a == MAP_FAILED) return NULL;
+  pthread_mutex_init(&a->lock, NULL);
+  a->index = index;
+  a->strategy = strategy;
+
+  // 初始化空闲索引
+  if (a->strategy == STRATEGY_QUICK_FIT) {
+    init_quick_lists(a);
+  } else if (a->strategy == STRATEGY_TLSF) {
+    init_tlsf(a);
+  } else if (a->strategy == STRATEGY_BUDDY) {
+    init_buddy(a);
+  } else if (a->strategy == STRATEGY_BEST_FIT) {
+    a->best_fit_root = NULL;
+  }
+
+  // 初始堆为一个区域，其中只有一个空闲块
+  struct heap_region *region = reserve_region(a, heap_size);
+  if (!region) {
+    munmap(a, PAGE_ALIGN(sizeof(struct arena)));
+    return NULL;
+  }
+  a->total_memory = region->size;
+  free_index_insert(a, region_first_free(a, region));  // 加入空闲索引
+  arena_publish(a);
+  return a;
+}
+
+// 获取竞技场的锁，发生争用时计数，供线程重新选择竞技场时参考
+static inline void arena_lock(struct arena *a) {
+  if (pthread_mutex_trylock(&a->lock) == 0) return;
+  __atomic_fetch_add(&a->contention, 1, __ATOMIC_RELAXED);
+  if (a == thread_arena) thread_contention++;
+  pthread_mutex_lock(&a->lock);
+}
+
+// 发布竞技场的统计快照后释放锁
+static inline void arena_unlock(struct arena *a) {
+  arena_publish(a);
+  pthread_mutex_unlock(&a->lock);
+}
+
+// 为线程选择竞技场：新线程轮转分配，争用严重的线程换到累计争用最少的竞技场 (尚未创建的计为 0)
+static struct arena* arena_choose(struct arena *current) {
+  pthread_mutex_lock(&mem.lock);
+  unsigned int index;
+  if (!current) {
+    index = mem.arena_next++ % mem.arena_count;
+  } else {
+    index = current->index < mem.arena_count ? current->index : 0;
+    size_t least = mem.arenas[index] ? __atomic_load_n(&mem.arenas[index]->contention, __ATOMIC_RELAXED) : 0;
+    for (unsigned int i = 0; i < mem.arena_count; i++) {
+      size_t contention = mem.arenas[i] ? __atomic_load_n(&mem.arenas[i]->contention, __ATOMIC_RELAXED) : 0;
+      if (contention < least) {
+        least = contention;
+        index = i;
+      }
+    }
+  }
+  if (!mem.arenas[index]) __atomic_store_n(&mem.arenas[index], arena_create(index, mem.strategy, mem.heap_size), __ATOMIC_RELEASE);  // 统计读者不持 mem.lock
+  struct arena *a = mem.arenas[index] ? mem.arenas[index] : mem.arenas[0];  // 创建失败时退回第一个竞技场
+  pthread_mutex_unlock(&mem.lock);
+  return a;
+}
+
+// 当前线程的竞技场，首次调用、争用过多或竞技场数量被调小时重新选择
+static struct arena* arena_get(void) {
+  if (thread_arena && thread_contention < ARENA_REBALANCE && thread_arena->index < mem.arena_count) return thread_arena;
+  thread_contention = 0;
+  thread_arena = arena_choose(thread_arena);
+  return thread_arena;
+}
+
+// 块所属的竞技场
+static inline struct arena* arena_of(struct mem_block *block) {
+  return REGION_OF(block)->arena;
+}
+
+// 远程释放：线程释放不属于自己竞技场的块时，不获取对方的锁，而是用一次 CAS 把它压入对方的远程释放栈，
+// 由对方在下一次慢路径分配 (持锁) 时整批取走。栈上的元素是用户指针，链接指针存放在有效载荷开头
+#define REMOTE_NEXT(ptr) (*(void**)(ptr))
+
+// 把 first ... last 串成的链整体压入 a 的远程释放栈
+static inline void remote_push(struct arena *a, void *first, void *last) {
+  void *head = __atomic_load_n(&a->remote_free, __ATOMIC_RELAXED);
+  do {
+    REMOTE_NEXT(last) = head;
+  } while (!__atomic_compare_exchange_n(&a->remote_free, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+// 判断当前线程释放 a 中的内存是否应走远程释放
+static inline int is_remote(struct arena *a) {
+  return a != thread_arena;
+}
+
+
+// ==================== 初始化 =====================
+// fork 安全：fork 前按 mem.lock、各竞技场的顺序取得所有锁 (与回收线程的加锁顺序一致)，
+// 保证子进程复制到的堆处于一致状态。子进程中只剩调用 fork 的线程，锁重新初始化，后台回收线程和分配记录不再继续
+static void fork_prepare(void) {
+  pthread_mutex_lock(&mem.lock);
+  for (int i = 0; i < ARENA_MAX; i++) {
+    if (mem.arenas[i]) pthread_mutex_lock(&mem.arenas[i]->lock);
+  }
+  for (struct arena *h = mem.heaps; h; h = h->heap_next) pthread_mutex_lock(&h->lock);
+}
+
+static void fork_parent(void) {
+  for (struct arena *h = mem.heaps; h; h = h->heap_next) pthread_mutex_unlock(&h->lock);
+  for (int i = ARENA_MAX - 1; i >= 0; i--) {
+    if (mem.arenas[i]) pthread_mutex_unlock(&mem.arenas[i]->lock);
+  }
+  pthread_mutex_unlock(&mem.lock);
+}
+
+static void cpu_cache_fork_child(void);
+
+static void fork_child(void) {
+  for (int i = 0; i < ARENA_MAX; i++) {
+    if (mem.arenas[i]) pthread_mutex_init(&mem.arenas[i]->lock, NULL);
+  }
+  for (struct arena *h = mem.heaps; h; h = h->heap_next) pthread_mutex_init(&h->lock, NULL);
+  pthread_mutex_init(&mem.lock, NULL);
+  pthread_cond_init(&mem.scavenger_cond, NULL);
+  mem.scavenger_running = 0;
+  cpu_cache_fork_child();
+  // 父进程的缓冲区里还有未写出的事件，子进程不再写入同一个文件
+  mem.tracing = 0;
+  if (mem.trace_fd >= 0) close(mem.trace_fd);
+  mem.trace_fd = -1;
+}
+
+void
+mem_init(size_t heap_size, allocation_strategy strategy) {
+  pthread_mutex_lock(&mem.lock);  // 获取锁
+  // 如果已经初始化过了，直接解锁退出
+  if (mem.initialized) {
+    pthread_mutex_unlock(&mem.lock);
+    return;
+  }
+
+  mem.page_size = sysconf(_SC_PAGESIZE);  // 获取系统页大小
+  heap_size = PAGE_ALIGN(heap_size);
+  if (heap_size < region_overhead(strategy) + MIN_BLOCK_SIZE) heap_size = PAGE_ALIGN(region_overhead(strategy) + MIN_BLOCK_SIZE);
+  mem.heap_size = heap_size;
+  mem.strategy = strategy;  // 设置分配策略，所有竞技场使用相同的策略
+  mem.clock_ticks = profile_clock();
+  mem.clock_ns = monotonic_ns();
+
+  // 竞技场数量默认为在线 CPU 数的若干倍
+  if (mem.arena_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus < 1) cpus = 1;
+    mem.arena_count = cpus * ARENA_PER_CPU < ARENA_MAX ? (unsigned int)cpus * ARENA_PER_CPU : ARENA_MAX;
+  }
+
+  // 第一个竞技场立即创建，其余的在轮转到时再创建
+  __atomic_store_n(&mem.arenas[0], arena_create(0, mem.strategy, mem.heap_size), __ATOMIC_RELEASE);
+  if (mem.arenas[0] == NULL) {
+      pthread_mutex_unlock(&mem.lock); // 失败解锁
+      perror("mem_init: mmap failed");
+      exit(1);
+  }
+  mem.initialized = 1;
+
+  // 释放锁
+  pthread_mutex_unlock(&mem.lock);
+
+  // 注册时可能分配内存 (作为 malloc 使用时会重入)，因此在释放锁之后进行
+  pthread_atfork(fork_prepare, fork_parent, fork_child);
+}
+
+
+// ==================== 分配与分割 ===================
+// 从空闲块 block (已移出空闲索引) 的开头切出 required_size 字节分配出去，
+// 剩余空间 >= 最小空闲块时分割出新的空闲块并放回空闲索引
+static void place_block(struct arena *a, struct mem_block *block, size_t required_size, size_t nbytes) {
+  unpurge(a, block);
+  size_t size = GET_SIZE(block);
+  block->applyed_size = nbytes;  // 记录用户申请的大小
+
+  if (size - required_size >= MIN_BLOCK_SIZE) {
+    CLASS_STAT(splits, size);
+    struct mem_block *new_block = (struct mem_block*)((char*)block + required_size);  // 在C语言中，指针加减法是以指向类型的大小为单位
+    new_block->size = size - required_size;  // 前一块即将被分配，不带 BLOCK_PREV_FREE
+    new_block->applyed_size = 0;
+    set_size(block, required_size);
+    mark_free(new_block);
+    free_index_insert(a, new_block);  // 剩余块加入空闲索引
+  }
+
+  mark_used(block);
+  a->used_memory += GET_SIZE(block);
+  a->waste += block_waste(block);
+}
+
+
+// ==================== 快速适配分配 ===================
+static void quick_fit_coalesce(struct arena *a);  // 见内存释放
+
+// 取出一个不小于 required_size 的空闲块 (移出空闲索引)，没有时扩展堆，调用者需持有 a->lock
+static struct mem_block* quick_fit_take(struct arena *a, size_t required_size) {
+  int index = quick_list_index(required_size);
+  struct mem_block *block = NULL;
+
+  // 精确级中的块大小恰好等于所需大小；范围级中的块可能偏小，所以从下一级开始查找，
+  // 这样位图找到的第一个非空桶的表头一定可用，不需要遍历链表
+  int start = quick_list_is_exact(index) ? index : index + 1;
+  int found_index = quick_bitmap_find(a, start);
+  if (found_index >= 0) {
+    block = a->quick_lists[found_index];
+    remove_from_quick_list(a, block);  // 从快速链表中摘除
+    return block;
+  }
+
+  // 更高的级都为空时，才在本级范围桶中逐个查找
+  if (!quick_list_is_exact(index)) {
+    size_t scans = 0;
+    for (block = a->quick_lists[index]; block; block = FREE_LINKS(block)->next) {
+      scans++;
+      if (GET_SIZE(block) >= required_size) break;
+    }
+    thread_stat_add(&thread_stats_get()->classes[stat_class(required_size)].scans, scans);
+    if (block) {
+      remove_from_quick_list(a, block);
+      return block;
+    }
+  }
+
+  // 有延迟合并的块时，先批量合并再查找一次
+  if (a->deferred_count) {
+    quick_fit_coalesce(a);
+    return quick_fit_take(a, required_size);
+  }
+
+  // 快速链表没找到，扩展堆
+  return extend_heap(a, required_size);  // 返回 NULL 说明内存不足
+}
+
+// 调用者需持有 a->lock
+void*
+umalloc_quick_fit(struct arena *a, size_t nbytes) { 
+  if (nbytes <= 0) return NULL;
+
+  size_t required_size = BLOCK_SIZE(nbytes);  // 计算所需内存块大小
+  struct mem_block *block = NULL;
+  if (required_size < DEFER_MAX_SIZE) block = defer_pop(a, required_size);  // 大小恰好相同的延迟块，直接复用
+  if (!block) block = quick_fit_take(a, required_size);
+  if (!block) return NULL;  // 说明内存不足
+  place_block(a, block, required_size, nbytes);  // 标记为已分配并分割剩余空间
+  return (void*)((char*)block + sizeof(struct mem_block));  // 返回用户可用的内存地址
+}
+
+
+// ==================== TLSF 分配 ===================
+// 取出一个不小于 required_size 的空闲块 (移出空闲索引)，没有时扩展堆，调用者需持有 a->lock。
+// 先把大小向上取整到下一个类的起点，这样找到的非空类中任何一个块都够用，直接取表头，
+// 查找只有两次位图运算，不遍历链表 (代价是可能跳过本类中恰好够用的块)
+static struct mem_block* tlsf_take(struct arena *a, size_t required_size) {
+  size_t size = required_size;
+  if (size >= TLSF_SMALL_MAX) size += (1UL << (63 - __builtin_clzl(size) - TLSF_SL_SHIFT)) - 1;
+  int fl, sl;
+  tlsf_mapping(size, &fl, &sl);
+  if (fl < TLSF_FL_COUNT && tlsf_find(a, &fl, &sl)) {
+    struct mem_block *block = a->tlsf_lists[fl][sl];
+    tlsf_remove(a, block);
+    return block;
+  }
+  // 更大的级别都为空时，所需大小本身所在级别的链表头仍可能放得下，只检查链表头以保持常数时间
+  tlsf_mapping(required_size, &fl, &sl);
+  if (fl < TLSF_FL_COUNT) {
+    struct mem_block *block = a->tlsf_lists[fl][sl];
+    if (block && GET_SIZE(block) >= required_size) {
+      tlsf_remove(a, block);
+      return block;
+    }
+  }
+  return extend_heap(a, required_size);  // 返回 NULL 说明内存不足
+}
+
+// 调用者需持有 a->lock
+void*
+umalloc_tlsf(struct arena *a, size_t nbytes) {
+  if (nbytes <= 0) return NULL;
+
+  size_t required_size = BLOCK_SIZE(nbytes);  // 计算所需内存块大小
+  struct mem_block *block = tlsf_take(a, required_size);
+  if (!block) return NULL;  // 说明内存不足
+  place_block(a, block, required_size, nbytes);  // 标记为已分配并分割剩余空间
+  return (void*)((char*)block + sizeof(struct mem_block));  // 返回用户可用的内存地址
+}
+
+
+// ==================== 伙伴系统分配 ===================
+// 取出一个大小恰为 size (2 的幂) 的空闲块 (移出空闲索引)，调用者需持有 a->lock。
+// 从不小于所需阶的第一个非空阶中取块，逐级对半分割，高地址的一半放回低一阶的链表
+static struct mem_block* buddy_take(struct arena *a, size_t size) {
+  int order = buddy_order(size);
+  int found = buddy_find(a, order);
+  if (found < 0) {
+    // 扩展得到的内存按伙伴对齐拆分后，2 倍大小的区间中一定有一个对齐的 size 大小的块
+    struct mem_block *block = extend_heap(a, 2 * size);
+    if (!block) return NULL;  // 说明内存不足
+    a->fresh = NULL;  // 拆分与合并会在新内存中写入块头，ucalloc 不能跳过清零
+    ufree_buddy(a, block);
+    found = buddy_find(a, order);
+    if (found < 0) return NULL;
+  }
+
+  struct mem_block *block = a->buddy_lists[found];
+  buddy_remove(a, block);
+  unpurge(a, block);
+  while (found > order) {
+    CLASS_STAT(splits, GET_SIZE(block));
+    size_t half = GET_SIZE(block) >> 1;
+    struct mem_block *upper = (struct mem_block*)((char*)block + half);
+    upper->size = half;
+    upper->applyed_size = 0;
+    set_size(block, half);
+    mark_free(upper);
+    buddy_insert(a, upper);
+    found--;
+  }
+  return block;
+}
+
+// 调用者需持有 a->lock
+void*
+umalloc_buddy(struct arena *a, size_t nbytes) {
+  if (nbytes <= 0) return NULL;
+
+  size_t required_size = buddy_block_size(BLOCK_SIZE(nbytes));  // 向上取整到 2 的幂，多出的部分计入内部碎片
+  struct mem_block *block = buddy_take(a, required_size);
+  if (!block) return NULL;  // 说明内存不足
+  place_block(a, block, required_size, nbytes);  // 大小恰好，不会分割
+  return (void*)((char*)block + sizeof(struct mem_block));
+}
+
+
+// ==================== 最佳适应分配 ===================
+// 取出不小于 required_size 的最小空闲块 (移出空闲索引)，没有时扩展堆，调用者需持有 a->lock
+static struct mem_block* best_fit_take(struct arena *a, size_t required_size) {
+  // 在空闲块红黑树中查找最佳适配块
+  struct mem_block *best = best_fit_search(a, required_size);
+  if (best) {
+    best_fit_remove(a, best);
+    return best;
+  }
+  // 没有找到最合适的块
+  return extend_heap(a, required_size);  // 返回 NULL 说明内存不足
+}
+
+// 调用者需持有 a->lock
+void*
+umalloc_best_fit(struct arena *a, size_t nbytes) {
+  if (nbytes <= 0) return NULL;
+
+  size_t required_size = BLOCK_SIZE(nbytes);  // 计算所需内存块大小
+  struct mem_block *best = best_fit_take(a, required_size);
+  if (!best) return NULL;  // 说明内存不足
+
+  // 分割块 (剩余空间足够大)：剩余空间 >= 最小空闲块
+  place_block(a, best, required_size, nbytes);
+
+  return (void*)((char*)best + sizeof(struct mem_block));  // 返回用户可用的内存地址, 藏内部管理信息（元数据）
+}
+
+// 按竞技场的策略从堆中分配，调用者需持有 a->lock
+static void* heap_alloc(struct arena *a, size_t nbytes) {
+  if (a->strategy == STRATEGY_QUICK_FIT) return umalloc_quick_fit(a, nbytes);  // 使用快速适配分配
+  if (a->strategy == STRATEGY_TLSF) return umalloc_tlsf(a, nbytes);  // 使用 TLSF 分配
+  if (a->strategy == STRATEGY_BUDDY) return umalloc_buddy(a, nbytes);  // 使用伙伴系统分配
+  return umalloc_best_fit(a, nbytes);  // 使用最佳适应分配
+}
+
+// 按竞技场的策略取出一个不小于 required_size 的空闲块 (不分割)，调用者需持有 a->lock
+static struct mem_block* heap_take(struct arena *a, size_t required_size) {
+  if (a->strategy == STRATEGY_QUICK_FIT) return quick_fit_take(a, required_size);
+  if (a->strategy == STRATEGY_TLSF) return tlsf_take(a, required_size);
+  if (a->strategy == STRATEGY_BUDDY) return buddy_take(a, buddy_block_size(required_size));
+  return best_fit_take(a, required_size);
+}
+
+// 按对齐要求从堆中分配 (alignment 为大于 16 的 2 的幂)，调用者需持有 a->lock。
+// 多取出 alignment + MIN_BLOCK_SIZE 字节，把对齐前的填充分割为独立的空闲块放回空闲索引
+static void* heap_alloc_aligned(struct arena *a, size_t alignment, size_t nbytes) {
+  size_t required_size = BLOCK_SIZE(nbytes);
+  if (a->strategy == STRATEGY_BUDDY) {
+    // 伙伴块的有效载荷按块大小对齐 (至多一页，更大的对齐由 aligned_dispatch 交给大对象映射)
+    size_t size = buddy_block_size(required_size > alignment ? required_size : alignment);
+    struct mem_block *block = buddy_take(a, size);
+    if (!block) return NULL;
+    place_block(a, block, size, nbytes);
+    return (void*)((char*)block + sizeof(struct mem_block));
+  }
+  size_t take_size = required_size + alignment + MIN_BLOCK_SIZE;
+  struct mem_block *block = heap_take(a, take_size);
+  if (!block) return NULL;  // 说明内存不足
+  unpurge(a, block);
+
+  uintptr_t payload = (uintptr_t)block + sizeof(struct mem_block);
+  uintptr_t aligned = (payload + alignment - 1) & ~(alignment - 1);
+  if (aligned != payload && aligned - payload < MIN_BLOCK_SIZE) aligned += alignment;  // 填充太小，不足以成为空闲块
+  if (aligned != payload) {
+    // 取出的块前面一定是已分配块，填充部分成为新的空闲块
+    size_t pad = aligned - payload;
+    struct mem_block *lead = block;
+    CLASS_STAT(splits, GET_SIZE(lead));
+    block = (struct mem_block*)((char*)lead + pad);
+    block->size = GET_SIZE(lead) - pad;
+    block->applyed_size = 0;
+    set_size(lead, pad);
+    mark_free(lead);
+    free_index_insert(a, lead);
+  }
+
+  place_block(a, block, required_size, nbytes);
+  return (void*)((char*)block + sizeof(struct mem_block));
+}
+
+
+// 批量分配 count 个同样大小的块，调用者需持有 a->lock。
+// 只查找一次：取出一个能容纳全部对象的空闲块，从头依次切出，剩余部分放回空闲索引；取不到时逐个分配
+static size_t heap_alloc_batch(struct arena *a, size_t nbytes, size_t count, void **out) {
+  size_t required_size = BLOCK_SIZE(nbytes);
+  size_t total_size;
+  // 伙伴系统的每个块都必须按自身大小对齐，不能从一个大块中依次切出；总大小溢出时同样逐个分配
+  struct mem_block *block = (a->strategy == STRATEGY_BUDDY || __builtin_mul_overflow(required_size, count, &total_size))
+                            ? NULL : heap_take(a, total_size);
+  if (!block) {
+    size_t n = 0;
+    while (n < count && (out[n] = heap_alloc(a, nbytes))) n++;
+    return n;
+  }
+  unpurge(a, block);
+
+  // 取出的块前面一定是已分配块，切出的块都不带 BLOCK_PREV_FREE
+  size_t remain = GET_SIZE(block);
+  char *cur = (char*)block;
+  struct mem_block *last = NULL;
+  for (size_t i = 0; i < count; i++) {
+    last = (struct mem_block*)cur;
+    last->size = required_size;
+    last->applyed_size = nbytes;
+    out[i] = cur + sizeof(struct mem_block);
+    cur += required_size;
+    remain -= required_size;
+  }
+
+  if (remain >= MIN_BLOCK_SIZE) {
+    CLASS_STAT(splits, GET_SIZE(block));
+    struct mem_block *rest = (struct mem_block*)cur;
+    rest->size = remain;
+    rest->applyed_size = 0;
+    mark_free(rest);
+    free_index_insert(a, rest);
+  } else {
+    set_size(last, required_size + remain);  // 剩余太小，并入最后一个块
+    mark_used(last);
+  }
+  a->used_memory += (size_t)((char*)NEXT_BLOCK(last) - (char*)block);
+  a->waste += (count - 1) * (required_size - sizeof(struct mem_block) - nbytes) + block_waste(last);
+  return count;
+}
+
+
+// ==================== 内存释放 ===================
+// 向前合并：前一块的脚部给出它的大小 (仅当 BLOCK_PREV_FREE 置位时调用)
+static struct mem_block* merge_with_prev(struct arena *a, struct mem_block *block) {
+    struct mem_block *prev = PREV_BLOCK(block);
+    CLASS_STAT(coalesces, GET_SIZE(block));
+    unpurge(a, prev);
+    unpurge(a, block);
+    set_size(prev, GET_SIZE(prev) + GET_SIZE(block));
+    return prev; // 返回合并后的指针
+}
+
+// 向后合并：后一块紧跟在本块之后
+static struct mem_block* merge_with_next(struct arena *a, struct mem_block *block) {
+    struct mem_block *next = NEXT_BLOCK(block);
+    CLASS_STAT(coalesces, GET_SIZE(block));
+    unpurge(a, next);
+    unpurge(a, block);
+    set_size(block, GET_SIZE(block) + GET_SIZE(next));
+    return block;
+}
+
+// Best Fit 的 Free
+// 前一个块已在树中时，合并后原地更新它的位置；否则把合并结果插入树中
+void ufree_best_fit(struct arena *a, struct mem_block *block) {
+  int in_tree = 0;
+  if (IS_FREE(NEXT_BLOCK(block))) {
+    best_fit_remove(a, NEXT_BLOCK(block));  // 后一个块将被吞并，先从树中删除
+    block = merge_with_next(a, block);  // 合并后一个块
+  }
+  if (IS_PREV_FREE(block)) {
+    block = merge_with_prev(a, block);  // 合并前一个块
+    in_tree = 1;
+  }
+  mark_free(block);  // 写入脚部
+  if (in_tree) best_fit_grow(a, block);
+  else best_fit_insert(a, block);
+}
+
+// 与相邻的空闲块合并后放入快速链表
+static void quick_fit_release(struct arena *a, struct mem_block *block) {
+  if (IS_PREV_FREE(block)) {
+    remove_from_quick_list(a, PREV_BLOCK(block));  // 移除前一个块
+    block = merge_with_prev(a, block);  // 合并前一个块
+  }
+  if (IS_FREE(NEXT_BLOCK(block))) {
+    remove_from_quick_list(a, NEXT_BLOCK(block));  // 移除后一个块
+    block = merge_with_next(a, block);  // 合并后一个块
+  }
+  mark_free(block);  // 写入脚部
+  add_to_quick_list(a, block);  // 将释放的块加入快速链表
+}
+
+// Quick Fit 的 Free
+// 开启延迟合并时，小块保持已分配状态放入延迟链表，由 quick_fit_coalesce 批量合并
+void ufree_quick_fit(struct arena *a, struct mem_block *block) {
+  if (mem.defer_coalesce && GET_SIZE(block) < DEFER_MAX_SIZE) {
+    defer_push(a, block);
+    if (a->deferred_memory * 100 > a->total_memory * mem.defer_coalesce) quick_fit_coalesce(a);  // 超过碎片阈值
+    return;
+  }
+  quick_fit_release(a, block);
+}
+
+// 批量合并：取出所有延迟块，按普通释放流程与相邻的空闲块合并。
+// 相邻的两个延迟块中，先取出的一个看到对方仍是已分配状态，后取出的一个再与它合并
+static void quick_fit_coalesce(struct arena *a) {
+  uint64_t start = monotonic_ns();
+  for (int w = 0; w < DEFER_BITMAP_WORDS; w++) {
+    while (a->deferred_bitmap[w]) {
+      int index = (w << 6) + __builtin_ctzl(a->deferred_bitmap[w]);
+      struct mem_block *block;
+      while ((block = a->deferred[index])) {
+        a->deferred[index] = DEFER_NEXT(block);
+        a->coalesce_merges += !!IS_PREV_FREE(block) + !!IS_FREE(NEXT_BLOCK(block));
+        quick_fit_release(a, block);
+      }
+      a->deferred_bitmap[w] &= ~(1UL << (index & 63));
+    }
+  }
+  a->deferred_count = 0;
+  a->deferred_memory = 0;
+  a->coalesce_passes++;
+  a->coalesce_ns += monotonic_ns() - start;
+}
+
+// TLSF 的 Free：通过脚部和块大小找到物理相邻的块，O(1) 合并
+void ufree_tlsf(struct arena *a, struct mem_block *block) {
+  if (IS_PREV_FREE(block)) {
+    tlsf_remove(a, PREV_BLOCK(block));  // 移除前一个块
+    block = merge_with_prev(a, block);  // 合并前一个块
+  }
+  if (IS_FREE(NEXT_BLOCK(block))) {
+    tlsf_remove(a, NEXT_BLOCK(block));  // 移除后一个块
+    block = merge_with_next(a, block);  // 合并后一个块
+  }
+  mark_free(block);  // 写入脚部
+  tlsf_insert(a, block);  // 按合并后的大小放入对应的类
+}
+
+// 伙伴系统的 Free：伙伴位于偏移量异或块大小处，它空闲且大小相同时合并，直到伙伴不空闲或超出区域
+static void buddy_coalesce(struct arena *a, struct mem_block *block, char *base, char *end) {
+  for (;;) {
+    size_t size = GET_SIZE(block);
+    struct mem_block *buddy = (struct mem_block*)(base + (((char*)block - base) ^ size));
+    if ((char*)buddy >= end || !IS_FREE(buddy) || GET_SIZE(buddy) != size) break;
+    CLASS_STAT(coalesces, size);
+    buddy_remove(a, buddy);
+    unpurge(a, buddy);
+    unpurge(a, block);
+    if (buddy < block) block = buddy;  // 低地址的块成为合并后的块，保留它的 BLOCK_PREV_FREE
+    set_size(block, size << 1);
+  }
+  mark_free(block);  // 写入脚部
+  buddy_insert(a, block);
+}
+
+// 释放的块不一定是单个伙伴块 (批量释放拼接的相邻块、扩展堆得到的新内存、缩小后的堆尾)，
+// 这时先按偏移量拆成若干按自身大小对齐的 2 的幂块：先写好所有块头，再逐个合并，
+// 保证合并时读到的伙伴块头都是有效的
+void ufree_buddy(struct arena *a, struct mem_block *block) {
+  struct heap_region *region = REGION_OF(block);
+  char *base = BUDDY_BASE(region);
+  char *end = (char*)REGION_EPILOGUE(region);
+  size_t size = GET_SIZE(block);
+  size_t offset = (char*)block - base;
+  if ((size & (size - 1)) == 0 && (offset & (size - 1)) == 0) {
+    buddy_coalesce(a, block, base, end);
+    return;
+  }
+
+  unpurge(a, block);
+  char *start = (char*)block, *stop = start + size;
+  for (char *cur = start; cur < stop; cur += GET_SIZE((struct mem_block*)cur)) {
+    size_t piece = 1UL << (63 - __builtin_clzl(stop - cur));
+    offset = cur - base;
+    if (offset && (offset & -offset) < piece) piece = offset & -offset;
+    struct mem_block *b = (struct mem_block*)cur;
+    b->size = piece | (cur == start ? block->size & BLOCK_PREV_FREE : 0);  // 其余块的 BLOCK_PREV_FREE 由前一块的 mark_free 设置
+    b->applyed_size = 0;
+  }
+  for (char *cur = start; cur < stop; ) {
+    struct mem_block *b = (struct mem_block*)cur;
+    cur += GET_SIZE(b);  // 合并后 b 可能变为更低地址的块，先记下下一块
+    buddy_coalesce(a, b, base, end);
+  }
+}
+
+// 释放一个块并归还它所属的竞技场 a，调用者需持有 a->lock
+void
+free_block(struct arena *a, struct mem_block *block) {
+  a->used_memory -= GET_SIZE(block);
+  a->waste -= block_waste(block);
+  block->applyed_size = 0;  // 重置申请的大小
+
+  // 根据策略分发
+  if (a->strategy == STRATEGY_BEST_FIT) {
+    ufree_best_fit(a, block);
+  } else if (a->strategy == STRATEGY_QUICK_FIT) {
+    ufree_quick_fit(a, block);
+  } else if (a->strategy == STRATEGY_TLSF) {
+    ufree_tlsf(a, block);
+  } else if (a->strategy == STRATEGY_BUDDY) {
+    ufree_buddy(a, block);
+  }
+}
+
+// =================== 小对象 ==================
+// 由地址查找所属的 run，不属于任何 run 时返回 NULL
+static inline struct run* run_of(void *ptr) {
+  struct run **leaf = pagemap_root[(uintptr_t)ptr >> REGION_SHIFT];
+  return leaf ? leaf[((uintptr_t)ptr >> RUN_SHIFT) & (PAGEMAP_LEAF_SIZE - 1)] : NULL;
+}
+
+// 将 run 加入/移出链表
+static void run_link(struct run **list, struct run *run) {
+  run->prev = NULL;
+  run->next = *list;
+  if (*list) (*list)->prev = run;
+  *list = run;
+}
+
+static void run_unlink(struct run **list, struct run *run) {
+  if (run->prev) run->prev->next = run->next;
+  else *list = run->next;
+  if (run->next) run->next->prev = run->prev;
+}
+
+// 在 run 区域中建立一个新的 run 及其元数据，区域用完时预留新的区域，调用者需持有 a->lock
+static struct run* run_new(struct arena *a) {
+  if (a->run_next == a->run_end) {
+    if (a->run_end == a->run_limit) {
+      // 预留新的 run 区域，并为它建立页映射表的叶子 (按需占用物理页)
+      char *start = reserve_aligned(HEAP_RESERVE_SIZE);
+      if (!start) return NULL;
+      struct run **leaf = mmap(NULL, PAGEMAP_LEAF_SIZE * sizeof(struct run*), PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (leaf == MAP_FAILED) {
+        munmap(start, HEAP_RESERVE_SIZE);
+        return NULL;
+      }
+      pagemap_root[(uintptr_t)start >> REGION_SHIFT] = leaf;
+      a->run_next = a->run_end = start;
+      a->run_limit = start + HEAP_RESERVE_SIZE;
+    }
+    if (mprotect(a->run_end, RUN_COMMIT_SIZE, PROT_READ | PROT_WRITE) != 0) return NULL;
+    a->run_end += RUN_COMMIT_SIZE;
+    a->run_memory += RUN_COMMIT_SIZE;
+  }
+
+  if (a->meta_next == a->meta_end) {
+    struct run *meta = mmap(NULL, RUN_META_CHUNK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (meta == MAP_FAILED) return NULL;
+    a->meta_next = meta;
+    a->meta_end = meta + RUN_META_CHUNK / sizeof(struct run);
+  }
+
+  struct run *run = a->meta_next++;
+  run->base = a->run_next;
+  run->arena = a;
+  a->run_next += RUN_SIZE;
+  a->run_count++;
+  pagemap_root[(uintptr_t)run->base >> REGION_SHIFT][((uintptr_t)run->base >> RUN_SHIFT) & (PAGEMAP_LEAF_SIZE - 1)] = run;
+  return run;
+}
+
+// 为第 index 级准备一个 run：优先复用空 run，其次建立新的 run
+static struct run* run_create(struct arena *a, int index) {
+  struct run *run = a->empty_runs;
+  if (run) {
+    run_unlink(&a->empty_runs, run);
+    if (run->purged) {
+      a->purged_memory -= RUN_SIZE;
+      run->purged = 0;
+    }
+  } else {
+    run = run_new(a);
+    if (!run) return NULL;
+  }
+
+  run->class_index = index;
+  run->slot_count = RUN_SIZE / SLAB_SLOT_SIZE(index);
+  run->free_count = run->slot_count;
+  for (size_t i = 0; i < RUN_BITMAP_WORDS; i++) {
+    unsigned int bits = run->slot_count > i * 64 ? run->slot_count - i * 64 : 0;
+    run->bitmap[i] = bits >= 64 ? ~0UL : (1UL << bits) - 1;
+  }
+  run_link(&a->runs[index], run);
+  return run;
+}
+
+// 从第 index 级分配一个槽位，调用者需持有 a->lock
+void*
+slab_alloc(struct arena *a, int index) {
+  struct run *run = a->runs[index];
+  if (!run && !(run = run_create(a, index))) return NULL;  // 内存不足
+
+  size_t w = 0;
+  while (!run->bitmap[w]) w++;
+  int bit = __builtin_ctzl(run->bitmap[w]);
+  run->bitmap[w] &= ~(1UL << bit);
+  if (--run->free_count == 0) run_unlink(&a->runs[index], run);  // run 已满
+  a->slab_used += SLAB_SLOT_SIZE(index);
+  return run->base + (w * 64 + bit) * SLAB_SLOT_SIZE(index);
+}
+
+// 判断槽位是否已在 run 中空闲
+static inline int slab_is_free(struct run *run, void *ptr) {
+  size_t slot = ((char*)ptr - run->base) / SLAB_SLOT_SIZE(run->class_index);
+  return (run->bitmap[slot / 64] >> (slot % 64)) & 1;
+}
+
+// 槽位放入线程缓存或 CPU 缓存时置位 cached 中对应的位；已经置位 (槽位已在某个缓存中，即重复释放) 时返回 0
+static inline int slot_cache_mark(struct run *run, void *ptr) {
+  size_t slot = ((char*)ptr - run->base) / SLAB_SLOT_SIZE(run->class_index);
+  uint64_t bit = 1UL << (slot % 64);
+  return !(__atomic_fetch_or(&run->cached[slot / 64], bit, __ATOMIC_RELAXED) & bit);
+}
+
+// 槽位离开缓存 (分配出去或归还 run) 时清除对应的位
+static inline void slot_cache_clear(struct run *run, void *ptr) {
+  size_t slot = ((char*)ptr - run->base) / SLAB_SLOT_SIZE(run->class_index);
+  __atomic_fetch_and(&run->cached[slot / 64], ~(1UL << (slot % 64)), __ATOMIC_RELAXED);
+}
+
+// 释放一个槽位，调用者需持有 run->arena->lock。
+// 只在整个 run 的粒度上合并：槽位全部空闲的 run 移入空 run 链表，可被任意级复用
+void
+slab_free(struct run *run, void *ptr) {
+  struct arena *a = run->arena;
+  size_t slot = ((char*)ptr - run->base) / SLAB_SLOT_SIZE(run->class_index);
+  if ((run->bitmap[slot / 64] >> (slot % 64)) & 1) return;  // 重复释放
+  slot_cache_clear(run, ptr);  // 从缓存中归还的槽位
+  run->bitmap[slot / 64] |= 1UL << (slot % 64);
+  a->slab_used -= SLAB_SLOT_SIZE(run->class_index);
+
+  if (run->free_count++ == 0) run_link(&a->runs[run->class_index], run);  // 由满变为有空闲
+  if (run->free_count == run->slot_count) {
+    run_unlink(&a->runs[run->class_index], run);
+    run->stamp = mem.epoch;
+    run_link(&a->empty_runs, run);
+  }
+}
+
+
+// =================== 远程释放 ==================
+// 取走 a 的整个远程释放栈并逐个释放，调用者需持有 a->lock
+static void remote_drain(struct arena *a) {
+  if (!__atomic_load_n(&a->remote_free, __ATOMIC_RELAXED)) return;
+  void *ptr = __atomic_exchange_n(&a->remote_free, NULL, __ATOMIC_ACQUIRE);
+  while (ptr) {
+    void *next = REMOTE_NEXT(ptr);
+    struct run *run = run_of(ptr);
+    if (run) slab_free(run, ptr);
+    else free_block(a, GET_BLOCK(ptr));
+    a->remote_drained++;
+    ptr = next;
+  }
+}
+
+
+// =================== 线程本地缓存 ==================
+// 每个线程按块大小分级缓存最近释放的块，绝大多数 malloc/free 可以不经过竞技场的锁完成。
+// 缓存中的块对共享堆而言仍是"已分配"状态 (BLOCK_FREE 未置位)，用 applyed_size = 0 标记其在缓存中，
+// 缓存链表的指针存放在块的有效载荷中。slab 槽位另有一组缓存，链表指针存放在槽位的开头。
+// 只有批量补充 (refill) 和批量回写 (flush) 才会获取锁，线程退出时缓存会全部归还。
+#define TCACHE_MIN_SIZE MIN_BLOCK_SIZE  // 最小的缓存块大小
+#define TCACHE_MAX_SIZE 1024  // 大于该大小的块不进入线程缓存
+#define TCACHE_CLASS_COUNT ((TCACHE_MAX_SIZE - TCACHE_MIN_SIZE) / ALIGNMENT + 1)  // 每 16 字节一级
+#define TCACHE_BIN_LIMIT 32  // 每级最多缓存的块数
+#define TCACHE_FILL_COUNT 8  // 缓存未命中时一次最多从共享堆取出的块数
+#define TCACHE_FLUSH_COUNT (TCACHE_BIN_LIMIT / 2)  // 缓存满时一次归还的块数
+#define TCACHE_NEXT(block) (*(struct mem_block**)((char*)(block) + sizeof(struct mem_block)))  // 缓存链表的后继
+#define SLAB_NEXT(slot) (*(void**)(slot))  // slab 缓存链表的后继
+
+struct tcache_bin {
+  struct mem_block *head;  // 通过 TCACHE_NEXT 串成单链表
+  unsigned int count;
+  unsigned int fill;  // 下次补充的块数，连续未命中时翻倍，回写时减半
+};
+
+struct slab_bin {
+  void *head;  // 通过 SLAB_NEXT 串成单链表
+  unsigned int count;
+  unsigned int fill;
+};
+
+struct tcache {
+  int registered;  // 是否已注册线程退出回调
+  struct tcache_bin bins[TCACHE_CLASS_COUNT];
+  struct slab_bin slabs[SLAB_CLASS_COUNT];
+};
+
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;  // 仅用于在线程退出时触发回收
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+// 块大小到缓存级别的映射，超出范围返回 -1
+static inline int tcache_class(size_t block_size) {
+  if (block_size < TCACHE_MIN_SIZE || block_size > TCACHE_MAX_SIZE) return -1;
+  return (int)((block_size - TCACHE_MIN_SIZE) >> ALIGN_SHIFT);
+}
+
+// 申请 nbytes 字节时从堆中得到的块大小，用来选择缓存级别 (线程使用的竞技场都是 mem.strategy 策略)
+static inline size_t request_block_size(size_t nbytes) {
+  return mem.strategy == STRATEGY_BUDDY ? buddy_block_size(BLOCK_SIZE(nbytes)) : BLOCK_SIZE(nbytes);
+}
+
+// 批量归还时的状态：当前持有锁的本地竞技场，以及正在为某个远程竞技场串起来的链
+struct flush_state {
+  struct arena *locked;
+  struct arena *remote;
+  void *first;
+  void *last;
+};
+
+// 归还一个块或槽位 (ptr 为用户指针)：属于本线程竞技场的直接持锁释放，
+// 属于其他竞技场的先串成链，竞技场改变时用一次 CAS 整体压入对方的远程释放栈
+static void flush_one(struct flush_state *st, struct arena *a, void *ptr) {
+  if (is_remote(a)) {
+    if (a != st->remote) {
+      if (st->remote) remote_push(st->remote, st->first, st->last);
+      st->remote = a;
+      st->first = NULL;
+    }
+    REMOTE_NEXT(ptr) = st->first;
+    if (!st->first) st->last = ptr;
+    st->first = ptr;
+    return;
+  }
+  if (a != st->locked) {
+    arena_lock(a);
+    st->locked = a;
+  }
+  struct run *run = run_of(ptr);
+  if (run) slab_free(run, ptr);
+  else free_block(a, GET_BLOCK(ptr));
+}
+
+static void flush_done(struct flush_state *st) {
+  if (st->remote) remote_push(st->remote, st->first, st->last);
+  if (st->locked) arena_unlock(st->locked);
+}
+
+// 将某一级的前 count 个块归还各自的竞技场，本地竞技场只获取一次锁
+static void tcache_flush_bin(struct tcache_bin *bin, unsigned int count) {
+  if (bin->count == 0) return;
+  struct flush_state st = {0};
+  while (bin->head && count--) {
+    struct mem_block *block = bin->head;
+    bin->head = TCACHE_NEXT(block);
+    bin->count--;
+    flush_one(&st, arena_of(block), (char*)block + sizeof(struct mem_block));
+  }
+  flush_done(&st);
+}
+
+// 将某一级的前 count 个槽位归还各自的 run
+static void slab_flush_bin(struct slab_bin *bin, unsigned int count) {
+  if (bin->count == 0) return;
+  struct flush_state st = {0};
+  while (bin->head && count--) {
+    void *slot = bin->head;
+    bin->head = SLAB_NEXT(slot);
+    bin->count--;
+    flush_one(&st, run_of(slot)->arena, slot);
+  }
+  flush_done(&st);
+}
+
+// 将当前线程的缓存全部归还共享堆
+void
+tcache_flush_all(void) {
+  for (size_t i = 0; i < TCACHE_CLASS_COUNT; i++) {
+    tcache_flush_bin(&tcache.bins[i], tcache.bins[i].count);
+  }
+  for (size_t i = 0; i < SLAB_CLASS_COUNT; i++) {
+    slab_flush_bin(&tcache.slabs[i], tcache.slabs[i].count);
+  }
+}
+
+// 线程退出时的回调
+static void tcache_thread_exit(void *arg) {
+  (void)arg;
+  tcache_flush_all();
+  tcache.registered = 0;  // 之后的析构函数若再次释放内存，会重新注册
+}
+
+static void tcache_key_init(void) {
+  pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+// 首次使用缓存时注册线程退出回调
+static void tcache_register(void) {
+  pthread_once(&tcache_key_once, tcache_key_init);
+  pthread_setspecific(tcache_key, &tcache);
+  tcache.registered = 1;
+}
+
+// 从缓存中取一个块，未命中返回 NULL
+static struct mem_block* tcache_get(int index) {
+  struct tcache_bin *bin = &tcache.bins[index];
+  struct mem_block *block = bin->head;
+  if (!block) return NULL;
+  bin->head = TCACHE_NEXT(block);
+  bin->count--;
+  return block;
+}
+
+// 将块放入第 index 级缓存，缓存满时先批量归还一半。
+// 块可能比该级略大 (分割时并入了剩余空间)，从这一级取出时仍然放得下
+static void tcache_put_class(struct mem_block *block, int index) {
+  if (!tcache.registered) tcache_register();
+
+  struct tcache_bin *bin = &tcache.bins[index];
+  if (bin->count >= TCACHE_BIN_LIMIT) {
+    tcache_flush_bin(bin, TCACHE_FLUSH_COUNT);
+    bin->fill >>= 1;
+  }
+
+  block_set_applyed(block, 0);  // 标记为缓存中
+  TCACHE_NEXT(block) = bin->head;
+  bin->head = block;
+  bin->count++;
+}
+
+// 将块按实际大小放入缓存；块大小不在缓存范围内返回 0
+int
+tcache_put(struct mem_block *block) {
+  int index = tcache_class(GET_SIZE(block));
+  if (index < 0) return 0;
+  tcache_put_class(block, index);
+  return 1;
+}
+
+// 缓存未命中时批量补充：持当前线程竞技场的锁一次取出 fill 个同级块，返回其中一个
+static struct mem_block* tcache_refill(int index, size_t nbytes) {
+  size_t class_size = TCACHE_MIN_SIZE + ((size_t)index << ALIGN_SHIFT);
+  size_t class_nbytes = class_size - sizeof(struct mem_block);  // 恰好落在该级的申请大小
+  struct mem_block *result = NULL;
+  struct tcache_bin *fill_bin = &tcache.bins[index];
+  unsigned int fill = fill_bin->fill ? fill_bin->fill : 1;
+  fill_bin->fill = (fill < TCACHE_FILL_COUNT) ? fill << 1 : TCACHE_FILL_COUNT;
+
+  struct arena *a = arena_get();
+  arena_lock(a);
+  remote_drain(a);  // 先回收其他线程归还的块
+  for (unsigned int i = 0; i < fill; i++) {
+    void *p = heap_alloc(a, class_nbytes);
+    if (!p) break;
+    struct mem_block *block = GET_BLOCK(p);
+    if (!result) {
+      result = block;
+    } else {
+      // 未分割的块可能比该级略大，按实际大小放入对应级别
+      int k = tcache_class(GET_SIZE(block));
+      if (k < 0) {
+        free_block(a, block);
+        continue;
+      }
+      struct tcache_bin *bin = &tcache.bins[k];
+      a->waste -= block_waste(block);
+      block->applyed_size = 0;
+      TCACHE_NEXT(block) = bin->head;
+      bin->head = block;
+      bin->count++;
+    }
+  }
+  arena_unlock(a);
+
+  if (result) {
+    if (!tcache.registered) tcache_register();
+    block_set_applyed(result, nbytes);
+  }
+  return result;
+}
+
+
+// 从 slab 缓存中取一个槽位，未命中时持当前线程竞技场的锁批量补充
+static void* slab_cache_get(int index) {
+  struct slab_bin *bin = &tcache.slabs[index];
+  void *slot = bin->head;
+  if (slot) {
+    bin->head = SLAB_NEXT(slot);
+    bin->count--;
+    slot_cache_clear(run_of(slot), slot);
+    return slot;
+  }
+
+  unsigned int fill = bin->fill ? bin->fill : 1;
+  bin->fill = (fill < TCACHE_FILL_COUNT) ? fill << 1 : TCACHE_FILL_COUNT;
+  struct arena *a = arena_get();
+  arena_lock(a);
+  remote_drain(a);
+  slot = slab_alloc(a, index);
+  for (unsigned int i = 1; slot && i < fill; i++) {
+    void *extra = slab_alloc(a, index);
+    if (!extra) break;
+    slot_cache_mark(run_of(extra), extra);
+    SLAB_NEXT(extra) = bin->head;
+    bin->head = extra;
+    bin->count++;
+  }
+  arena_unlock(a);
+  if (slot && !tcache.registered) tcache_register();
+  return slot;
+}
+
+// 将槽位放入 slab 缓存，缓存满时先批量归还一半。调用者已用 slot_cache_mark 标记槽位
+static void slab_cache_put(struct run *run, void *slot) {
+  if (!tcache.registered) tcache_register();
+  struct slab_bin *bin = &tcache.slabs[run->class_index];
+  if (bin->count >= TCACHE_BIN_LIMIT) {
+    slab_flush_bin(bin, TCACHE_FLUSH_COUNT);
+    bin->fill >>= 1;
+  }
+  SLAB_NEXT(slot) = bin->head;
+  bin->head = slot;
+  bin->count++;
+}
+
+
+// =================== CPU 缓存 ==================
+// 线程缓存占用的内存随线程数增长，线程远多于 CPU 时可以改用按 CPU 划分的缓存 (UMALLOC_OPT_PERCPU_CACHE)：
+// 每个 CPU 为每个 slab 级和线程缓存级保存少量对象，总量只随 CPU 数增长。
+// 对象以用户指针存放在数组栈中，取出/放入只修改当前 CPU 的栈，不获取锁：
+// x86-64 上用 restartable sequences (rseq，glibc 2.35 起为每个线程注册) 实现，线程在临界区中被抢占或迁移时
+// 内核让它跳到中止处理，按未命中处理；其他情况用 sched_getcpu 选择缓存并用原子交换占用它，
+// 已被占用时同样按未命中处理，不会等待。
+// 归还其他 CPU 的缓存时先占用它，rseq 实现下再用 membarrier 让该 CPU 上正在执行的临界区重新开始。
+// 缓存中的块与线程缓存一样保持"已分配"状态，applyed_size 为 0
+#define CPU_CACHE_SLOTS 16  // 每级最多缓存的对象数
+#define CPU_CACHE_FILL 4  // 未命中时一次从共享堆取出的对象数
+#define CPU_CACHE_FLUSH (CPU_CACHE_SLOTS / 2)  // 缓存满时一次归还的对象数
+#define CPU_CACHE_MAX 1024  // 支持的 CPU 数上限，编号更大的 CPU 不使用缓存
+#define CPU_CLASS_COUNT (SLAB_CLASS_COUNT + TCACHE_CLASS_COUNT)  // 前 SLAB_CLASS_COUNT 级为 slab 槽位，其余为块
+
+struct cpu_bin {
+  size_t count;  // rseq 临界区以写入 count 作为提交
+  void *slots[CPU_CACHE_SLOTS];
+};
+
+struct cpu_cache {
+  unsigned int busy;  // 非 0 时被占用：回退实现下正在操作的线程，或正在归还整个缓存的线程
+  struct cpu_bin bins[CPU_CLASS_COUNT];
+} __attribute__((aligned(64)));  // 不同 CPU 的缓存不共享缓存行
+
+#ifdef HAVE_RSEQ
+// 当前线程的 rseq 区域记录的 CPU 号，本线程未注册 rseq 或编号超出范围时返回 -1
+static inline int rseq_cpu(void) {
+  struct rseq *rs = (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+  int cpu = (int)__atomic_load_n(&rs->cpu_id, __ATOMIC_RELAXED);  // 未注册时为负数
+  return cpu < (int)mem.cpu_count ? cpu : -1;
+}
+
+// 临界区 [start, commit) 的描述符放在 __rseq_cs 段中，进入前把它的地址写入 rseq 区域的 rseq_cs 字段
+#define RSEQ_ENTER(start, commit, abort) \
+  ".pushsection __rseq_cs, \"aw\"\n\t" \
+  ".balign 32\n\t" \
+  "3:\n\t" \
+  ".long 0, 0\n\t" \
+  ".quad " #start "f, " #commit "f - " #start "f, " #abort "f\n\t" \
+  ".popsection\n\t" \
+  "leaq 3b(%%rip), %%rax\n\t" \
+  "movq %%rax, %%fs:8(%[rs])\n\t"
+
+// 中止处理紧跟在 glibc 注册的签名之后，把结果清零后跳到 done
+#define RSEQ_ABORT(abort, done) \
+  ".pushsection __rseq_failure, \"ax\"\n\t" \
+  ".byte 0x0f, 0xb9, 0x3d\n\t" \
+  ".long " RSEQ_STR(RSEQ_SIG) "\n\t" \
+  #abort ":\n\t" \
+  "xorl %k[ret], %k[ret]\n\t" \
+  "jmp " #done "f\n\t" \
+  ".popsection\n\t"
+#define RSEQ_STR_(x) #x
+#define RSEQ_STR(x) RSEQ_STR_(x)
+
+// 在 cpu 上弹出一个对象：当前不在 cpu 上、缓存被占用、为空或被打断时返回 NULL
+static inline void* rseq_pop(struct cpu_cache *c, struct cpu_bin *bin, int cpu) {
+  void *ret;
+  __asm__ __volatile__(
+    RSEQ_ENTER(1, 2, 4)
+    "1:\n\t"
+    "cmpl %[cpu], %%fs:4(%[rs])\n\t"
+    "jnz 4f\n\t"
+    "cmpl $0, (%[busy])\n\t"
+    "jnz 4f\n\t"
+    "movq (%[bin]), %%rcx\n\t"
+    "testq %%rcx, %%rcx\n\t"
+    "jz 4f\n\t"
+    "movq (%[bin], %%rcx, 8), %[ret]\n\t"  // slots[count - 1]
+    "decq %%rcx\n\t"
+    "movq %%rcx, (%[bin])\n\t"
+    "2:\n\t"
+    "jmp 5f\n\t"
+    RSEQ_ABORT(4, 5)
+    "5:\n\t"
+    : [ret] "=&r" (ret)
+    : [rs] "r" (__rseq_offset), [cpu] "r" (cpu), [busy] "r" (&c->busy), [bin] "r" (bin)
+    : "rax", "rcx", "memory", "cc");
+  return ret;
+}
+
+// 在 cpu 上压入一个对象，成功返回 1；缓存已满时也返回 0
+static inline int rseq_push(struct cpu_cache *c, struct cpu_bin *bin, int cpu, void *ptr) {
+  int ret;
+  __asm__ __volatile__(
+    RSEQ_ENTER(1, 2, 4)
+    "1:\n\t"
+    "cmpl %[cpu], %%fs:4(%[rs])\n\t"
+    "jnz 4f\n\t"
+    "cmpl $0, (%[busy])\n\t"
+    "jnz 4f\n\t"
+    "movq (%[bin]), %%rcx\n\t"
+    "cmpq %[slots], %%rcx\n\t"
+    "jae 4f\n\t"
+    "movq %[ptr], 8(%[bin], %%rcx, 8)\n\t"  // slots[count]
+    "incq %%rcx\n\t"
+    "movq %%rcx, (%[bin])\n\t"
+    "2:\n\t"
+    "movl $1, %[ret]\n\t"
+    "jmp 5f\n\t"
+    RSEQ_ABORT(4, 5)
+    "5:\n\t"
+    : [ret] "=&r" (ret)
+    : [rs] "r" (__rseq_offset), [cpu] "r" (cpu), [busy] "r" (&c->busy), [bin] "r" (bin), [ptr] "r" (ptr),
+      [slots] "i" (CPU_CACHE_SLOTS)
+    : "rax", "rcx", "memory", "cc");
+  return ret;
+}
+
+// 让 cpu 上正在执行的临界区重新开始；不支持指定 CPU 的内核上打断所有 CPU
+static void rseq_fence(int cpu) {
+  if (syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, MEMBARRIER_CMD_FLAG_CPU, cpu) != 0) {
+    syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED_RSEQ, 0, 0);
+  }
+}
+#endif
+
+// 是否能使用 rseq：glibc 为当前线程注册了 rseq，并且能为进程注册 membarrier 用来打断其他 CPU 上的临界区
+static int rseq_usable(void) {
+#ifdef HAVE_RSEQ
+  return __rseq_size > 0 && rseq_cpu() >= 0 &&
+         syscall(SYS_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED_RSEQ, 0, 0) == 0;
+#else
+  return 0;
+#endif
+}
+
+// 回退实现：占用 sched_getcpu 所在 CPU 的缓存，已被占用时返回 NULL
+static inline struct cpu_cache* cpu_cache_acquire(void) {
+  int cpu = sched_getcpu();
+  if (cpu < 0 || (unsigned int)cpu >= mem.cpu_count) return NULL;
+  struct cpu_cache *c = &mem.cpu_caches[cpu];
+  if (__atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE)) return NULL;
+  return c;
+}
+
+static inline void cpu_cache_release(struct cpu_cache *c) {
+  __atomic_store_n(&c->busy, 0, __ATOMIC_RELEASE);
+}
+
+// 从当前 CPU 的第 index 级取出一个对象，未命中返回 NULL
+static inline void* cpu_pop(int index) {
+#ifdef HAVE_RSEQ
+  if (mem.cpu_cache_rseq) {
+    int cpu = rseq_cpu();  // 未注册 rseq 的线程不能与其他线程的临界区互斥，不使用缓存
+    if (cpu < 0) return NULL;
+    struct cpu_cache *c = &mem.cpu_caches[cpu];
+    return rseq_pop(c, &c->bins[index], cpu);
+  }
+#endif
+  struct cpu_cache *c = cpu_cache_acquire();
+  if (!c) return NULL;
+  struct cpu_bin *bin = &c->bins[index];
+  void *ptr = bin->count ? bin->slots[--bin->count] : NULL;
+  cpu_cache_release(c);
+  return ptr;
+}
+
+// 将对象放入当前 CPU 的第 index 级，缓存已满或不可用时返回 0
+static inline int cpu_push(int index, void *ptr) {
+#ifdef HAVE_RSEQ
+  if (mem.cpu_cache_rseq) {
+    int cpu = rseq_cpu();
+    if (cpu < 0) return 0;
+    struct cpu_cache *c = &mem.cpu_caches[cpu];
+    return rseq_push(c, &c->bins[index], cpu, ptr);
+  }
+#endif
+  struct cpu_cache *c = cpu_cache_acquire();
+  if (!c) return 0;
+  struct cpu_bin *bin = &c->bins[index];
+  int ok = bin->count < CPU_CACHE_SLOTS;
+  if (ok) bin->slots[bin->count++] = ptr;
+  cpu_cache_release(c);
+  return ok;
+}
+
+// 第 index 级的对象所属的竞技场
+static inline struct arena* cpu_object_arena(int index, void *ptr) {
+  return index < SLAB_CLASS_COUNT ? run_of(ptr)->arena : arena_of(GET_BLOCK(ptr));
+}
+
+// 从当前 CPU 的第 index 级取出至多 count 个对象归还各自的竞技场
+static void cpu_cache_flush(int index, unsigned int count) {
+  struct flush_state st = {0};
+  void *ptr;
+  while (count-- && (ptr = cpu_pop(index))) flush_one(&st, cpu_object_arena(index, ptr), ptr);
+  flush_done(&st);
+}
+
+// 未命中时持当前线程竞技场的锁取出 CPU_CACHE_FILL 个对象，返回其中一个，其余放入当前 CPU 的缓存
+static void* cpu_cache_refill(int index) {
+  int is_block = index >= SLAB_CLASS_COUNT;
+  size_t class_nbytes = is_block ? TCACHE_MIN_SIZE + ((size_t)(index - SLAB_CLASS_COUNT) << ALIGN_SHIFT) - sizeof(struct mem_block) : 0;
+  void *result = NULL;
+
+  struct arena *a = arena_get();
+  arena_lock(a);
+  remote_drain(a);
+  for (int i = 0; i < CPU_CACHE_FILL; i++) {
+    void *ptr = is_block ? heap_alloc(a, class_nbytes) : slab_alloc(a, index);
+    if (!ptr) break;
+    if (!result) {
+      result = ptr;
+      continue;
+    }
+    if (!is_block) {
+      slot_cache_mark(run_of(ptr), ptr);
+      if (!cpu_push(index, ptr)) slab_free(run_of(ptr), ptr);
+      continue;
+    }
+    // 未分割的块可能比该级略大，按实际大小放入对应级别
+    struct mem_block *block = GET_BLOCK(ptr);
+    int k = tcache_class(GET_SIZE(block));
+    if (k < 0) {
+      free_block(a, block);
+      continue;
+    }
+    a->waste -= block_waste(block);
+    block->applyed_size = 0;
+    if (!cpu_push(SLAB_CLASS_COUNT + k, ptr)) free_block(a, block);
+  }
+  arena_unlock(a);
+  return result;
+}
+
+// 从当前 CPU 的缓存分配第 index 级的对象，返回用户指针
+static void* cpu_cache_get(int index, size_t nbytes) {
+  void *ptr = cpu_pop(index);
+  if (ptr && index < SLAB_CLASS_COUNT) slot_cache_clear(run_of(ptr), ptr);
+  if (!ptr) ptr = cpu_cache_refill(index);
+  if (ptr && index >= SLAB_CLASS_COUNT) block_set_applyed(GET_BLOCK(ptr), nbytes);
+  return ptr;
+}
+
+// 将对象放入当前 CPU 的缓存，放不下时先归还一半，仍然放不下 (缓存不可用) 时直接归还这一个。
+// 槽位由调用者用 slot_cache_mark 标记
+static void cpu_cache_put(int index, void *ptr) {
+  if (index >= SLAB_CLASS_COUNT) block_set_applyed(GET_BLOCK(ptr), 0);  // 标记为缓存中
+  if (cpu_push(index, ptr)) return;
+  cpu_cache_flush(index, CPU_CACHE_FLUSH);
+  if (cpu_push(index, ptr)) return;
+  struct flush_state st = {0};
+  flush_one(&st, cpu_object_arena(index, ptr), ptr);
+  flush_done(&st);
+}
+
+// 归还所有 CPU 缓存中的对象，调用者需持有 mem.lock
+static void cpu_cache_drain(void) {
+  for (unsigned int cpu = 0; cpu < mem.cpu_count; cpu++) {
+    struct cpu_cache *c = &mem.cpu_caches[cpu];
+    while (__atomic_exchange_n(&c->busy, 1, __ATOMIC_ACQUIRE)) sched_yield();  // 回退实现的操作很快就会结束
+#ifdef HAVE_RSEQ
+    if (mem.cpu_cache_rseq) rseq_fence(cpu);  // 已经越过 busy 检查的临界区重新开始后会看到占用
+#endif
+    struct flush_state st = {0};
+    for (int i = 0; i < (int)CPU_CLASS_COUNT; i++) {
+      struct cpu_bin *bin = &c->bins[i];
+      while (bin->count) {
+        void *ptr = bin->slots[--bin->count];
+        flush_one(&st, cpu_object_arena(i, ptr), ptr);
+      }
+    }
+    flush_done(&st);
+    cpu_cache_release(c);
+  }
+}
+
+// 开启时建立缓存 (首次开启时映射，按需占用物理页) 并选择实现方式，当前线程缓存中的块先归还；
+// 关闭时归还所有 CPU 缓存中的对象。其他线程缓存中已有的块留到线程退出时归还
+static int cpu_cache_enable(int on) {
+  pthread_mutex_lock(&mem.lock);
+  if (on && !mem.cpu_caches) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    if (cpus < 1) cpus = 1;
+    if (cpus > CPU_CACHE_MAX) cpus = CPU_CACHE_MAX;
+    struct cpu_cache *caches = mmap(NULL, cpus * sizeof(struct cpu_cache), PROT_READ | PROT_WRITE,
+                                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (caches == MAP_FAILED) {
+      pthread_mutex_unlock(&mem.lock);
+      return -1;
+    }
+    mem.cpu_count = (unsigned int)cpus;
+    mem.cpu_cache_rseq = rseq_usable();
+    mem.cpu_caches = caches;
+  }
+  mem.cpu_cache = on;
+  if (!on) cpu_cache_drain();  // 关闭时仍在途的操作放入的对象留到下一次回收
+  pthread_mutex_unlock(&mem.lock);
+  if (on) tcache_flush_all();
+  return 0;
+}
+
+// fork 之后子进程只剩一个线程：清除其他线程留下的占用，重新注册 membarrier (注册状态不会继承)
+static void cpu_cache_fork_child(void) {
+  for (unsigned int cpu = 0; cpu < mem.cpu_count; cpu++) mem.cpu_caches[cpu].busy = 0;
+  if (mem.cpu_cache_rseq) mem.cpu_cache_rseq = rseq_usable();
+}
+
+
+// =================== 大对象 ==================
+#define LARGE_HEADER_SIZE (sizeof(struct large_chunk) + sizeof(struct mem_block))
+#define LARGE_CHUNK(block) ((struct large_chunk*)((char*)(block) - sizeof(struct large_chunk)))
+#define LARGE_BLOCK(chunk) ((struct mem_block*)((char*)(chunk) + sizeof(struct large_chunk)))
+#define LARGE_BASE(chunk) ((char*)((uintptr_t)(chunk) & ~(mem.page_size - 1)))  // 映射的起始地址，对齐分配时 large_chunk 不一定在映射开头
+
+// 将大对象加入/移出所属竞技场的大对象链表，调用者需持有该竞技场的锁
+static void large_link(struct large_chunk *chunk) {
+  struct arena *a = chunk->arena;
+  chunk->prev = NULL;
+  chunk->next = a->large_list;
+  if (a->large_list) a->large_list->prev = chunk;
+  a->large_list = chunk;
+  a->large_count++;
+  a->large_memory += chunk->map_size;
+  a->waste += block_waste(LARGE_BLOCK(chunk));
+}
+
+static void large_unlink(struct large_chunk *chunk) {
+  struct arena *a = chunk->arena;
+  if (chunk->prev) chunk->prev->next = chunk->next;
+  else a->large_list = chunk->next;
+  if (chunk->next) chunk->next->prev = chunk->prev;
+  a->large_count--;
+  a->large_memory -= chunk->map_size;
+  a->waste -= block_waste(LARGE_BLOCK(chunk));
+}
+
+// 为大对象建立独立的页对齐映射，新映射的页全部为 0。
+// alignment 大于 16 时多映射 alignment 字节，有效载荷对齐后再把首尾多余的整页解除映射
+void*
+large_alloc(size_t nbytes, size_t alignment) {
+  size_t pad = alignment > ALIGNMENT ? alignment : 0;
+  size_t map_size = PAGE_ALIGN(nbytes + LARGE_HEADER_SIZE + pad);
+  char *start = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (start == MAP_FAILED) return NULL;
+
+  char *payload = start + LARGE_HEADER_SIZE;
+  if (pad) {
+    payload = (char*)(((uintptr_t)payload + alignment - 1) & ~(alignment - 1));
+    char *base = LARGE_BASE(payload - LARGE_HEADER_SIZE);
+    char *end = (char*)PAGE_ALIGN((uintptr_t)payload + nbytes);
+    if (base > start) munmap(start, base - start);
+    if (end < start + map_size) munmap(end, start + map_size - end);
+    map_size = end - base;
+  }
+
+  struct large_chunk *chunk = (struct large_chunk*)(payload - LARGE_HEADER_SIZE);
+  chunk->map_size = map_size;
+  chunk->arena = arena_get();
+  struct mem_block *block = LARGE_BLOCK(chunk);
+  block->size = (map_size - (size_t)((char*)block - LARGE_BASE(chunk))) | BLOCK_MMAPPED;
+  block->applyed_size = nbytes;
+
+  arena_lock(chunk->arena);
+  large_link(chunk);
+  arena_unlock(chunk->arena);
+  return (void*)((char*)block + sizeof(struct mem_block));
+}
+
+// 释放大对象，直接解除映射
+void
+large_free(struct mem_block *block) {
+  struct large_chunk *chunk = LARGE_CHUNK(block);
+  struct arena *a = chunk->arena;
+  arena_lock(a);
+  large_unlink(chunk);
+  arena_unlock(a);
+  munmap(LARGE_BASE(chunk), chunk->map_size);
+}
+
+// 调整大对象的大小：用 mremap 扩大或缩小映射，内核只需移动页表而不必复制数据
+void*
+large_realloc(struct mem_block *block, size_t nbytes) {
+  struct large_chunk *chunk = LARGE_CHUNK(block);
+  size_t offset = (char*)chunk - LARGE_BASE(chunk);
+  size_t map_size = PAGE_ALIGN(offset + nbytes + LARGE_HEADER_SIZE);
+  if (map_size == chunk->map_size) {
+    block_set_applyed(block, nbytes);
+    return (void*)((char*)block + sizeof(struct mem_block));
+  }
+
+  // 映射可能被移动，先从链表中摘除，完成后再按新地址加入
+  struct arena *a = chunk->arena;
+  arena_lock(a);
+  large_unlink(chunk);
+  arena_unlock(a);
+
+  char *start = mremap(LARGE_BASE(chunk), chunk->map_size, map_size, MREMAP_MAYMOVE);
+  int ok = (start != MAP_FAILED);
+  if (ok) {
+    chunk = (struct large_chunk*)(start + offset);
+    chunk->map_size = map_size;
+    block = LARGE_BLOCK(chunk);
+    block->size = (map_size - offset - sizeof(struct large_chunk)) | BLOCK_MMAPPED;
+    block->applyed_size = nbytes;
+  }
+
+  arena_lock(a);
+  large_link(chunk);
+  arena_unlock(a);
+  return ok ? (void*)((char*)block + sizeof(struct mem_block)) : NULL;
+}
+
+
+// =================== 内存回收 ==================
+// 收集竞技场 a 中至少 min_size 且未归还过的空闲块，最多 max 个，调用者需持有 a->lock
+static size_t free_index_collect(struct arena *a, size_t min_size, struct mem_block **out, size_t max) {
+  size_t n = 0;
+  if (a->strategy == STRATEGY_QUICK_FIT) {
+    for (int i = quick_bitmap_find(a, quick_list_index(min_size)); i >= 0 && n < max; i = quick_bitmap_find(a, i + 1)) {
+      for (struct mem_block *block = a->quick_lists[i]; block && n < max; block = FREE_LINKS(block)->next) {
+        if (GET_SIZE(block) >= min_size && !IS_PURGED(block)) out[n++] = block;
+      }
+    }
+  } else if (a->strategy == STRATEGY_TLSF) {
+    int fl, sl;
+    tlsf_mapping(min_size, &fl, &sl);
+    for (int found = tlsf_find(a, &fl, &sl); found && n < max; sl++, found = tlsf_find(a, &fl, &sl)) {
+      for (struct mem_block *block = a->tlsf_lists[fl][sl]; block && n < max; block = FREE_LINKS(block)->next) {
+        if (GET_SIZE(block) >= min_size && !IS_PURGED(block)) out[n++] = block;
+      }
+    }
+  } else if (a->strategy == STRATEGY_BUDDY) {
+    for (int k = buddy_find(a, buddy_order(buddy_block_size(min_size))); k >= 0 && n < max; k = buddy_find(a, k + 1)) {
+      for (struct mem_block *block = a->buddy_lists[k]; block && n < max; block = FREE_LINKS(block)->next) {
+        if (!IS_PURGED(block)) out[n++] = block;
+      }
+    }
+  } else {
+    struct mem_block *block = best_fit_search(a, min_size);
+    for (struct rb_node *node = block ? FREE_NODE(block) : NULL; node && n < max; node = rb_next(node)) {
+      if (!IS_PURGED(NODE_BLOCK(node))) out[n++] = NODE_BLOCK(node);
+    }
+  }
+  return n;
+}
+
+// 将尾区域末尾空闲块中多余的页解除提交，堆总量随之缩小，返回缩小的字节数
+static size_t trim_tail(struct arena *a, size_t min_age) {
+  struct heap_region *last = a->last_region;
+  struct mem_block *epilogue = REGION_EPILOGUE(last);
+  if (!IS_PREV_FREE(epilogue)) return 0;
+  struct mem_block *tail = PREV_BLOCK(epilogue);
+  if (GET_SIZE(tail) < PURGE_MIN_SIZE || mem.epoch - FREE_STAMP(tail) < min_age) return 0;
+
+  // 末尾空闲块保留最小块大小，之后的整页 (使用透明大页时为整个大页) 全部解除提交
+  uintptr_t new_end = commit_align((uintptr_t)tail + MIN_BLOCK_SIZE + sizeof(struct mem_block));
+  uintptr_t old_end = (uintptr_t)last + last->size;
+  if (new_end >= old_end) return 0;
+  size_t trimmed = old_end - new_end;
+
+  // 用 PROT_NONE 的新映射覆盖：物理页立即释放，地址范围仍然保留
+  if (mmap((void*)new_end, trimmed, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0) == MAP_FAILED) return 0;
+  if (mem.hugepage) madvise((void*)new_end, trimmed, MADV_HUGEPAGE);  // 新映射不继承原来的建议，之后重新提交时仍需使用大页
+
+  free_index_remove(a, tail);
+  unpurge(a, tail);
+  last->size -= trimmed;
+  set_size(tail, GET_SIZE(tail) - trimmed);
+  epilogue = REGION_EPILOGUE(last);
+  epilogue->size = 0;
+  epilogue->applyed_size = 0;
+  mark_free(tail);
+  free_index_insert(a, tail);
+
+  a->total_memory -= trimmed;
+  a->trimmed_memory += trimmed;
+  return trimmed;
+}
+
+// 把 scavenge 或预热临时标记为已分配的空闲块按普通释放流程放回 (不计入已用内存)，调用者需持有 a->lock
+static void unpin_free(struct arena *a, struct mem_block *block) {
+  if (a->strategy == STRATEGY_BEST_FIT) ufree_best_fit(a, block);
+  else if (a->strategy == STRATEGY_TLSF) ufree_tlsf(a, block);
+  else if (a->strategy == STRATEGY_BUDDY) ufree_buddy(a, block);
+  else ufree_quick_fit(a, block);
+}
+
+// 回收竞技场 a 中空闲时长不少于 min_age 个周期的空闲页，调用者需持有 a->lock。
+// 为了不在持锁期间执行 madvise，先把选中的块临时标记为已分配并移出空闲索引 (其他线程不会分配或合并它们)，
+// 解锁后归还系统，再重新加锁按普通释放流程放回 (期间邻居被释放时会正常合并)。
+static void scavenge(struct arena *a, size_t min_age) {
+  struct mem_block *batch[SCAVENGE_BATCH];
+  size_t n;
+
+  if (a->deferred_count) quick_fit_coalesce(a);  // 合并后才能得到整页的空闲块
+
+  while ((n = free_index_collect(a, PURGE_MIN_SIZE, batch, SCAVENGE_BATCH)) > 0) {
+    size_t pinned = 0;
+    for (size_t i = 0; i < n; i++) {
+      if (mem.epoch - FREE_STAMP(batch[i]) < min_age) continue;  // 空闲时间还不够长
+      free_index_remove(a, batch[i]);
+      mark_used(batch[i]);
+      batch[pinned++] = batch[i];
+    }
+    if (pinned == 0) break;
+
+    arena_unlock(a);
+    for (size_t i = 0; i < pinned; i++) {
+      uintptr_t start, end;
+      purge_range(batch[i], &start, &end);
+      madvise((void*)start, end - start, mem.purge_lazy ? MADV_FREE : MADV_DONTNEED);
+    }
+    arena_lock(a);
+
+    for (size_t i = 0; i < pinned; i++) {
+      uintptr_t start, end;
+      purge_range(batch[i], &start, &end);
+      a->purged_memory += end - start;
+      batch[i]->size |= BLOCK_PURGED;
+      unpin_free(a, batch[i]);
+    }
+  }
+
+  trim_tail(a, min_age);
+}
+
+// 将空闲时长不少于 min_age 个周期的空 run 归还系统，调用者需持有 a->lock。
+// 与空闲块相同，先把选中的 run 移出空 run 链表，在锁外执行 madvise
+static void scavenge_runs(struct arena *a, size_t min_age) {
+  struct run *batch[SCAVENGE_BATCH];
+  size_t n;
+
+  do {
+    n = 0;
+    for (struct run *run = a->empty_runs; run && n < SCAVENGE_BATCH; run = run->next) {
+      if (!run->purged && mem.epoch - run->stamp >= min_age) batch[n++] = run;
+    }
+    if (n == 0) break;
+    for (size_t i = 0; i < n; i++) run_unlink(&a->empty_runs, batch[i]);
+
+    arena_unlock(a);
+    for (size_t i = 0; i < n; i++) {
+      madvise(batch[i]->base, RUN_SIZE, mem.purge_lazy ? MADV_FREE : MADV_DONTNEED);
+    }
+    arena_lock(a);
+
+    for (size_t i = 0; i < n; i++) {
+      batch[i]->purged = 1;
+      a->purged_memory += RUN_SIZE;
+      run_link(&a->empty_runs, batch[i]);
+    }
+  } while (n == SCAVENGE_BATCH);
+}
+
+// 依次回收每个竞技场，调用者需持有 mem.lock (锁顺序：mem.lock 在前，竞技场的锁在后)
+static void scavenge_all(size_t min_age) {
+  for (unsigned int i = 0; i < ARENA_MAX; i++) {
+    struct arena *a = mem.arenas[i];
+    if (!a) continue;
+    arena_lock(a);
+    remote_drain(a);
+    scavenge(a, min_age);
+    scavenge_runs(a, min_age);
+    arena_unlock(a);
+  }
+}
+
+// 立即把所有空闲页归还系统 (忽略衰减时间)
+void
+umalloc_purge(void) {
+  tcache_flush_all();  // 当前线程缓存和 CPU 缓存中的对象也先归还竞技场
+  pthread_mutex_lock(&mem.lock);
+  cpu_cache_drain();
+  scavenge_all(0);
+  pthread_mutex_unlock(&mem.lock);
+}
+
+// 让空闲块中可以归还系统的整页范围立即驻留：优先用 MADV_POPULATE_WRITE (Linux 5.14) 一次建立页表，
+// 不支持时逐页写入 (这部分不含空闲块的元数据，内容本来就没有意义)
+static void populate_free(struct mem_block *block) {
+  uintptr_t start, end;
+  purge_range(block, &start, &end);
+  if (end > start && madvise((void*)start, end - start, MADV_POPULATE_WRITE) != 0) {
+    for (uintptr_t p = start; p < end; p += mem.page_size) *(volatile char*)p = 0;
+  }
+}
+
+// 让竞技场 a 所有空闲块中的页立即驻留，调用者不持有 a->lock。
+// 与 scavenge 相同，每批把空闲块临时标记为已分配并移出空闲索引，解锁后建立页表，再加锁放回。
+// 每个区域按地址顺序推进：一批中的最后一个块留到下一批收集完才放回，作为继续遍历的起点 (期间它不会被合并或分割)
+static void prefault_arena(struct arena *a) {
+  struct mem_block *batch[SCAVENGE_BATCH];
+  arena_lock(a);
+  remote_drain(a);
+  for (struct heap_region *r = a->regions; r; r = r->next) {
+    struct mem_block *cursor = NULL;
+    for (;;) {
+      if (a->deferred_count) quick_fit_coalesce(a);  // 延迟合并的块不在空闲索引中
+      size_t n = 0;
+      for (struct mem_block *b = cursor ? NEXT_BLOCK(cursor) : REGION_FIRST_BLOCK(r); GET_SIZE(b) > 0 && n < SCAVENGE_BATCH; b = NEXT_BLOCK(b)) {
+        if (!IS_FREE(b)) continue;
+        free_index_remove(a, b);
+        mark_used(b);
+        batch[n++] = b;
+      }
+      if (cursor) unpin_free(a, cursor);
+      if (n == 0) break;
+
+      arena_unlock(a);
+      for (size_t i = 0; i < n; i++) populate_free(batch[i]);
+      arena_lock(a);
+
+      for (size_t i = 0; i < n; i++) {
+        unpurge(a, batch[i]);
+        if (i + 1 < n) unpin_free(a, batch[i]);
+      }
+      cursor = batch[n - 1];
+    }
+
+    // 曾按 4 KB 页驻留过的范围即使页已归还，页表仍然保留，缺页时不会得到大页，
+    // 因此把已提交部分中完整的大页同步合并一次 (MADV_COLLAPSE，内核不支持时忽略)。区域不会被释放，可以在锁外进行
+    uintptr_t huge_end = ((uintptr_t)r + r->size) & ~(HUGEPAGE_SIZE - 1);
+    if (mem.hugepage && huge_end > (uintptr_t)r) {
+      arena_unlock(a);
+      madvise(r, huge_end - (uintptr_t)r, MADV_COLLAPSE);
+      arena_lock(a);
+    }
+  }
+  arena_unlock(a);
+}
+
+// 预热：保证当前线程的竞技场中有至少 nbytes 字节的连续空闲堆 (不足时扩展堆)，
+// 并让所有已创建的竞技场 (不含私有堆) 中空闲块的页立即驻留，启动时一次承担缺页，而不是由之后的请求承担。
+// 开启 UMALLOC_OPT_HUGEPAGE 时已提交的堆同时合并为透明大页。建立页表在竞技场的锁外分批进行，
+// 其他线程可以同时分配，只是正在预热的块暂时不可用。成功返回 0，内存不足返回 -1
+int
+umalloc_prefault(size_t nbytes) {
+  if (!mem.initialized) mem_init(4096, STRATEGY_BEST_FIT);
+  if (nbytes > 0) {
+    struct arena *a = arena_get();
+    arena_lock(a);
+    remote_drain(a);
+    if (a->deferred_count) quick_fit_coalesce(a);
+    void *p = heap_alloc(a, nbytes);
+    if (!p) {
+      arena_unlock(a);
+      return -1;
+    }
+    free_block(a, GET_BLOCK(p));
+    arena_unlock(a);
+  }
+  for (unsigned int i = 0; i < ARENA_MAX; i++) {
+    struct arena *a = __atomic_load_n(&mem.arenas[i], __ATOMIC_ACQUIRE);  // 竞技场创建后不会释放，不需要 mem.lock
+    if (a) prefault_arena(a);
+  }
+  return 0;
+}
+
+// 开启或关闭竞技场 a 已有区域的透明大页
+static void hugepage_arena(struct arena *a, int on) {
+  arena_lock(a);
+  for (struct heap_region *r = a->regions; r; r = r->next) madvise(r, r->reserved, on ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+  arena_unlock(a);
+}
+
+// 对所有竞技场和私有堆应用透明大页设置，之后预留的区域按 mem.hugepage 设置，调用者需持有 mem.lock
+static void hugepage_apply(int on) {
+  for (unsigned int i = 0; i < ARENA_MAX; i++) {
+    if (mem.arenas[i]) hugepage_arena(mem.arenas[i], on);
+  }
+  for (struct arena *h = mem.heaps; h; h = h->heap_next) hugepage_arena(h, on);
+}
+
+// 堆区域中由透明大页支持的字节数 (/proc/self/smaps 中的 AnonHugePages)，读取失败返回 0。
+// 需要解析整个 smaps，开销与映射数成正比，因此不放在 umalloc_get_stats 中，由需要的调用者单独查询。
+// 可能在作为 malloc 使用时调用，因此不经过分配器：用栈上的缓冲区逐行解析
+size_t
+umalloc_hugepage_bytes(void) {
+  int fd = open("/proc/self/smaps", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return 0;
+  char buf[4096];
+  size_t len = 0, total = 0;
+  int in_heap = 0;  // 当前映射是否属于堆区域
+  ssize_t n;
+  while ((n = read(fd, buf + len, sizeof(buf) - len)) > 0) {
+    len += n;
+    char *line = buf, *nl;
+    while ((nl = memchr(line, '\n', buf + len - line))) {
+      *nl = '\0';
+      uintptr_t start, end;
+      size_t kb;
+      if (sscanf(line, "%" SCNxPTR "-%" SCNxPTR " ", &start, &end) == 2) {
+        in_heap = (start >> REGION_SHIFT) < REGION_MAP_SIZE && REGION_OF(start) != NULL;
+      } else if (in_heap && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1) {
+        total += kb << 10;
+      }
+      line = nl + 1;
+    }
+    len = buf + len - line;
+    if (len == sizeof(buf)) len = 0;  // 过长的行 (不会是需要的字段) 直接丢弃
+    memmove(buf, line, len);
+  }
+  close(fd);
+  return total;
+}
+
+// 后台回收线程：每 decay_ms / SCAVENGE_TICKS 毫秒推进一次 epoch，回收空闲了 SCAVENGE_TICKS 个周期以上的页
+static void* scavenger_main(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&mem.lock);
+  while (mem.scavenger_running) {
+    size_t tick_ms = mem.decay_ms / SCAVENGE_TICKS;
+    if (tick_ms == 0) tick_ms = 1;
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += tick_ms / 1000;
+    deadline.tv_nsec += (long)(tick_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (pthread_cond_timedwait(&mem.scavenger_cond, &mem.lock, &deadline) == 0) continue;  // 被唤醒：参数改变或需要退出
+    mem.epoch++;
+    scavenge_all(SCAVENGE_TICKS);
+  }
+  pthread_mutex_unlock(&mem.lock);
+  return NULL;
+}
+
+int
+scavenger_start(void) {
+  pthread_mutex_lock(&mem.lock);
+  if (mem.scavenger_running) {
+    pthread_mutex_unlock(&mem.lock);
+    return 0;
+  }
+  mem.scavenger_running = 1;
+  if (pthread_create(&mem.scavenger, NULL, scavenger_main, NULL) != 0) {
+    mem.scavenger_running = 0;
+    pthread_mutex_unlock(&mem.lock);
+    return -1;
+  }
+  pthread_mutex_unlock(&mem.lock);
+  return 0;
+}
+
+int
+scavenger_stop(void) {
+  pthread_mutex_lock(&mem.lock);
+  if (!mem.scavenger_running) {
+    pthread_mutex_unlock(&mem.lock);
+    return 0;
+  }
+  mem.scavenger_running = 0;
+  pthread_cond_signal(&mem.scavenger_cond);
+  pthread_mutex_unlock(&mem.lock);
+  pthread_join(mem.scavenger, NULL);
+  return 0;
+}
+
+
+// =================== 可调参数 ==================
+// 设置可调参数，成功返回 0，参数无效返回 -1
+int
+umallopt(umalloc_option option, size_t value) {
+  switch (option) {
+  case UMALLOC_OPT_MMAP_THRESHOLD:
+    mem.mmap_threshold = value;
+    return 0;
+  case UMALLOC_OPT_DECAY_MS:
+    pthread_mutex_lock(&mem.lock);
+    mem.decay_ms = value;
+    pthread_cond_signal(&mem.scavenger_cond);  // 让后台线程按新的周期休眠
+    pthread_mutex_unlock(&mem.lock);
+    return 0;
+  case UMALLOC_OPT_BACKGROUND_THREAD:
+    return value ? scavenger_start() : scavenger_stop();
+  case UMALLOC_OPT_PURGE_LAZY:
+    mem.purge_lazy = value != 0;
+    return 0;
+  case UMALLOC_OPT_PROFILE:
+    if (value > UINT32_MAX) return -1;
+    mem.profile = (unsigned int)value;
+    return 0;
+  case UMALLOC_OPT_CHECK_SIZED:
+    mem.check_sized = value != 0;
+    return 0;
+  case UMALLOC_OPT_DEFER_COALESCE:
+    // 关闭后已延迟的块留到下一次未命中或回收时合并
+    if (value > 100) return -1;
+    mem.defer_coalesce = value;
+    return 0;
+  case UMALLOC_OPT_HUGEPAGE:
+    pthread_mutex_lock(&mem.lock);
+    mem.hugepage = value != 0;
+    hugepage_apply(mem.hugepage);
+    pthread_mutex_unlock(&mem.lock);
+    return 0;
+  case UMALLOC_OPT_PERCPU_CACHE:
+    return cpu_cache_enable(value != 0);
+  case UMALLOC_OPT_ARENAS:
+    // 已创建的竞技场不会销毁，其中的块照常释放；只是新分配不再使用超出数量的竞技场
+    if (value == 0 || value > ARENA_MAX) return -1;
+    pthread_mutex_lock(&mem.lock);
+    mem.arena_count = (unsigned int)value;
+    pthread_mutex_unlock(&mem.lock);
+    return 0;
+  }
+  return -1;
+}
+
+
+// =================== 统计 ==================
+// 汇总所有竞技场发布的快照和各线程记录的内部碎片变化，不遍历堆。只有竞技场的最大空闲块
+// 被取走之后才短暂获取它的锁，从空闲索引求出新的最大块，其余情况不获取任何锁。
+// 每个竞技场的数据各自一致，不同竞技场之间不是同一时刻的快照
+void
+umalloc_get_stats(struct umalloc_stats *stats) {
+  memset(stats, 0, sizeof(*stats));
+  for (unsigned int i = 0; i < ARENA_MAX; i++) {
+    struct arena *a = __atomic_load_n(&mem.arenas[i], __ATOMIC_ACQUIRE);
+    if (!a) continue;
+    struct arena_stats s;
+    arena_stats_read(a, &s);
+    if (s.largest_dirty) {
+      // 快照中的最大空闲块只是上界，持锁重新求出，解锁时发布新的快照
+      arena_lock(a);
+      if (a->largest_dirty) {
+        a->largest_free = free_index_largest(a);
+        a->largest_dirty = 0;
+      }
+      arena_unlock(a);
+      arena_stats_read(a, &s);
+    }
+    stats->arena_count++;
+    stats->total_bytes += s.heap_memory + s.run_memory + s.large_memory;
+    stats->used_bytes += s.used_memory + s.large_memory + s.slab_used;
+    stats->free_bytes += s.free_memory;
+    stats->free_blocks += s.free_count;
+    if (s.largest_free > stats->largest_free) stats->largest_free = s.largest_free;
+    stats->internal_waste += s.waste;
+    stats->committed_bytes += s.heap_memory + s.run_memory;
+    stats->purged_bytes += s.purged_memory;
+    stats->trimmed_bytes += s.trimmed_memory;
+    stats->grow_count += s.grow_count;
+    stats->mmapped_bytes += s.large_memory;
+    stats->mmapped_count += s.large_count;
+    stats->slab_bytes += s.run_memory;
+    stats->slab_runs += s.run_count;
+    stats->remote_drained += s.remote_drained;
+    stats->deferred_blocks += s.deferred_count;
+    stats->deferred_bytes += s.deferred_memory;
+    stats->coalesce_passes += s.coalesce_passes;
+    stats->coalesce_merges += s.coalesce_merges;
+    stats->coalesce_ns += s.coalesce_ns;
+  }
+  for (struct thread_stats *t = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); t; t = t->next) {
+    stats->internal_waste += __atomic_load_n(&t->waste, __ATOMIC_RELAXED);
+  }
+  stats->internal_waste += __atomic_load_n(&thread_stats_fallback.waste, __ATOMIC_RELAXED);
+  stats->arena_limit = mem.arena_count;
+  stats->cpu_caches = mem.cpu_cache ? mem.cpu_count : 0;
+  stats->cpu_cache_rseq = mem.cpu_cache && mem.cpu_cache_rseq;
+}
+
+// 打印统计，先归还当前线程缓存和 CPU 缓存中的块，避免它们被统计为已用
+void 
+fragmentation_stats() {
+  tcache_flush_all();
+  pthread_mutex_lock(&mem.lock);
+  cpu_cache_drain();
+  pthread_mutex_unlock(&mem.lock);
+  struct umalloc_stats stats;
+  umalloc_get_stats(&stats);
+
+  size_t external_frag = 0;  // 记录外部碎片
+  if (stats.free_bytes > 0) {
+    // 外部碎片率 = (1 - 最大连续空闲块大小 / 总空闲内存) × 100%
+    external_frag = (stats.free_bytes - stats.largest_free) * 10000 / stats.free_bytes;  // 计算外部碎片百分比，这里保留两位小数
+  }
+
+  size_t internal_frag = 0;  // 记录内部碎片，这里没有将元数据也算入内部碎片
+  if (stats.internal_waste > 0) {
+    // 内部碎片率 = 未使用的有效载荷总和 / 已分配的块总大小 × 100%
+    internal_frag = stats.internal_waste * 10000 / stats.used_bytes;  // 计算内部碎片百分比，这里保留两位小数
+  }
+
+  printf("Memory Stats:\n");
+  printf("  Total: %zu bytes\n", stats.total_bytes);
+  printf("  Used: %zu bytes\n", stats.used_bytes);
+  printf("  Free: %zu bytes in %zu blocks\n", stats.free_bytes, stats.free_blocks);
+  printf("  Largest free block: %zu bytes\n", stats.largest_free);
+  printf("  Arenas: %u of %u\n", stats.arena_count, stats.arena_limit);
+  printf("  Heap growth: %zu times (trimmed %zu bytes)\n", stats.grow_count, stats.trimmed_bytes);
+  printf("  Resident: %zu of %zu committed bytes\n", stats.committed_bytes - stats.purged_bytes, stats.committed_bytes);
+  printf("  Mmapped: %zu bytes in %zu chunks\n", stats.mmapped_bytes, stats.mmapped_count);
+  printf("  Slab: %zu runs of %zu committed bytes\n", stats.slab_runs, stats.slab_bytes);
+  printf("  Remote frees: %zu drained\n", stats.remote_drained);
+  if (mem.hugepage) printf("  Huge pages: %zu of %zu committed heap bytes\n", umalloc_hugepage_bytes(), stats.committed_bytes - stats.slab_bytes);
+  if (stats.cpu_caches) printf("  CPU caches: %u (%s)\n", stats.cpu_caches, stats.cpu_cache_rseq ? "rseq" : "sched_getcpu");
+  printf("  Deferred: %zu blocks (%zu bytes), %zu coalescing passes merged %zu blocks in %zu ns\n",
+         stats.deferred_blocks, stats.deferred_bytes, stats.coalesce_passes, stats.coalesce_merges, stats.coalesce_ns);
+  printf("  External: %zu.%02zu%%\n", external_frag / 100, external_frag % 100);
+  printf("  Internal: %zu.%02zu%% (%zu bytes)\n", internal_frag / 100, internal_frag % 100, stats.internal_waste);
+}
+
+// 把一条线程记录累加到 profile 中
+static void profile_merge(struct umalloc_profile *profile, struct thread_stats *t) {
+  const size_t *src = (const size_t*)t->classes;
+  size_t *dst = (size_t*)profile->classes;
+  size_t words = STAT_CLASSES * sizeof(struct umalloc_class_stats) / sizeof(size_t);  // 计数全部是 size_t，按字累加
+  for (size_t i = 0; i < words; i++) dst[i] += __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    profile->malloc_latency[i] += __atomic_load_n(&t->malloc_latency[i], __ATOMIC_RELAXED);
+    profile->free_latency[i] += __atomic_load_n(&t->free_latency[i], __ATOMIC_RELAXED);
+  }
+}
+
+// 合并所有线程记录中的操作计数和耗时直方图，不获取锁；正在运行的线程的计数可能略有滞后
+void
+umalloc_get_profile(struct umalloc_profile *profile) {
+  memset(profile, 0, sizeof(*profile));
+  for (struct thread_stats *t = __atomic_load_n(&thread_stats_list, __ATOMIC_ACQUIRE); t; t = t->next) profile_merge(profile, t);
+  profile_merge(profile, &thread_stats_fallback);
+
+  // 计时单位与纳秒的比例：用初始化以来的计时读数与单调时钟之比换算
+  profile->tick_ns = 1.0;
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ticks = profile_clock() - mem.clock_ticks;
+  if (mem.initialized && ticks > 0) profile->tick_ns = (double)(monotonic_ns() - mem.clock_ns) / ticks;
+#endif
+}
+
+// 直方图中位于分位点 q (0 ~ 1) 的桶的上界 (计时单位)，没有记录时返回 0
+static double latency_percentile(const size_t *hist, double q) {
+  size_t total = 0, seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) total += hist[i];
+  if (total == 0) return 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen >= q * total) return (double)(2UL << i);
+  }
+  return 0;
+}
+
+static void latency_print(const char *name, const size_t *hist, double tick_ns) {
+  size_t total = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++) total += hist[i];
+  printf("  %s: %zu samples, p50 <= %.0f ns, p90 <= %.0f ns, p99 <= %.0f ns\n", name, total,
+         latency_percentile(hist, 0.5) * tick_ns, latency_percentile(hist, 0.9) * tick_ns, latency_percentile(hist, 0.99) * tick_ns);
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    if (hist[i]) printf("    [%8.0f, %8.0f) ns: %zu\n", (double)(1UL << i) * tick_ns, (double)(2UL << i) * tick_ns, hist[i]);
+  }
+}
+
+// 打印按大小分级的操作计数 (只列出有记录的级别) 和 umalloc/ufree 的耗时分布
+void
+profile_stats() {
+  struct umalloc_profile profile;
+  umalloc_get_profile(&profile);
+
+  printf("Allocator Profile:\n");
+  printf("  %-16s %10s %10s %10s %10s %10s %10s\n", "Class (bytes)", "Allocs", "Frees", "Splits", "Coalesces", "Extends", "Scans");
+  for (int i = 0; i < STAT_CLASSES; i++) {
+    struct umalloc_class_stats *c = &profile.classes[i];
+    if (!c->allocs && !c->frees && !c->splits && !c->coalesces && !c->extends && !c->scans) continue;
+    char range[48];
+    snprintf(range, sizeof(range), "[%lu, %lu)", 1UL << i, 2UL << i);
+    printf("  %-16s %10zu %10zu %10zu %10zu %10zu %10zu\n", range, c->allocs, c->frees, c->splits, c->coalesces, c->extends, c->scans);
+  }
+  latency_print("umalloc", profile.malloc_latency, profile.tick_ns);
+  latency_print("ufree", profile.free_latency, profile.tick_ns);
+}
+
+
+// =================== 内存可视化 ==================
+// 持锁时只把块头拷贝到快照中 (每个竞技场一次顺序遍历)，绘制和导出都在释放锁之后进行。
+// 快照数组用 mmap 分配并按需 mremap 扩大，不经过分配器本身
+struct heap_snapshot {
+  struct umalloc_map_region *regions;
+  struct umalloc_map_block *blocks;
+  size_t region_count, region_capacity;
+  size_t block_count, block_capacity;
+};
+
+// 确保数组还能再放一个元素，失败返回 -1
+static int snapshot_reserve(void **array, size_t *capacity, size_t count, size_t elem) {
+  if (count < *capacity) return 0;
+  size_t old_size = *capacity * elem;
+  size_t new_size = old_size ? old_size * 2 : 16 * mem.page_size;
+  void *p = old_size ? mremap(*array, old_size, new_size, MREMAP_MAYMOVE)
+                     : mmap(NULL, new_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (p == MAP_FAILED) return -1;
+  *array = p;
+  *capacity = new_size / elem;
+  return 0;
+}
+
+// 拷贝竞技场中每个区域的块，id 为竞技场下标或 HEAP_INDEX 加私有堆的序号，调用者需持有 a->lock
+static int snapshot_arena(struct heap_snapshot *snap, struct arena *a, unsigned int id) {
+  for (struct heap_region *region = a->regions; region; region = region->next) {
+    if (snapshot_reserve((void**)&snap->regions, &snap->region_capacity, snap->region_count, sizeof(struct umalloc_map_region))) return -1;
+    struct umalloc_map_region *r = &snap->regions[snap->region_count++];
+    *r = (struct umalloc_map_region){(uintptr_t)REGION_FIRST_BLOCK(region), region->size - REGION_OVERHEAD, 0, id, 0};
+    for (struct mem_block *b = REGION_FIRST_BLOCK(region); GET_SIZE(b); b = NEXT_BLOCK(b)) {
+      if (snapshot_reserve((void**)&snap->blocks, &snap->block_capacity, snap->block_count, sizeof(struct umalloc_map_block))) return -1;
+      snap->blocks[snap->block_count++] = (struct umalloc_map_block){
+        b->size & (~BLOCK_FLAGS | BLOCK_FREE | BLOCK_PURGED), IS_FREE(b) ? 0 : b->applyed_size};
+      r->block_count++;
+    }
+  }
+  return 0;
+}
+
+// 依次锁住每个竞技场和私有堆拷贝块头，失败返回 -1
+static int snapshot_take(struct heap_snapshot *snap) {
+  memset(snap, 0, sizeof(*snap));
+  if (!mem.initialized) return 0;
+  tcache_flush_all();  // 先归还当前线程缓存和 CPU 缓存中的块
+  int err = 0;
+  pthread_mutex_lock(&mem.lock);
+  cpu_cache_drain();
+  for (unsigned int i = 0; i < ARENA_MAX && !err; i++) {
+    struct arena *a = mem.arenas[i];
+    if (!a) continue;
+    arena_lock(a);
+    remote_drain(a);
+    err = snapshot_arena(snap, a, i);
+    arena_unlock(a);
+  }
+  unsigned int id = HEAP_INDEX;
+  for (struct arena *h = mem.heaps; h && !err; h = h->heap_next) {
+    arena_lock(h);
+    err = snapshot_arena(snap, h, id++);
+    arena_unlock(h);
+  }
+  pthread_mutex_unlock(&mem.lock);
+  return err;
+}
+
+static void snapshot_release(struct heap_snapshot *snap) {
+  if (snap->regions) munmap(snap->regions, snap->region_capacity * sizeof(struct umalloc_map_region));
+  if (snap->blocks) munmap(snap->blocks, snap->block_capacity * sizeof(struct umalloc_map_block));
+}
+
+// 绘制一个竞技场的布局：把它的各个区域首尾相接，每个字符代表 scale 字节，
+// 按地址顺序扫描一遍块，把每个块的字节计入它覆盖的字符
+static void visualize_arena(struct umalloc_map_region *regions, size_t region_count,
+                            struct umalloc_map_block *blocks, unsigned int rows, unsigned int columns) {
+  size_t total = 0, total_used = 0, total_free = 0, block_count = 0, free_blocks = 0;
+  for (size_t i = 0; i < region_count; i++) {
+    total += regions[i].size;
+    block_count += regions[i].block_count;
+  }
+  for (size_t i = 0; i < block_count; i++) {
+    size_t size = blocks[i].size & ~BLOCK_FLAGS;
+    if (blocks[i].size & BLOCK_FREE) {
+      free_blocks++;
+      total_free += size;
+    } else {
+      total_used += size;
+    }
+  }
+  size_t cells = (size_t)rows * columns;
+  size_t scale = (total + cells - 1) / cells;  // 每个字符代表的字节数
+  if (scale == 0) scale = 1;
+
+  printf("\n+------------------------------------------------------------+\n");
+  if (regions[0].arena >= HEAP_INDEX) printf("|                    MEMORY LAYOUT (heap %u)                  |\n", regions[0].arena - HEAP_INDEX);
+  else printf("|                    MEMORY LAYOUT (arena %u)                 |\n", regions[0].arena);
+  printf("+------------------------------------------------------------+\n");
+  printf("| Total: %zu  Used: %zu  Free: %zu |\n", total, total_used, total_free);
+  printf("| Blocks: %zu (Used: %zu Free: %zu) Util: %d%% |\n",
+         block_count, block_count - free_blocks, free_blocks, total ? (int)(total_used * 100 / total) : 0);
+  printf("+------------------------------------------------------------+\n");
+  for (size_t i = 0; i < region_count; i++) {
+    printf("| Region %zu: %p - %p |\n", i, (void*)(uintptr_t)regions[i].start, (void*)(uintptr_t)(regions[i].start + regions[i].size));
+  }
+  printf("+------------------------------------------------------------+\n");
+  printf("| Address        | Memory State                              |\n");
+  printf("+------------------------------------------------------------+\n");
+
+  char line[columns + 1];
+  size_t cell_used = 0, cell_free = 0;  // 当前字符中已用和空闲的字节数
+  size_t room = scale;  // 当前字符还能容纳的字节数
+  unsigned int column = 0;
+  uintptr_t row_addr = 0;
+  struct umalloc_map_block *b = blocks;
+  for (size_t r = 0; r < region_count; r++) {
+    uintptr_t addr = regions[r].start;
+    for (size_t i = 0; i < regions[r].block_count; i++, b++) {
+      size_t left = b->size & ~BLOCK_FLAGS;
+      while (left > 0) {
+        if (column == 0 && room == scale) row_addr = addr;
+        size_t take = left < room ? left : room;
+        if (b->size & BLOCK_FREE) cell_free += take;
+        else cell_used += take;
+        addr += take;
+        left -= take;
+        room -= take;
+        if (room > 0) continue;
+        // 当前字符已满
+        line[column++] = cell_free == 0 ? '#' : cell_used == 0 ? '.' : '+';
+        cell_used = cell_free = 0;
+        room = scale;
+        if (column == columns) {
+          line[column] = '\0';
+          printf("| %p | %s |\n", (void*)row_addr, line);
+          column = 0;
+        }
+      }
+    }
+  }
+  // 最后一个不满的字符和行
+  if (room < scale) line[column++] = cell_free == 0 ? '#' : cell_used == 0 ? '.' : '+';
+  if (column > 0) {
+    memset(line + column, ' ', columns - column);
+    line[columns] = '\0';
+    printf("| %p | %s |\n", (void*)row_addr, line);
+  }
+
+  printf("+------------------------------------------------------------+\n");
+  printf("| Legend: # = Used  . = Free  + = Mixed  (%zu B per char)      |\n", scale);
+  printf("+------------------------------------------------------------+\n");
+}
+
+// 以 rows 行、每行 columns 个字符的分辨率依次绘制每个竞技场和私有堆
+void
+visualize_heap(unsigned int rows, unsigned int columns) {
+  if (rows == 0 || columns == 0) return;
+  struct heap_snapshot snap;
+  if (snapshot_take(&snap) != 0) {
+    fprintf(stderr, "visualize_heap: snapshot failed\n");
+    snapshot_release(&snap);
+    return;
+  }
+  struct umalloc_map_block *blocks = snap.blocks;
+  for (size_t i = 0; i < snap.region_count; ) {
+    // 同一个竞技场的区域在快照中相邻
+    size_t j = i, block_count = 0;
+    for (; j < snap.region_count && snap.regions[j].arena == snap.regions[i].arena; j++) {
+      block_count += snap.regions[j].block_count;
+    }
+    visualize_arena(&snap.regions[i], j - i, blocks, rows, columns);
+    blocks += block_count;
+    i = j;
+  }
+  snapshot_release(&snap);
+}
+
+void
+visualize_memory() {
+  visualize_heap(16, 32);
+}
+
+// 导出块布局：二进制格式为 umalloc_map_header，之后每个区域的 umalloc_map_region 后紧跟它的块记录；
+// JSON 格式为 {"regions": [{"arena", "start", "size", "blocks": [[大小, 标志, 申请大小], ...]}, ...]}。
+// 成功返回 0，失败返回 -1
+int
+umalloc_heap_map(const char *path, umalloc_map_format format) {
+  struct heap_snapshot snap;
+  if (snapshot_take(&snap) != 0) {
+    snapshot_release(&snap);
+    errno = ENOMEM;
+    return -1;
+  }
+  FILE *f = fopen(path, "w");
+  if (!f) {
+    snapshot_release(&snap);
+    return -1;
+  }
+
+  struct umalloc_map_block *b = snap.blocks;
+  if (format == UMALLOC_MAP_JSON) {
+    fprintf(f, "{\"regions\": [");
+    for (size_t r = 0; r < snap.region_count; r++) {
+      struct umalloc_map_region *region = &snap.regions[r];
+      fprintf(f, "%s\n {\"arena\": %u, \"start\": \"%#" PRIx64 "\", \"size\": %" PRIu64 ", \"blocks\": [",
+              r ? "," : "", region->arena, region->start, region->size);
+      for (uint64_t i = 0; i < region->block_count; i++, b++) {
+        fprintf(f, "%s[%" PRIu64 ",%u,%" PRIu64 "]", i ? "," : "",
+                b->size & ~(uint64_t)BLOCK_FLAGS, (unsigned int)(b->size & BLOCK_FLAGS), b->requested);
+      }
+      fprintf(f, "]}");
+    }
+    fprintf(f, "\n]}\n");
+  } else {
+    struct umalloc_map_header header = {UMALLOC_MAP_MAGIC, (uint32_t)snap.region_count, 0};
+    fwrite(&header, sizeof(header), 1, f);
+    for (size_t r = 0; r < snap.region_count; r++) {
+      fwrite(&snap.regions[r], sizeof(struct umalloc_map_region), 1, f);
+      fwrite(b, sizeof(struct umalloc_map_block), snap.regions[r].block_count, f);
+      b += snap.regions[r].block_count;
+    }
+  }
+  int err = ferror(f);
+  if (fclose(f) != 0) err = 1;
+  snapshot_release(&snap);
+  return err ? -1 : 0;
+}
+
+
+// =================== 统一 malloc 接口 ==================
+// 按大小分发到大对象、slab、线程缓存或竞技场的堆
+static void* malloc_dispatch(size_t nbytes) {
+  // 大对象直接映射
+  if (nbytes > mem.mmap_threshold) return large_alloc(nbytes, 0);
+
+  // 小对象从 slab 分配
+  if (nbytes <= SLAB_MAX_SIZE) {
+    if (mem.cpu_cache) return cpu_cache_get(SLAB_CLASS(nbytes), nbytes);
+    return slab_cache_get(SLAB_CLASS(nbytes));
+  }
+
+  // 优先从 CPU 缓存或线程本地缓存分配，命中时不需要获取锁
+  int index = tcache_class(request_block_size(nbytes));
+  if (index >= 0) {
+    if (mem.cpu_cache) return cpu_cache_get(SLAB_CLASS_COUNT + index, nbytes);
+    struct mem_block *block = tcache_get(index);
+    if (block) {
+      block_set_applyed(block, nbytes);
+      return (void*)((char*)block + sizeof(struct mem_block));
+    }
+    block = tcache_refill(index, nbytes);
+    return block ? (void*)((char*)block + sizeof(struct mem_block)) : NULL;
+  }
+
+  struct arena *a = arena_get();  // 当前线程的竞技场
+  arena_lock(a);
+  remote_drain(a);
+  void *p = heap_alloc(a, nbytes);
+  arena_unlock(a);
+
+  return p;
+}
+
+void*
+umalloc(size_t nbytes)
+{
+  if (nbytes <= 0) return NULL;
+
+  // 首次调用时初始化内存管理器 (选定策略)
+  if (!mem.initialized) {
+    mem_init(4096, STRATEGY_BEST_FIT);
+    // mem_init(4096, STRATEGY_QUICK_FIT);
+  }
+
+  struct thread_stats *t = thread_stats_get();
+  thread_stat_add(&t->classes[stat_class(nbytes)].allocs, 1);
+  void *p;
+  if (!profile_sample()) {
+    p = malloc_dispatch(nbytes);
+  } else {
+    uint64_t start = profile_clock();
+    p = malloc_dispatch(nbytes);
+    latency_record(t->malloc_latency, start);
+  }
+  if (TRACING() && p) trace_event(UMALLOC_TRACE_MALLOC, p, 0, nbytes);
+  return p;
+}
+
+// 统一释放内存的分发器
+static void free_dispatch(void *pa) {
+  // 小对象：通过页映射表找到所属 run，放入线程缓存；已在 run 中空闲或已在缓存中的槽位直接忽略
+  struct run *run = run_of(pa);
+  if (run) {
+    if (slab_is_free(run, pa) || !slot_cache_mark(run, pa)) return;
+    CLASS_STAT(frees, SLAB_SLOT_SIZE(run->class_index));
+    if (mem.cpu_cache) cpu_cache_put(run->class_index, pa);
+    else slab_cache_put(run, pa);
+    return;
+  }
+
+  struct mem_block *block = GET_BLOCK(pa);
+  // 安全检查：已空闲或已在线程缓存中 (applyed_size 为 0) 的块直接忽略
+  if (IS_FREE(block) || block->applyed_size == 0) return;
+  CLASS_STAT(frees, PAYLOAD_SIZE(block));
+
+  // 大对象直接解除映射
+  if (IS_MMAPPED(block)) {
+    large_free(block);
+    return;
+  }
+
+  // 优先放入 CPU 缓存或线程本地缓存，不需要获取锁
+  if (mem.cpu_cache) {
+    int index = tcache_class(GET_SIZE(block));
+    if (index >= 0) {
+      cpu_cache_put(SLAB_CLASS_COUNT + index, pa);
+      return;
+    }
+  } else if (tcache_put(block)) {
+    return;
+  }
+
+  // 块属于其他线程的竞技场时压入对方的远程释放栈，不获取对方的锁
+  struct arena *a = arena_of(block);
+  if (is_remote(a)) {
+    block_set_applyed(block, 0);  // 与线程缓存相同，标记为已释放
+    remote_push(a, pa, pa);
+    return;
+  }
+  arena_lock(a);
+  free_block(a, block);
+  arena_unlock(a);
+}
+
+void
+ufree(void *pa) {
+  if (pa == 0) return;
+  if (TRACING()) trace_event(UMALLOC_TRACE_FREE, pa, 0, 0);
+  if (!profile_sample()) {
+    free_dispatch(pa);
+    return;
+  }
+  uint64_t start = profile_clock();
+  free_dispatch(pa);
+  latency_record(thread_stats_get()->free_latency, start);
+}
+
+// 调试模式下核对 ufree_sized 的大小：槽位须放得下 nbytes，块须记录着同样的申请大小
+static void sized_check(void *pa, size_t nbytes) {
+  struct run *run = run_of(pa);
+  if (run) {
+    if (slab_is_free(run, pa) || nbytes > SLAB_SLOT_SIZE(run->class_index)) {
+      fprintf(stderr, "ufree_sized: %p size %zu does not match slot size %zu\n", pa, nbytes, SLAB_SLOT_SIZE(run->class_index));
+      abort();
+    }
+    return;
+  }
+  struct mem_block *block = GET_BLOCK(pa);
+  if (IS_FREE(block) || block->applyed_size != nbytes) {
+    fprintf(stderr, "ufree_sized: %p size %zu does not match allocated size %zu\n", pa, nbytes, IS_FREE(block) ? 0 : block->applyed_size);
+    abort();
+  }
+}
+
+// 带大小的释放：nbytes 须与分配 (或最后一次 urealloc) 时的申请大小相同，与 C++ 的 sized delete 一致。
+// 去向只由 nbytes 和地址决定，不读取块头：大于 slab 上限的一定不是槽位，省去页映射表的查找；
+// 不在任何堆区域中的是大对象；其余按 nbytes 算出缓存级别直接放入线程缓存。
+// 不检查重复释放，调试模式 (UMALLOC_OPT_CHECK_SIZED) 下才核对大小和块状态
+void
+ufree_sized(void *pa, size_t nbytes) {
+  if (pa == 0) return;
+  if (TRACING()) trace_event(UMALLOC_TRACE_FREE, pa, 0, nbytes);
+  if (mem.check_sized) sized_check(pa, nbytes);
+
+  if (nbytes <= SLAB_MAX_SIZE) {
+    struct run *run = run_of(pa);
+    if (run) {
+      if (!slot_cache_mark(run, pa)) return;  // 已在缓存中
+      CLASS_STAT(frees, SLAB_SLOT_SIZE(run->class_index));  // 与 ufree 相同，按槽位大小分级
+      if (mem.cpu_cache) cpu_cache_put(run->class_index, pa);
+      else slab_cache_put(run, pa);
+      return;
+    }
+  }
+
+  struct mem_block *block = GET_BLOCK(pa);
+  struct heap_region *region = REGION_OF(block);
+  CLASS_STAT(frees, PAYLOAD_SIZE(block));  // 与 ufree 相同，按有效载荷大小分级
+  if (!region) {
+    large_free(block);
+    return;
+  }
+
+  // 缓存级别由申请大小直接算出，不需要按块大小查找。放入线程缓存时仍要把 applyed_size 清零：
+  // 它是"已在缓存中"的标记 (之后的 ufree 据此忽略重复释放)，内部碎片的统计也依赖它。
+  // 块头与缓存链表指针 (有效载荷的开头) 通常在同一缓存行，这次写入不会带来额外的缺失
+  int index = tcache_class(request_block_size(nbytes));
+  if (index >= 0) {
+    if (mem.cpu_cache) cpu_cache_put(SLAB_CLASS_COUNT + index, pa);
+    else tcache_put_class(block, index);
+    return;
+  }
+
+  // 不进入缓存的块需要按块大小合并
+  struct arena *a = region->arena;
+  if (is_remote(a)) {
+    block_set_applyed(block, 0);
+    remote_push(a, pa, pa);
+    return;
+  }
+  arena_lock(a);
+  free_block(a, block);
+  arena_unlock(a);
+}
+
+// 可用大小：槽位或块的有效载荷大小，调用者可以直接使用申请大小之外的空间
+size_t
+umalloc_usable_size(void *pa) {
+  if (pa == 0) return 0;
+  struct run *run = run_of(pa);
+  if (run) return SLAB_SLOT_SIZE(run->class_index);
+  return PAYLOAD_SIZE(GET_BLOCK(pa));
+}
+
+// 原地调整堆中已分配块的大小，成功返回 1：
+// 缩小时把多余的尾部分割出来按普通释放流程归还 (会与后面的空闲块合并)，扩大时吞并后面相邻的空闲块
+static int block_resize(struct mem_block *block, size_t nbytes) {
+  struct arena *a = arena_of(block);
+  size_t required_size = BLOCK_SIZE(nbytes);
+  size_t size = GET_SIZE(block);
+  int ok = 1;
+
+  // 伙伴块只能缩小为自身的低半部分，不能吞并相邻的块
+  if (a->strategy == STRATEGY_BUDDY) {
+    required_size = buddy_block_size(required_size);
+    if (required_size > size) return 0;
+  }
+
+  arena_lock(a);
+  if (required_size > size) {
+    struct mem_block *next = NEXT_BLOCK(block);
+    if (IS_FREE(next) && size + GET_SIZE(next) >= required_size) {
+      free_index_remove(a, next);
+      unpurge(a, next);
+      a->waste -= block_waste(block);
+      set_size(block, size + GET_SIZE(next));
+      a->used_memory -= size;
+      place_block(a, block, required_size, nbytes);  // 多出的部分重新分割为空闲块
+    } else {
+      ok = 0;
+    }
+  } else {
+    a->waste -= block_waste(block);
+    block->applyed_size = nbytes;
+    if (size - required_size >= MIN_BLOCK_SIZE) {
+      CLASS_STAT(splits, size);
+      struct mem_block *tail = (struct mem_block*)((char*)block + required_size);
+      tail->size = size - required_size;  // 前一块仍是已分配状态
+      tail->applyed_size = 0;
+      set_size(block, required_size);
+      free_block(a, tail);
+    }
+    a->waste += block_waste(block);
+  }
+  arena_unlock(a);
+  return ok;
+}
+
+// 调整已分配内存的大小：能原地完成时不移动数据，否则分配新的内存并复制
+static void* realloc_dispatch(void *pa, size_t nbytes) {
+  if (pa == 0) return umalloc(nbytes);
+  if (nbytes == 0) {
+    ufree(pa);
+    return NULL;
+  }
+
+  struct run *run = run_of(pa);
+  if (run) {
+    if (nbytes <= SLAB_SLOT_SIZE(run->class_index)) return pa;  // 槽位本身放得下
+  } else {
+    struct mem_block *block = GET_BLOCK(pa);
+    if (IS_MMAPPED(block)) {
+      if (nbytes > mem.mmap_threshold) return large_realloc(block, nbytes);  // mremap 调整映射
+    } else if (nbytes <= mem.mmap_threshold && block_resize(block, nbytes)) {
+      return pa;
+    }
+  }
+
+  void *p = umalloc(nbytes);
+  if (!p) return NULL;
+  size_t old_size = umalloc_usable_size(pa);
+  memcpy(p, pa, old_size < nbytes ? old_size : nbytes);
+  ufree(pa);
+  return p;
+}
+
+void*
+urealloc(void *pa, size_t nbytes) {
+  if (!TRACING()) return realloc_dispatch(pa, nbytes);
+  trace_busy = 1;
+  void *p = realloc_dispatch(pa, nbytes);
+  trace_busy = 0;
+  if (p || nbytes == 0) trace_event(UMALLOC_TRACE_REALLOC, p, (uintptr_t)pa, nbytes);  // 失败时原对象不变，不记录
+  return p;
+}
+
+// 分配并清零 count 个 size 字节的元素。
+// 大对象和扩展堆新得到的内存来自系统，本来就是 0，只需清掉其中写过的空闲块元数据
+static void* calloc_dispatch(size_t count, size_t size) {
+  size_t nbytes;
+  if (__builtin_mul_overflow(count, size, &nbytes)) return NULL;
+  if (nbytes == 0) return NULL;
+  if (!mem.initialized) mem_init(4096, STRATEGY_BEST_FIT);
+
+  if (nbytes > mem.mmap_threshold) return large_alloc(nbytes, 0);
+
+  // 经过 slab 和线程缓存的内存都可能被用过，直接清零
+  if (nbytes <= SLAB_MAX_SIZE || tcache_class(request_block_size(nbytes)) >= 0) {
+    void *p = umalloc(nbytes);
+    if (p) memset(p, 0, nbytes);
+    return p;
+  }
+
+  struct arena *a = arena_get();
+  arena_lock(a);
+  remote_drain(a);
+  a->fresh = NULL;
+  void *p = heap_alloc(a, nbytes);
+  int fresh = p && GET_BLOCK(p) == a->fresh;
+  arena_unlock(a);
+  if (!p) return NULL;
+
+  if (fresh) {
+    // 新块只写过开头的链表指针、时间戳和末尾的脚部 (块未被分割时脚部落在有效载荷中)
+    size_t head = FREE_PAYLOAD_SIZE + sizeof(size_t);
+    size_t footer = PAYLOAD_SIZE(GET_BLOCK(p)) - sizeof(size_t);
+    memset(p, 0, nbytes < head ? nbytes : head);
+    if (footer < nbytes) memset((char*)p + footer, 0, nbytes - footer);
+  } else {
+    memset(p, 0, nbytes);
+  }
+  return p;
+}
+
+void*
+ucalloc(size_t count, size_t size) {
+  if (!TRACING()) return calloc_dispatch(count, size);
+  trace_busy = 1;
+  void *p = calloc_dispatch(count, size);
+  trace_busy = 0;
+  if (p) trace_event(UMALLOC_TRACE_CALLOC, p, 0, count * size);
+  return p;
+}
+
+// 按 alignment (2 的幂) 对齐分配
+static void* aligned_dispatch(size_t alignment, size_t nbytes) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) return NULL;
+  if (alignment <= ALIGNMENT) return umalloc(nbytes);
+  if (nbytes == 0) return NULL;
+  if (!mem.initialized) mem_init(4096, STRATEGY_BEST_FIT);
+
+  // slab 的 run 按页对齐，槽位大小是 alignment 的倍数时每个槽位都是对齐的。
+  // 超过映射阈值时 umalloc 会直接映射 (只保证 16 字节对齐)，不能走这条捷径
+  size_t rounded = (nbytes + alignment - 1) & ~(alignment - 1);
+  if (rounded <= SLAB_MAX_SIZE && rounded <= mem.mmap_threshold) return umalloc(rounded);
+
+  // 伙伴块最多按页对齐，更大的对齐要求直接映射
+  if (nbytes > mem.mmap_threshold || (mem.strategy == STRATEGY_BUDDY && alignment > mem.page_size)) return large_alloc(nbytes, alignment);
+
+  struct arena *a = arena_get();
+  arena_lock(a);
+  remote_drain(a);
+  void *p = heap_alloc_aligned(a, alignment, nbytes);
+  arena_unlock(a);
+  return p;
+}
+
+void*
+ualigned_alloc(size_t alignment, size_t nbytes) {
+  if (!TRACING()) return aligned_dispatch(alignment, nbytes);
+  trace_busy = 1;
+  void *p = aligned_dispatch(alignment, nbytes);
+  trace_busy = 0;
+  if (p) trace_event(UMALLOC_TRACE_ALIGNED, p, alignment, nbytes);
+  return p;
+}
+
+// POSIX 接口：alignment 须为 sizeof(void*) 倍数的 2 的幂，成功返回 0
+int
+uposix_memalign(void **memptr, size_t alignment, size_t nbytes) {
+  if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+  if (nbytes == 0) {
+    *memptr = NULL;
+    return 0;
+  }
+  void *p = ualigned_alloc(alignment, nbytes);
+  if (!p) return ENOMEM;
+  *memptr = p;
+  return 0;
+}
+
+
+// =================== 批量接口 ==================
+// 一次分配或释放一组对象：整批只获取一次锁，不经过线程缓存
+#define BATCH_CHUNK 64  // 批量释放时每次排序合并的块数
+
+// 按大小分发批量分配
+static size_t umalloc_batch_dispatch(size_t nbytes, size_t count, void **out) {
+  size_t n = 0;
+  if (nbytes > mem.mmap_threshold) {
+    while (n < count && (out[n] = large_alloc(nbytes, 0))) n++;
+    return n;
+  }
+
+  struct arena *a;
+  if (nbytes <= SLAB_MAX_SIZE) {
+    // 先取线程缓存中已有的槽位，其余持锁一次从 run 中取出
+    int index = SLAB_CLASS(nbytes);
+    struct slab_bin *bin = &tcache.slabs[index];
+    while (n < count && bin->head) {
+      out[n++] = bin->head;
+      bin->head = SLAB_NEXT(bin->head);
+      bin->count--;
+      slot_cache_clear(run_of(out[n - 1]), out[n - 1]);
+    }
+    if (n == count) return n;
+    a = arena_get();
+    arena_lock(a);
+    remote_drain(a);
+    while (n < count && (out[n] = slab_alloc(a, index))) n++;
+  } else {
+    a = arena_get();
+    arena_lock(a);
+    remote_drain(a);
+    n = heap_alloc_batch(a, nbytes, count, out);
+  }
+  arena_unlock(a);
+  return n;
+}
+
+// 分配 count 个 nbytes 大小的对象写入 out，返回成功分配的个数 (内存不足时可能少于 count)
+size_t
+umalloc_batch(size_t nbytes, size_t count, void **out) {
+  if (nbytes == 0 || count == 0) return 0;
+  if (!mem.initialized) mem_init(4096, STRATEGY_BEST_FIT);
+  size_t n = umalloc_batch_dispatch(nbytes, count, out);
+  thread_stat_add(&thread_stats_get()->classes[stat_class(nbytes)].allocs, n);
+  if (TRACING()) {
+    for (size_t i = 0; i < n; i++) trace_event(UMALLOC_TRACE_MALLOC, out[i], 0, nbytes);
+  }
+  return n;
+}
+
+static int batch_compare(const void *x, const void *y) {
+  uintptr_t p = (uintptr_t)*(struct mem_block* const*)x, q = (uintptr_t)*(struct mem_block* const*)y;
+  return (p > q) - (p < q);
+}
+
+// 按地址排序后把物理相邻的已分配块先拼成一个大块，每段只做一次合并和索引插入
+static void batch_coalesce(struct flush_state *st, struct mem_block **blocks, size_t count) {
+  if (count == 0) return;
+  qsort(blocks, count, sizeof(*blocks), batch_compare);
+  if (st->locked != thread_arena) {
+    if (st->locked) arena_unlock(st->locked);
+    arena_lock(thread_arena);
+    st->locked = thread_arena;
+  }
+
+  size_t i = 0;
+  while (i < count) {
+    // 拼接前逐块扣除内部碎片，拼成的大块按未申请 (applyed_size 为 0) 交给 free_block
+    struct mem_block *first = blocks[i];
+    size_t total = GET_SIZE(first);
+    thread_arena->waste -= block_waste(first);
+    first->applyed_size = 0;
+    for (i++; i < count; i++) {
+      if (blocks[i] == blocks[i - 1]) continue;  // 重复释放
+      if ((char*)blocks[i] != (char*)first + total) break;
+      thread_arena->waste -= block_waste(blocks[i]);
+      total += GET_SIZE(blocks[i]);
+      // 被拼接的块头成为空闲块内部的数据，清零后之后的重复释放 (applyed_size 为 0) 会被忽略
+      blocks[i]->size = 0;
+      blocks[i]->applyed_size = 0;
+    }
+    set_size(first, total);
+    free_block(thread_arena, first);
+  }
+}
+
+// 释放一组指针：slab 槽位和其他竞技场的块按 flush_one 归还，本竞技场的块排序后整段合并
+void
+ufree_batch(void **ptrs, size_t count) {
+  struct flush_state st = {0};
+  struct mem_block *blocks[BATCH_CHUNK];
+  size_t pending = 0;
+
+  if (TRACING()) {
+    for (size_t i = 0; i < count; i++) {
+      if (ptrs[i]) trace_event(UMALLOC_TRACE_FREE, ptrs[i], 0, 0);
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    void *ptr = ptrs[i];
+    if (!ptr) continue;
+
+    struct run *run = run_of(ptr);
+    if (run) {
+      if (slab_is_free(run, ptr)) continue;
+      CLASS_STAT(frees, SLAB_SLOT_SIZE(run->class_index));
+      flush_one(&st, run->arena, ptr);
+      continue;
+    }
+
+    struct mem_block *block = GET_BLOCK(ptr);
+    if (IS_FREE(block) || block->applyed_size == 0) continue;  // 重复释放或已在缓存中
+    CLASS_STAT(frees, PAYLOAD_SIZE(block));
+    if (IS_MMAPPED(block)) {
+      flush_done(&st);  // large_free 会获取竞技场的锁
+      st = (struct flush_state){0};
+      large_free(block);
+      continue;
+    }
+
+    struct arena *a = arena_of(block);
+    if (is_remote(a)) {
+      block_set_applyed(block, 0);
+      flush_one(&st, a, ptr);
+      continue;
+    }
+    blocks[pending++] = block;
+    if (pending == BATCH_CHUNK) {
+      batch_coalesce(&st, blocks, pending);
+      pending = 0;
+    }
+  }
+  batch_coalesce(&st, blocks, pending);
+  flush_done(&st);
+}
+
+
+// =================== 私有堆 ==================
+// uheap_create 创建的私有堆是一个不参与线程轮转的竞技场，有自己的分配策略。
+// 分配和释放都持堆的锁直接操作空闲索引，不经过 slab、线程缓存和大对象映射，
+// 因此堆中的对象全部位于它的堆区域内，重置时只需把每个区域恢复成一个空闲块，与对象个数无关。
+// 堆句柄为 NULL 时表示默认堆，即 umalloc/ufree 使用的共享竞技场
+
+// 创建私有堆，预先提交 initial_size 字节；策略无效或内存不足时返回 NULL
+uheap_t*
+uheap_create(size_t initial_size, allocation_strategy strategy) {
+  if (strategy != STRATEGY_BEST_FIT && strategy != STRATEGY_QUICK_FIT && strategy != STRATEGY_TLSF && strategy != STRATEGY_BUDDY) return NULL;
+  if (!mem.initialized) mem_init(4096, STRATEGY_BEST_FIT);
+
+  size_t heap_size = PAGE_ALIGN(initial_size);
+  if (heap_size < region_overhead(strategy) + MIN_BLOCK_SIZE) heap_size = PAGE_ALIGN(region_overhead(strategy) + MIN_BLOCK_SIZE);
+  struct arena *h = arena_create(HEAP_INDEX, strategy, heap_size);
+  if (!h) return NULL;
+
+  pthread_mutex_lock(&mem.lock);
+  h->heap_next = mem.heaps;
+  if (mem.heaps) mem.heaps->heap_prev = h;
+  mem.heaps = h;
+  pthread_mutex_unlock(&mem.lock);
+  return h;
+}
+
+void*
+uheap_alloc(uheap_t *heap, size_t nbytes) {
+  if (!heap) return umalloc(nbytes);
+  if (nbytes == 0) return NULL;
+  CLASS_STAT(allocs, nbytes);
+  arena_lock(heap);
+  void *p = heap_alloc(heap, nbytes);
+  arena_unlock(heap);
+  return p;
+}
+
+// 释放私有堆中的对象。私有堆的对象不能交给 ufree (会进入线程缓存，重置或销毁堆后缓存中留下悬空的块)
+void
+uheap_free(uheap_t *heap, void *ptr) {
+  if (!heap) {
+    ufree(ptr);
+    return;
+  }
+  if (ptr == 0) return;
+  struct mem_block *block = GET_BLOCK(ptr);
+  if (IS_FREE(block) || block->applyed_size == 0) return;  // 重复释放 (包括在延迟合并链表中或已被合并的块)
+  CLASS_STAT(frees, PAYLOAD_SIZE(block));
+  arena_lock(heap);
+  free_block(heap, block);
+  arena_unlock(heap);
+}
+
+// 一次性释放私有堆中的全部对象，保留已提交的内存供之后的分配使用。
+// 不逐个访问对象：清空空闲索引后把每个区域重建为一个空闲块，耗时与区域个数成正比，与对象个数无关
+void
+uheap_reset(uheap_t *heap) {
+  if (!heap) return;
+  arena_lock(heap);
+  if (heap->strategy == STRATEGY_QUICK_FIT) {
+    init_quick_lists(heap);
+  } else if (heap->strategy == STRATEGY_TLSF) {
+    init_tlsf(heap);
+  } else if (heap->strategy == STRATEGY_BUDDY) {
+    init_buddy(heap);
+  } else if (heap->strategy == STRATEGY_BEST_FIT) {
+    heap->best_fit_root = NULL;
+  }
+  heap->free_count = 0;
+  heap->largest_free = 0;
+  heap->largest_dirty = 0;
+  heap->used_memory = 0;
+  heap->waste = 0;
+  heap->purged_memory = 0;  // 重建的空闲块不带 BLOCK_PURGED，其中已归还的页之后按未归还处理
+  heap->fresh = NULL;
+  for (struct heap_region *r = heap->regions; r; r = r->next) {
+    struct mem_block *first = region_first_free(heap, r);
+    REGION_EPILOGUE(r)->size = 0;
+    first->size = r->size - region_overhead(heap->strategy);
+    first->applyed_size = 0;
+    mark_free(first);
+    free_index_insert(heap, first);
+  }
+  arena_unlock(heap);
+}
+
+// 销毁私有堆，归还它的全部内存
+void
+uheap_destroy(uheap_t *heap) {
+  if (!heap) return;
+  pthread_mutex_lock(&mem.lock);
+  if (heap->heap_prev) heap->heap_prev->heap_next = heap->heap_next;
+  else mem.heaps = heap->heap_next;
+  if (heap->heap_next) heap->heap_next->heap_prev = heap->heap_prev;
+  pthread_mutex_unlock(&mem.lock);
+
+  struct heap_region *r = heap->regions;
+  while (r) {
+    struct heap_region *next = r->next;
+    for (size_t i = 0; i < r->reserved >> REGION_SHIFT; i++) {
+      region_map[((uintptr_t)r >> REGION_SHIFT) + i] = NULL;
+    }
+    munmap(r, r->reserved);
+    r = next;
+  }
+  pthread_mutex_destroy(&heap->lock);
+  munmap(heap, PAGE_ALIGN(sizeof(struct arena)));
 }
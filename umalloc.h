@@ -8,29 +8,171 @@
 // 内存分配策略枚举
 typedef enum {
     STRATEGY_BEST_FIT = 0,
-    STRATEGY_QUICK_FIT = 1
+    STRATEGY_QUICK_FIT = 1,
+    STRATEGY_TLSF = 2,  // 两级分离适配 (Two-Level Segregated Fit)，查找、分割、合并均为 O(1)
+    STRATEGY_BUDDY = 3  // 二进制伙伴系统，块大小为 2 的幂，伙伴地址由异或求出
 } allocation_strategy;
 
-// 内存块结构
+// 内存块结构 (边界标记格式)
+// 每个块只有 16 字节的头部，块大小与状态标志打包在 size 中。
+// 空闲块的链表/树指针存放在有效载荷中，并在块尾写入脚部 (footer, 即块大小)，
+// 物理相邻的块通过地址运算找到：后一块 = 块地址 + 块大小，前一块 = 块地址 - 前一块的脚部。
 struct mem_block {
-  size_t size;
-  int is_free;
-  size_t applyed_size;
-  
-  // 用于快速适配桶的双向链表
-  struct mem_block *prev;  // 在quick_lists中的前驱
-  struct mem_block *next;  // 在quick_lists中的后继
-  
-  // 用于全局地址排序的双向链表
-  struct mem_block *prev_global;  // 在globallist中的前驱
-  struct mem_block *next_global;  // 在globallist中的后继
+  size_t size;  // 块总大小 (含头部)，16 字节对齐，低 4 位为标志位
+  size_t applyed_size;  // 用户申请的大小
 };
 
+// 可调参数，通过 umallopt 设置
+typedef enum {
+    UMALLOC_OPT_MMAP_THRESHOLD = 0,  // 大于该大小的申请直接用独立的 mmap 映射满足 (默认 128 KB)
+    UMALLOC_OPT_DECAY_MS = 1,  // 空闲页至少空闲这么久 (毫秒) 才会被后台线程归还系统 (默认 10000)
+    UMALLOC_OPT_BACKGROUND_THREAD = 2,  // 1 启动后台回收线程，0 停止 (默认不启动)
+    UMALLOC_OPT_PURGE_LAZY = 3,  // 1 使用 MADV_FREE 惰性归还，0 使用 MADV_DONTNEED 立即归还 (默认 0)
+    UMALLOC_OPT_ARENAS = 4,  // 竞技场数量上限，1 ~ 256 (默认为在线 CPU 数的 4 倍)
+    UMALLOC_OPT_CHECK_SIZED = 5,  // 1 时 ufree_sized 核对传入的大小，不符则报错退出 (默认 0)
+    UMALLOC_OPT_PROFILE = 6,  // umalloc/ufree 耗时直方图的抽样周期：每个线程每 N 次调用计时一次，0 关闭 (默认 64)
+    UMALLOC_OPT_DEFER_COALESCE = 7,  // 快速适配延迟合并：释放的小块 (4 KB 以下) 不与相邻块合并，分配未命中或延迟的字节数
+                                     // 超过堆的该百分比时批量合并，1 ~ 100，0 关闭 (默认 0)
+    UMALLOC_OPT_PERCPU_CACHE = 8,  // 1 用按 CPU 划分的缓存代替线程缓存 (x86-64 上使用 restartable sequences)，
+                                   // 缓存的内存只随 CPU 数增长；0 关闭并归还所有 CPU 缓存 (默认 0)
+    UMALLOC_OPT_HUGEPAGE = 9  // 1 堆区域使用 2 MB 透明大页 (madvise(MADV_HUGEPAGE)，提交按大页对齐)，0 关闭 (默认 0)
+} umalloc_option;
+
+// 堆统计，由 umalloc_get_stats 填写
+struct umalloc_stats {
+    size_t total_bytes;  // 向系统申请的内存总量 (堆区域、slab run 和大对象映射)
+    size_t used_bytes;  // 已分配的字节数 (含块头，线程缓存中的块也算已分配)
+    size_t free_bytes;  // 空闲块总字节数
+    size_t free_blocks;  // 空闲块个数
+    size_t largest_free;  // 最大空闲块
+    size_t internal_waste;  // 已分配块中未被申请的有效载荷字节数 (slab 槽位不计)
+    size_t committed_bytes;  // 堆区域和 slab run 已提交的字节数
+    size_t purged_bytes;  // 其中已归还系统、不再驻留的字节数
+    size_t trimmed_bytes;  // 从堆尾归还的累计字节数
+    size_t grow_count;  // 堆扩展次数
+    size_t mmapped_bytes;  // 大对象映射的字节数
+    size_t mmapped_count;  // 大对象个数
+    size_t slab_bytes;  // slab run 已提交的字节数
+    size_t slab_runs;  // 已建立的 run 数
+    size_t remote_drained;  // 回收的远程释放累计个数
+    size_t deferred_blocks;  // 等待合并的块数 (UMALLOC_OPT_DEFER_COALESCE)，计入 free_bytes 但不计入 free_blocks
+    size_t deferred_bytes;
+    size_t coalesce_passes;  // 批量合并的累计次数
+    size_t coalesce_merges;  // 其中与相邻空闲块合并的累计次数
+    size_t coalesce_ns;  // 批量合并的累计耗时
+    unsigned int arena_count;  // 已创建的竞技场数
+    unsigned int arena_limit;  // 竞技场数量上限
+    unsigned int cpu_caches;  // CPU 缓存的个数 (UMALLOC_OPT_PERCPU_CACHE 关闭时为 0)
+    unsigned int cpu_cache_rseq;  // CPU 缓存使用 restartable sequences 时为 1，使用 sched_getcpu 与原子操作时为 0
+};
+
+// 操作计数与耗时直方图，由 umalloc_get_profile 填写
+#define UMALLOC_STAT_CLASSES 48  // 第 i 级统计大小在 [2^i, 2^(i+1)) 字节的对象
+#define UMALLOC_HIST_BUCKETS 64  // 第 i 桶统计耗时在 [2^i, 2^(i+1)) 个计时单位的操作
+
+struct umalloc_class_stats {
+    size_t allocs;  // 分配次数 (按申请大小)
+    size_t frees;  // 释放次数 (按对象大小)
+    size_t splits;  // 分割空闲块的次数 (按被分割的块大小)
+    size_t coalesces;  // 与相邻空闲块合并的次数 (按释放的块大小)
+    size_t extends;  // 扩展堆的次数 (按所需的块大小)
+    size_t scans;  // 快速适配在范围桶中逐个检查的块数 (按所需的块大小)
+};
+
+struct umalloc_profile {
+    struct umalloc_class_stats classes[UMALLOC_STAT_CLASSES];
+    size_t malloc_latency[UMALLOC_HIST_BUCKETS];  // umalloc 的耗时直方图 (抽样)
+    size_t free_latency[UMALLOC_HIST_BUCKETS];  // ufree 的耗时直方图 (抽样)
+    double tick_ns;  // 一个计时单位对应的纳秒数
+};
+
+// 分配记录，由 umalloc_trace_start 开启。文件以 struct umalloc_trace_header 开头，之后是各线程成批写入的事件，
+// 不同线程的批次交错出现，按 time 排序即得全局顺序
+#define UMALLOC_TRACE_MAGIC 0x3145434152544d55ULL  // "UMTRACE1"
+
+enum {
+    UMALLOC_TRACE_MALLOC = 0,  // umalloc / umalloc_batch 的每个对象
+    UMALLOC_TRACE_FREE = 1,  // ufree / ufree_sized / ufree_batch 的每个对象
+    UMALLOC_TRACE_REALLOC = 2,
+    UMALLOC_TRACE_CALLOC = 3,
+    UMALLOC_TRACE_ALIGNED = 4  // ualigned_alloc / uposix_memalign
+};
+
+struct umalloc_trace_header {
+    uint64_t magic;
+    uint32_t event_size;  // sizeof(struct umalloc_trace_event)
+    uint32_t reserved;
+};
+
+struct umalloc_trace_event {
+    uint64_t time;  // 单调时钟纳秒：分配在返回后读取，释放在释放前读取，同一地址的释放总排在再次分配之前
+    uint64_t ptr;  // 对象地址：分配的结果、释放的参数、realloc 的新地址
+    uint64_t aux;  // realloc 的原地址，对齐分配的对齐值
+    uint64_t size;  // 申请的字节数 (calloc 为 count * size，ufree_sized 为传入的大小)
+    uint32_t thread;  // 线程编号，从 1 开始
+    uint32_t op;  // UMALLOC_TRACE_*
+};
+
+// 堆布局快照，由 umalloc_heap_map 导出。二进制格式为 header，之后每个区域记录后紧跟它的 block_count 个块记录，
+// 块按地址顺序排列，第一个块从 start 开始，后一个块紧接前一个块
+#define UMALLOC_MAP_MAGIC 0x314d504145484d55ULL  // "UMHEAPM1"
+
+typedef enum {
+    UMALLOC_MAP_BINARY = 0,
+    UMALLOC_MAP_JSON = 1
+} umalloc_map_format;
+
+struct umalloc_map_header {
+    uint64_t magic;
+    uint32_t region_count;
+    uint32_t reserved;
+};
+
+struct umalloc_map_region {
+    uint64_t start;  // 第一个块的地址
+    uint64_t size;  // 所有块的总字节数
+    uint64_t block_count;
+    uint32_t arena;  // 竞技场下标，私有堆从 256 起依次编号
+    uint32_t reserved;
+};
+
+struct umalloc_map_block {
+    uint64_t size;  // 块大小 (含头部)，低 4 位为标志：0x1 空闲，0x8 空闲页已归还系统
+    uint64_t requested;  // 已分配块的申请大小，空闲块和线程缓存中的块为 0
+};
+
+// 私有堆句柄，由 uheap_create 创建；NULL 表示 umalloc/ufree 使用的默认堆
+typedef struct arena uheap_t;
+
 // 接口声明
 void mem_init(size_t heap_size, allocation_strategy strategy);
+int umallopt(umalloc_option option, size_t value);
+void umalloc_purge(void);
+int umalloc_prefault(size_t nbytes);  // 预热所有已创建的竞技场 (不含私有堆)，nbytes 的连续空闲堆建在调用线程的竞技场中
 void* umalloc(size_t nbytes);
 void ufree(void *ptr);
+void ufree_sized(void *ptr, size_t nbytes);
+void* urealloc(void *ptr, size_t nbytes);
+void* ucalloc(size_t count, size_t size);
+void* ualigned_alloc(size_t alignment, size_t nbytes);
+int uposix_memalign(void **memptr, size_t alignment, size_t nbytes);
+size_t umalloc_usable_size(void *ptr);
+size_t umalloc_batch(size_t nbytes, size_t count, void **out);
+void ufree_batch(void **ptrs, size_t count);
+void umalloc_get_stats(struct umalloc_stats *stats);
+size_t umalloc_hugepage_bytes(void);
 void fragmentation_stats(void);
+void umalloc_get_profile(struct umalloc_profile *profile);
+void profile_stats(void);
+uheap_t* uheap_create(size_t initial_size, allocation_strategy strategy);
+void* uheap_alloc(uheap_t *heap, size_t nbytes);
+void uheap_free(uheap_t *heap, void *ptr);
+void uheap_reset(uheap_t *heap);
+void uheap_destroy(uheap_t *heap);
+int umalloc_trace_start(const char *path);
+void umalloc_trace_stop(void);
 void visualize_memory(void);
+void visualize_heap(unsigned int rows, unsigned int columns);
+int umalloc_heap_map(const char *path, umalloc_map_format format);
 
 #endif
\ No newline at end of file
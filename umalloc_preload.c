@@ -0,0 +1,251 @@
+// umalloc_preload.c
+// 以标准 malloc 接口导出 umalloc，编译为 libumalloc.so 后通过 LD_PRELOAD 替换程序的分配器：
+//   LD_PRELOAD=./libumalloc.so UMALLOC_STRATEGY=quick_fit <程序>
+// 环境变量：
+//   UMALLOC_STRATEGY  分配策略 best_fit (默认)、quick_fit、tlsf 或 buddy
+//   UMALLOC_TRACE     把分配记录写入该文件，进程退出时写出 (见 umalloc_trace_start)
+//   UMALLOC_PERCPU_CACHE  为 1 时用按 CPU 划分的缓存代替线程缓存 (见 UMALLOC_OPT_PERCPU_CACHE)
+//   UMALLOC_HUGEPAGE  为 1 时堆使用透明大页 (见 UMALLOC_OPT_HUGEPAGE)
+//   UMALLOC_PREFAULT  启动时预热的堆大小 (字节，可带 K/M/G 后缀，见 umalloc_prefault)
+
+#define _GNU_SOURCE
+#include "umalloc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define EXPORT __attribute__((visibility("default")))
+
+// ==================== 自举 ====================
+// 初始化过程中 (pthread_atfork 等) 的分配会重入 malloc，这时从静态缓冲区顺序分配。
+// 自举分配的对象从不回收，每个对象前 16 字节记录大小
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrap_used;
+static int initialized;
+static __thread int initializing;
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static int is_bootstrap(void *ptr) {
+  return (char*)ptr >= bootstrap && (char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static void* bootstrap_alloc(size_t alignment, size_t nbytes) {
+  if (alignment < 16) alignment = 16;
+  size_t used = __atomic_load_n(&bootstrap_used, __ATOMIC_RELAXED), start;
+  do {
+    start = (used + 16 + alignment - 1) & ~(alignment - 1);
+    if (nbytes > BOOTSTRAP_SIZE || start + nbytes > BOOTSTRAP_SIZE) {
+      errno = ENOMEM;
+      return NULL;
+    }
+  } while (!__atomic_compare_exchange_n(&bootstrap_used, &used, (start + nbytes + 15) & ~(size_t)15, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+  *(size_t*)(bootstrap + start - 16) = nbytes;
+  return bootstrap + start;  // 静态缓冲区本来就是 0，calloc 不需要清零
+}
+
+static size_t bootstrap_size(void *ptr) {
+  return *(size_t*)((char*)ptr - 16);
+}
+
+static void preload_setup(void) {
+  allocation_strategy strategy = STRATEGY_BEST_FIT;
+  const char *name = getenv("UMALLOC_STRATEGY");
+  if (name && strcmp(name, "quick_fit") == 0) strategy = STRATEGY_QUICK_FIT;
+  else if (name && strcmp(name, "tlsf") == 0) strategy = STRATEGY_TLSF;
+  else if (name && strcmp(name, "buddy") == 0) strategy = STRATEGY_BUDDY;
+  mem_init(4096, strategy);
+
+  const char *percpu = getenv("UMALLOC_PERCPU_CACHE");
+  if (percpu && atoi(percpu)) umallopt(UMALLOC_OPT_PERCPU_CACHE, 1);
+  const char *hugepage = getenv("UMALLOC_HUGEPAGE");
+  if (hugepage && atoi(hugepage)) umallopt(UMALLOC_OPT_HUGEPAGE, 1);
+  const char *prefault = getenv("UMALLOC_PREFAULT");
+  if (prefault && *prefault) {
+    char *unit;
+    size_t nbytes = strtoull(prefault, &unit, 10);
+    if (*unit == 'K' || *unit == 'k') nbytes <<= 10;
+    else if (*unit == 'M' || *unit == 'm') nbytes <<= 20;
+    else if (*unit == 'G' || *unit == 'g') nbytes <<= 30;
+    umalloc_prefault(nbytes);
+  }
+
+  const char *trace = getenv("UMALLOC_TRACE");
+  if (trace && *trace) umalloc_trace_start(trace);
+  __atomic_store_n(&initialized, 1, __ATOMIC_RELEASE);
+}
+
+// 确保已初始化；当前线程正在初始化 (重入) 时返回 0，调用者改用自举分配
+static inline int preload_ready(void) {
+  if (__builtin_expect(__atomic_load_n(&initialized, __ATOMIC_ACQUIRE), 1)) return 1;
+  if (initializing) return 0;
+  initializing = 1;
+  pthread_once(&init_once, preload_setup);
+  initializing = 0;
+  return 1;
+}
+
+// 进程退出时写出分配记录
+__attribute__((destructor)) static void preload_exit(void) {
+  umalloc_trace_stop();
+}
+
+
+// ==================== C 接口 ====================
+// umalloc 对 0 字节的申请返回 NULL，而 malloc(0) 应返回可以释放的唯一指针，因此至少申请 1 字节
+EXPORT void*
+malloc(size_t nbytes) {
+  if (!preload_ready()) return bootstrap_alloc(16, nbytes);
+  void *p = umalloc(nbytes ? nbytes : 1);
+  if (!p) errno = ENOMEM;
+  return p;
+}
+
+EXPORT void
+free(void *ptr) {
+  if (ptr == NULL || is_bootstrap(ptr)) return;
+  ufree(ptr);
+}
+
+EXPORT void*
+calloc(size_t count, size_t size) {
+  size_t nbytes;
+  if (__builtin_mul_overflow(count, size, &nbytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  if (!preload_ready()) return bootstrap_alloc(16, nbytes);
+  void *p = ucalloc(1, nbytes ? nbytes : 1);
+  if (!p) errno = ENOMEM;
+  return p;
+}
+
+EXPORT void*
+realloc(void *ptr, size_t nbytes) {
+  if (ptr && is_bootstrap(ptr)) {
+    // 自举对象不能交给 urealloc，复制到新对象
+    void *p = malloc(nbytes);
+    if (p) {
+      size_t old = bootstrap_size(ptr);
+      memcpy(p, ptr, old < nbytes ? old : nbytes);
+    }
+    return p;
+  }
+  if (!ptr) return malloc(nbytes);
+  if (nbytes == 0) {
+    ufree(ptr);
+    return NULL;
+  }
+  void *p = urealloc(ptr, nbytes);
+  if (!p) errno = ENOMEM;
+  return p;
+}
+
+EXPORT void*
+reallocarray(void *ptr, size_t count, size_t size) {
+  size_t nbytes;
+  if (__builtin_mul_overflow(count, size, &nbytes)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(ptr, nbytes);
+}
+
+EXPORT int
+posix_memalign(void **memptr, size_t alignment, size_t nbytes) {
+  if (!preload_ready()) {
+    if (alignment == 0 || alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) return EINVAL;
+    void *p = bootstrap_alloc(alignment, nbytes);
+    if (!p) return ENOMEM;
+    *memptr = p;
+    return 0;
+  }
+  return uposix_memalign(memptr, alignment, nbytes ? nbytes : 1);
+}
+
+EXPORT void*
+aligned_alloc(size_t alignment, size_t nbytes) {
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (!preload_ready()) return bootstrap_alloc(alignment, nbytes);
+  void *p = ualigned_alloc(alignment, nbytes ? nbytes : 1);
+  if (!p) errno = ENOMEM;
+  return p;
+}
+
+// 旧接口：alignment 不是 2 的幂时向上取整
+EXPORT void*
+memalign(size_t alignment, size_t nbytes) {
+  if (alignment & (alignment - 1)) alignment = (size_t)1 << (64 - __builtin_clzl(alignment));
+  return aligned_alloc(alignment ? alignment : 1, nbytes);
+}
+
+EXPORT void*
+valloc(size_t nbytes) {
+  return aligned_alloc(sysconf(_SC_PAGESIZE), nbytes);
+}
+
+EXPORT void*
+pvalloc(size_t nbytes) {
+  size_t page = sysconf(_SC_PAGESIZE);
+  return aligned_alloc(page, (nbytes + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t
+malloc_usable_size(void *ptr) {
+  if (ptr && is_bootstrap(ptr)) return bootstrap_size(ptr);
+  return umalloc_usable_size(ptr);
+}
+
+
+// ==================== C++ 接口 ====================
+// operator new/delete 的 Itanium ABI 符号 (size_t 为 unsigned long)。
+// C 里无法抛出 std::bad_alloc，分配失败时报错退出；nothrow 版本返回 NULL。
+// 带大小的 delete 走 ufree_sized，省去查找块头；对齐版本的块不保证与申请大小一致，仍走 ufree
+static void* new_or_die(size_t alignment, size_t nbytes) {
+  void *p = alignment ? aligned_alloc(alignment, nbytes) : malloc(nbytes);
+  if (!p) {
+    fprintf(stderr, "umalloc: operator new(%zu) failed: out of memory\n", nbytes);
+    abort();
+  }
+  return p;
+}
+
+static void sized_delete(void *ptr, size_t nbytes) {
+  if (ptr == NULL || is_bootstrap(ptr)) return;
+  ufree_sized(ptr, nbytes ? nbytes : 1);
+}
+
+// operator new(size_t) / new[](size_t)
+EXPORT void* _Znwm(size_t n) { return new_or_die(0, n); }
+EXPORT void* _Znam(size_t n) { return new_or_die(0, n); }
+// operator new(size_t, const std::nothrow_t&) / new[]
+EXPORT void* _ZnwmRKSt9nothrow_t(size_t n, const void *tag) { (void)tag; return malloc(n); }
+EXPORT void* _ZnamRKSt9nothrow_t(size_t n, const void *tag) { (void)tag; return malloc(n); }
+// operator new(size_t, std::align_val_t) / new[]，以及 nothrow 版本
+EXPORT void* _ZnwmSt11align_val_t(size_t n, size_t al) { return new_or_die(al, n); }
+EXPORT void* _ZnamSt11align_val_t(size_t n, size_t al) { return new_or_die(al, n); }
+EXPORT void* _ZnwmSt11align_val_tRKSt9nothrow_t(size_t n, size_t al, const void *tag) { (void)tag; return aligned_alloc(al, n); }
+EXPORT void* _ZnamSt11align_val_tRKSt9nothrow_t(size_t n, size_t al, const void *tag) { (void)tag; return aligned_alloc(al, n); }
+
+// operator delete(void*) / delete[]，以及 nothrow 版本
+EXPORT void _ZdlPv(void *p) { free(p); }
+EXPORT void _ZdaPv(void *p) { free(p); }
+EXPORT void _ZdlPvRKSt9nothrow_t(void *p, const void *tag) { (void)tag; free(p); }
+EXPORT void _ZdaPvRKSt9nothrow_t(void *p, const void *tag) { (void)tag; free(p); }
+// operator delete(void*, size_t) / delete[]
+EXPORT void _ZdlPvm(void *p, size_t n) { sized_delete(p, n); }
+EXPORT void _ZdaPvm(void *p, size_t n) { sized_delete(p, n); }
+// operator delete(void*, std::align_val_t) 及带大小、nothrow 的版本
+EXPORT void _ZdlPvSt11align_val_t(void *p, size_t al) { (void)al; free(p); }
+EXPORT void _ZdaPvSt11align_val_t(void *p, size_t al) { (void)al; free(p); }
+EXPORT void _ZdlPvmSt11align_val_t(void *p, size_t n, size_t al) { (void)n; (void)al; free(p); }
+EXPORT void _ZdaPvmSt11align_val_t(void *p, size_t n, size_t al) { (void)n; (void)al; free(p); }
+EXPORT void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *p, size_t al, const void *tag) { (void)al; (void)tag; free(p); }
+EXPORT void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *p, size_t al, const void *tag) { (void)al; (void)tag; free(p); }